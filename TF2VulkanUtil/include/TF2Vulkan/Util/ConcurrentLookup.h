@@ -0,0 +1,288 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace Util
+{
+	// Open addressing hash map for caches that are read far more
+	// often than they are written. Find() never locks. Everything else (FindOrInsert, Erase,
+	// Clear, ForEach) must be serialized by the caller, and Erase() and Clear()
+	// additionally require that no readers are active. Values never move once inserted.
+	template<typename TKey, typename TValue, typename THash = std::hash<TKey>>
+	class ConcurrentLookupMap final
+	{
+		struct Node;
+
+	public:
+		ConcurrentLookupMap() = default;
+		ConcurrentLookupMap(const ConcurrentLookupMap&) = delete;
+		ConcurrentLookupMap& operator=(const ConcurrentLookupMap&) = delete;
+
+		TValue* Find(const TKey& key) const { return Find(key, THash{}(key)); }
+		TValue* Find(const TKey& key, size_t hash) const
+		{
+			const Table* table = m_Table.load(std::memory_order_acquire);
+			if (!table)
+				return nullptr;
+
+			for (size_t i = hash & table->m_Mask; ; i = (i + 1) & table->m_Mask)
+			{
+				Node* node = table->m_Slots[i].load(std::memory_order_acquire);
+				if (!node)
+					return nullptr;
+
+				// Collisions are rejected without touching the node
+				if (table->m_Hashes[i] == hash && node->m_Key == key)
+					return &node->m_Value;
+			}
+		}
+
+		// create() is only called on a miss. finalize(key, value) is called once the
+		// value is at its final address, before it becomes visible to readers.
+		template<typename TCreate, typename TFinalize>
+		TValue& FindOrInsert(const TKey& key, TCreate&& create, TFinalize&& finalize)
+		{
+			const size_t hash = THash{}(key);
+			if (auto found = Find(key, hash))
+				return *found;
+
+			Node& node = *m_Nodes.emplace_back(std::make_unique<Node>(hash, key, create));
+			node.m_Index = m_Nodes.size() - 1;
+			try
+			{
+				finalize(std::as_const(node.m_Key), node.m_Value);
+			}
+			catch (...)
+			{
+				m_Nodes.pop_back();
+				throw;
+			}
+
+			Publish(node);
+			return node.m_Value;
+		}
+		template<typename TCreate>
+		TValue& FindOrInsert(const TKey& key, TCreate&& create)
+		{
+			return FindOrInsert(key, std::forward<TCreate>(create), [](const TKey&, TValue&) {});
+		}
+
+		// Returns false if key wasn't in the map. key may refer to the entry's own
+		// key, it isn't used again once the entry is destroyed.
+		bool Erase(const TKey& key)
+		{
+			if (m_Tables.empty())
+				return false;
+
+			// Nobody can still be probing the tables that were outgrown
+			m_Tables.erase(m_Tables.begin(), m_Tables.end() - 1);
+			Table& table = *m_Tables.back();
+
+			const size_t hash = THash{}(key);
+			for (size_t i = hash & table.m_Mask; ; i = (i + 1) & table.m_Mask)
+			{
+				Node* node = table.m_Slots[i].load(std::memory_order_relaxed);
+				if (!node)
+					return false;
+
+				if (table.m_Hashes[i] != hash || !(node->m_Key == key))
+					continue;
+
+				table.Remove(i);
+
+				// Swap with the last node, which keeps its address
+				const size_t index = node->m_Index;
+				if (index != m_Nodes.size() - 1)
+				{
+					std::swap(m_Nodes[index], m_Nodes.back());
+					m_Nodes[index]->m_Index = index;
+				}
+				m_Nodes.pop_back();
+
+				m_Size.store(size() - 1, std::memory_order_release);
+				return true;
+			}
+		}
+
+		size_t size() const { return m_Size.load(std::memory_order_acquire); }
+		bool empty() const { return size() == 0; }
+
+		template<typename TFunc> void ForEach(TFunc&& func)
+		{
+			for (auto& node : m_Nodes)
+				func(std::as_const(node->m_Key), node->m_Value);
+		}
+		template<typename TFunc> void ForEach(TFunc&& func) const
+		{
+			for (const auto& node : m_Nodes)
+				func(std::as_const(node->m_Key), std::as_const(node->m_Value));
+		}
+
+		void Clear()
+		{
+			m_Table.store(nullptr, std::memory_order_release);
+			m_Size.store(0, std::memory_order_release);
+			m_Tables.clear();
+			m_Nodes.clear();
+		}
+
+	private:
+		struct Node final
+		{
+			template<typename TCreate>
+			Node(size_t hash, const TKey& key, TCreate& create) :
+				m_Hash(hash), m_Key(key), m_Value(create())
+			{
+			}
+
+			size_t m_Hash;
+			size_t m_Index = 0; // In m_Nodes
+			TKey m_Key;
+			TValue m_Value;
+		};
+
+		struct Table final
+		{
+			explicit Table(size_t capacity) :
+				m_Mask(capacity - 1),
+				m_Hashes(std::make_unique<size_t[]>(capacity)),
+				m_Slots(std::make_unique<std::atomic<Node*>[]>(capacity))
+			{
+				assert((capacity & m_Mask) == 0);
+				for (size_t i = 0; i < capacity; i++)
+					m_Slots[i].store(nullptr, std::memory_order_relaxed);
+			}
+
+			void Insert(Node& node)
+			{
+				size_t i = node.m_Hash & m_Mask;
+				while (m_Slots[i].load(std::memory_order_relaxed))
+					i = (i + 1) & m_Mask;
+
+				// Only rewritten by Remove(), with no readers around, so it doesn't need to be atomic
+				m_Hashes[i] = node.m_Hash;
+				m_Slots[i].store(&node, std::memory_order_release);
+			}
+
+			// Backward shift deletion, so lookups never need tombstones. Only
+			// safe with no readers active.
+			void Remove(size_t hole)
+			{
+				for (size_t i = (hole + 1) & m_Mask; ; i = (i + 1) & m_Mask)
+				{
+					Node* node = m_Slots[i].load(std::memory_order_relaxed);
+					if (!node)
+						break;
+
+					// Entries can only move back as far as the slot they hash to
+					const size_t home = m_Hashes[i] & m_Mask;
+					if (((i - home) & m_Mask) >= ((i - hole) & m_Mask))
+					{
+						m_Hashes[hole] = m_Hashes[i];
+						m_Slots[hole].store(node, std::memory_order_relaxed);
+						hole = i;
+					}
+				}
+
+				m_Slots[hole].store(nullptr, std::memory_order_relaxed);
+			}
+
+			size_t m_Mask;
+			std::unique_ptr<size_t[]> m_Hashes;
+			std::unique_ptr<std::atomic<Node*>[]> m_Slots;
+		};
+
+		void Publish(Node& node)
+		{
+			const size_t newSize = size() + 1;
+			Table* table = m_Tables.empty() ? nullptr : m_Tables.back().get();
+
+			// Keep the load factor at or below 1/2. Readers may still be probing the
+			// old table, so it stays alive until Erase() or Clear().
+			if (!table || newSize * 2 > table->m_Mask + 1)
+			{
+				const size_t capacity = table ? (table->m_Mask + 1) * 2 : 16;
+				table = m_Tables.emplace_back(std::make_unique<Table>(capacity)).get();
+
+				for (auto& existing : m_Nodes)
+				{
+					if (existing.get() != &node)
+						table->Insert(*existing);
+				}
+
+				table->Insert(node);
+				m_Table.store(table, std::memory_order_release);
+			}
+			else
+			{
+				table->Insert(node);
+			}
+
+			m_Size.store(newSize, std::memory_order_release);
+		}
+
+		std::atomic<const Table*> m_Table = nullptr;
+		std::atomic<size_t> m_Size = 0;
+		std::vector<std::unique_ptr<Table>> m_Tables;
+		std::vector<std::unique_ptr<Node>> m_Nodes;
+	};
+
+	// Append-only array with lock-free indexed reads. push_back must be
+	// serialized by the caller. Elements never move.
+	template<typename T, size_t CHUNK_SIZE = 1024, size_t MAX_CHUNKS = 1024>
+	class ConcurrentAppendVector final
+	{
+	public:
+		ConcurrentAppendVector()
+		{
+			for (auto& chunk : m_Chunks)
+				chunk.store(nullptr, std::memory_order_relaxed);
+		}
+		ConcurrentAppendVector(const ConcurrentAppendVector&) = delete;
+		ConcurrentAppendVector& operator=(const ConcurrentAppendVector&) = delete;
+
+		size_t size() const { return m_Size.load(std::memory_order_acquire); }
+
+		const T& operator[](size_t index) const
+		{
+			assert(index < size());
+			return m_Chunks[index / CHUNK_SIZE].load(std::memory_order_acquire)[index % CHUNK_SIZE];
+		}
+		const T& at(size_t index) const
+		{
+			if (index >= size())
+				throw std::out_of_range("Index out of range");
+
+			return (*this)[index];
+		}
+
+		void push_back(T value)
+		{
+			const size_t index = m_Size.load(std::memory_order_relaxed);
+			const size_t chunkIndex = index / CHUNK_SIZE;
+			if (chunkIndex >= MAX_CHUNKS)
+				throw std::length_error("ConcurrentAppendVector is full");
+
+			T* chunk = m_Chunks[chunkIndex].load(std::memory_order_relaxed);
+			if (!chunk)
+			{
+				chunk = m_Storage.emplace_back(std::make_unique<T[]>(CHUNK_SIZE)).get();
+				m_Chunks[chunkIndex].store(chunk, std::memory_order_release);
+			}
+
+			chunk[index % CHUNK_SIZE] = std::move(value);
+			m_Size.store(index + 1, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<size_t> m_Size = 0;
+		std::atomic<T*> m_Chunks[MAX_CHUNKS];
+		std::vector<std::unique_ptr<T[]>> m_Storage;
+	};
+}
@@ -72,3 +72,13 @@ template<> struct ::std::hash<type> \
 		return ::Util::hash_multi(__VA_ARGS__); \
 	} \
 };
+
+// For keys that compute their hash once when they're built (stored in m_Hash)
+#define STD_HASH_PRECOMPUTED_DEFINITION(type) \
+template<> struct ::std::hash<type> \
+{ \
+	inline size_t operator()(const type& v) const \
+	{ \
+		return v.m_Hash; \
+	} \
+};
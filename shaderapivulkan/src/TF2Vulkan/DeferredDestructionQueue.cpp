@@ -0,0 +1,32 @@
+#include "DeferredDestructionQueue.h"
+
+using namespace TF2Vulkan;
+
+static DeferredDestructionQueue s_DeferredDestruction;
+DeferredDestructionQueue& TF2Vulkan::g_DeferredDestruction = s_DeferredDestruction;
+
+ResourceBlob& DeferredDestructionQueue::GetCurrentBucket()
+{
+	const auto frameNumber = g_ShaderDevice.GetFrameNumber();
+	auto& bucket = m_Buckets[frameNumber % MAX_FRAMES_IN_FLIGHT];
+
+	if (bucket.m_FrameNumber != frameNumber)
+	{
+		// The frame that last used this bucket must have been released already
+		assert(bucket.m_Resources.empty());
+		bucket.m_FrameNumber = frameNumber;
+	}
+
+	return bucket.m_Resources;
+}
+
+void DeferredDestructionQueue::ReleaseCompleted(uint64_t completedFrame)
+{
+	std::lock_guard lock(m_Mutex);
+
+	for (auto& bucket : m_Buckets)
+	{
+		if (bucket.m_FrameNumber <= completedFrame)
+			bucket.m_Resources.ReleaseAttachedResources();
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "interface/internal/IShaderDeviceInternal.h"
+#include "ResourceBlob.h"
+
+#include <array>
+#include <mutex>
+
+namespace TF2Vulkan
+{
+	// Holds on to resources that commands recorded this frame may still be
+	// using, and destroys them once the GPU has finished that frame.
+	class DeferredDestructionQueue final
+	{
+	public:
+		// Tags the resource with the frame currently being recorded
+		template<typename T> void Add(T&& resource)
+		{
+			std::lock_guard lock(m_Mutex);
+			GetCurrentBucket().AddResource(std::forward<T>(resource));
+		}
+
+		// Destroys everything tagged with completedFrame or earlier
+		void ReleaseCompleted(uint64_t completedFrame);
+
+	private:
+		ResourceBlob& GetCurrentBucket();
+
+		struct Bucket
+		{
+			uint64_t m_FrameNumber = 0;
+			ResourceBlob m_Resources;
+		};
+		std::array<Bucket, MAX_FRAMES_IN_FLIGHT> m_Buckets;
+		std::mutex m_Mutex;
+	};
+
+	extern DeferredDestructionQueue& g_DeferredDestruction;
+}
@@ -1,6 +1,16 @@
 #include "stdafx.h"
 #include "FormatConverter.h"
 
+#include <tier1/convar.h>
+
+#include <intrin.h>
+#include <immintrin.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
 #undef min
 #undef max
 
@@ -10,8 +20,8 @@ using namespace TF2Vulkan;
 	static constexpr bool HAS_ ## compNameUpper = true; \
 	static constexpr bool HAS_ ## index = true; \
 	static constexpr auto INDEX_ ## compNameUpper = index; \
-	static constexpr auto COMPONENT_BITS_ ## compNameUpper = bits; \
-	using ChannelType ## componentNameUpper = type;
+	static constexpr auto CHANNEL_BITS_ ## compNameUpper = bits; \
+	using ChannelType ## compNameUpper = type;
 
 #define DECLARE_COMPONENT(type, index, compNameLower, compNameUpper) \
 	DECLARE_COMPONENT_HELPERS(type, index, sizeof(type) * CHAR_BIT, compNameLower, compNameUpper); \
@@ -292,58 +302,451 @@ static void ConvertChannel(const PixelFormat<srcFormat>& RESTRICT src, PixelForm
 	dst.TrySetChannelValue<channel>(src.GetChannelValue<channel>());
 }
 
+template<ImageFormat srcFormat, ImageFormat dstFormat>
+static void ConvertRowScalar(const std::byte* RESTRICT srcRaw, std::byte* RESTRICT dstRaw,
+	uint32_t begin, uint32_t end)
+{
+	const auto* RESTRICT srcPtr = reinterpret_cast<const PixelFormat<srcFormat>*>(srcRaw);
+	auto* RESTRICT dstPtr = reinterpret_cast<PixelFormat<dstFormat>*>(dstRaw);
+
+	for (uint32_t x = begin; x < end; x++)
+	{
+		const auto& RESTRICT src = srcPtr[x];
+		auto& RESTRICT dst = dstPtr[x];
+
+		ConvertChannel<ImageChannel::R>(src, dst);
+		ConvertChannel<ImageChannel::G>(src, dst);
+		ConvertChannel<ImageChannel::B>(src, dst);
+		ConvertChannel<ImageChannel::A>(src, dst);
+	}
+}
+
+namespace
+{
+	struct SwizzleMasks
+	{
+		alignas(16) uint8_t m_Shuffle[16]; // Source byte for each destination byte, 0x80 for none
+		alignas(16) uint8_t m_Fill[16];    // ORed in afterwards
+	};
+
+	// Pixels per 16 byte block, on both sides
+	constexpr uint32_t GetSwizzleBlockPixels(uint32_t srcSize, uint32_t dstSize)
+	{
+		return (srcSize == 3 && dstSize == 3) ? 5 : 4;
+	}
+
+	template<ImageFormat srcFormat, ImageFormat dstFormat>
+	constexpr SwizzleMasks BuildSwizzleMasks()
+	{
+		using SrcData = PixelFormatData<srcFormat>;
+		using DstData = PixelFormatData<dstFormat>;
+
+		const int srcIndices[4] = { SrcData::INDEX_R, SrcData::INDEX_G, SrcData::INDEX_B, SrcData::INDEX_A };
+		const int dstIndices[4] = { DstData::INDEX_R, DstData::INDEX_G, DstData::INDEX_B, DstData::INDEX_A };
+
+		constexpr uint32_t srcSize = sizeof(SrcData);
+		constexpr uint32_t dstSize = sizeof(DstData);
+		constexpr uint32_t dstBlock = GetSwizzleBlockPixels(srcSize, dstSize) * dstSize;
+
+		SwizzleMasks masks{};
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			masks.m_Shuffle[i] = 0x80;
+			if (i >= dstBlock)
+				continue;
+
+			const auto pixel = i / dstSize;
+			for (size_t channel = 0; channel < 4; channel++)
+			{
+				if (dstIndices[channel] != int(i % dstSize))
+					continue;
+
+				if (srcIndices[channel] >= 0)
+					masks.m_Shuffle[i] = uint8_t(pixel * srcSize + srcIndices[channel]);
+				else
+					masks.m_Fill[i] = 0xFF; // Only alpha can be missing
+			}
+		}
+
+		return masks;
+	}
+
+	// Every supported format is 8 bits per channel, so converting between
+	// them is just a byte shuffle, plus filling in alpha if the source has none.
+	template<ImageFormat srcFormat, ImageFormat dstFormat>
+	struct Swizzle final
+	{
+		static constexpr uint32_t SRC_SIZE = sizeof(PixelFormatData<srcFormat>);
+		static constexpr uint32_t DST_SIZE = sizeof(PixelFormatData<dstFormat>);
+
+		static constexpr uint32_t PIXELS = GetSwizzleBlockPixels(SRC_SIZE, DST_SIZE);
+		static constexpr uint32_t SRC_BLOCK = PIXELS * SRC_SIZE;
+		static constexpr uint32_t DST_BLOCK = PIXELS * DST_SIZE;
+
+		static constexpr SwizzleMasks MASKS = BuildSwizzleMasks<srcFormat, dstFormat>();
+
+		// pshufw-style immediate for the first pixel, only meaningful for 4 -> 4
+		static constexpr int SHUFFLE_IMM = (MASKS.m_Shuffle[0] & 3) | ((MASKS.m_Shuffle[1] & 3) << 2) |
+			((MASKS.m_Shuffle[2] & 3) << 4) | ((MASKS.m_Shuffle[3] & 3) << 6);
+
+		// Blocks are always loaded and stored 16 bytes at a time, so the row has
+		// to have room for that much past the start of the last block. Bytes
+		// stored past the end of a block are overwritten by the next one (or the
+		// scalar tail).
+		static constexpr uint32_t MinPixels(uint32_t blocks)
+		{
+			const auto srcBytes = (blocks - 1) * SRC_BLOCK + 16;
+			const auto dstBytes = (blocks - 1) * DST_BLOCK + 16;
+			const auto srcPixels = (srcBytes + SRC_SIZE - 1) / SRC_SIZE;
+			const auto dstPixels = (dstBytes + DST_SIZE - 1) / DST_SIZE;
+			return srcPixels > dstPixels ? srcPixels : dstPixels;
+		}
+	};
+
+	enum class SIMDLevel
+	{
+		Scalar,
+		SSE2,
+		SSSE3,
+		AVX2,
+	};
+
+	// Converts as much of the start of a row as it can, returns how many pixels that was
+	using RowKernel = uint32_t(*)(const std::byte* src, std::byte* dst, uint32_t width);
+}
+
+static ConVar mat_vulkan_format_convert_simd("mat_vulkan_format_convert_simd", "3", FCVAR_NONE,
+	"Highest instruction set used for texture format conversions (0 = scalar, 1 = SSE2, 2 = SSSE3, 3 = AVX2).",
+	true, 0, true, 3);
+
+static SIMDLevel DetectSIMDLevel()
+{
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	const bool sse2 = info[3] & (1 << 26);
+	const bool ssse3 = info[2] & (1 << 9);
+	const bool osxsave = info[2] & (1 << 27);
+	const bool avx = info[2] & (1 << 28);
+
+	// The OS has to be saving the upper halves of the ymm registers too
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return SIMDLevel::AVX2;
+	}
+
+	if (ssse3)
+		return SIMDLevel::SSSE3;
+	if (sse2)
+		return SIMDLevel::SSE2;
+
+	return SIMDLevel::Scalar;
+}
+
+static SIMDLevel GetSupportedSIMDLevel()
+{
+	static const SIMDLevel s_Supported = DetectSIMDLevel();
+	return s_Supported;
+}
+
+static SIMDLevel GetSIMDLevel()
+{
+	return std::min(GetSupportedSIMDLevel(), SIMDLevel(mat_vulkan_format_convert_simd.GetInt()));
+}
+
+// No pshufb, but 4 byte pixels can still be shuffled as words
+template<ImageFormat srcFormat, ImageFormat dstFormat>
+static uint32_t ConvertRowSSE2(const std::byte* RESTRICT src, std::byte* RESTRICT dst, uint32_t width)
+{
+	using S = Swizzle<srcFormat, dstFormat>;
+	static_assert(S::SRC_SIZE == 4 && S::DST_SIZE == 4);
+
+	const __m128i zero = _mm_setzero_si128();
+
+	uint32_t x = 0;
+	for (; x + S::PIXELS <= width; x += S::PIXELS)
+	{
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * S::SRC_SIZE));
+
+		__m128i lo = _mm_unpacklo_epi8(pixels, zero);
+		__m128i hi = _mm_unpackhi_epi8(pixels, zero);
+		lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, S::SHUFFLE_IMM), S::SHUFFLE_IMM);
+		hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, S::SHUFFLE_IMM), S::SHUFFLE_IMM);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * S::DST_SIZE), _mm_packus_epi16(lo, hi));
+	}
+
+	return x;
+}
+
+template<ImageFormat srcFormat, ImageFormat dstFormat>
+static uint32_t ConvertRowSSSE3(const std::byte* RESTRICT src, std::byte* RESTRICT dst, uint32_t width)
+{
+	using S = Swizzle<srcFormat, dstFormat>;
+
+	const __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(S::MASKS.m_Shuffle));
+	const __m128i fill = _mm_load_si128(reinterpret_cast<const __m128i*>(S::MASKS.m_Fill));
+
+	uint32_t x = 0;
+	for (; x + S::MinPixels(1) <= width; x += S::PIXELS)
+	{
+		__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * S::SRC_SIZE));
+		pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), fill);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * S::DST_SIZE), pixels);
+	}
+
+	return x;
+}
+
+// vpshufb can't cross 128 bit lanes, so each lane holds its own block
+template<ImageFormat srcFormat, ImageFormat dstFormat>
+static uint32_t ConvertRowAVX2(const std::byte* RESTRICT src, std::byte* RESTRICT dst, uint32_t width)
+{
+	using S = Swizzle<srcFormat, dstFormat>;
+
+	const __m256i shuffle = _mm256_broadcastsi128_si256(
+		_mm_load_si128(reinterpret_cast<const __m128i*>(S::MASKS.m_Shuffle)));
+	const __m256i fill = _mm256_broadcastsi128_si256(
+		_mm_load_si128(reinterpret_cast<const __m128i*>(S::MASKS.m_Fill)));
+
+	uint32_t x = 0;
+	for (; x + S::MinPixels(2) <= width; x += S::PIXELS * 2)
+	{
+		const std::byte* srcBlock = src + x * S::SRC_SIZE;
+		std::byte* dstBlock = dst + x * S::DST_SIZE;
+
+		__m256i pixels;
+		if constexpr (S::SRC_BLOCK == 16)
+		{
+			pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcBlock));
+		}
+		else
+		{
+			pixels = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcBlock))),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcBlock + S::SRC_BLOCK)), 1);
+		}
+
+		pixels = _mm256_or_si256(_mm256_shuffle_epi8(pixels, shuffle), fill);
+
+		if constexpr (S::DST_BLOCK == 16)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dstBlock), pixels);
+		}
+		else
+		{
+			// Upper lane goes second, over the end of the lower one
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstBlock), _mm256_castsi256_si128(pixels));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstBlock + S::DST_BLOCK), _mm256_extracti128_si256(pixels, 1));
+		}
+	}
+
+	return x;
+}
+
+template<ImageFormat srcFormat, ImageFormat dstFormat>
+static RowKernel GetRowKernel(SIMDLevel level)
+{
+	using S = Swizzle<srcFormat, dstFormat>;
+
+	switch (level)
+	{
+	case SIMDLevel::AVX2:
+		return &ConvertRowAVX2<srcFormat, dstFormat>;
+	case SIMDLevel::SSSE3:
+		return &ConvertRowSSSE3<srcFormat, dstFormat>;
+	case SIMDLevel::SSE2:
+		if constexpr (S::SRC_SIZE == 4 && S::DST_SIZE == 4)
+			return &ConvertRowSSE2<srcFormat, dstFormat>;
+		else
+			return nullptr;
+
+	default:
+		return nullptr;
+	}
+}
+
 template<ImageFormat srcFormat, ImageFormat dstFormat>
 static void ConvertImpl(const std::byte* RESTRICT srcRaw, size_t srcSize,
 	std::byte* RESTRICT dstRaw, size_t dstSize,
-	uint32_t width, uint32_t height, size_t srcStride, size_t dstStride)
+	uint32_t width, uint32_t height, size_t srcStride, size_t dstStride, SIMDLevel level)
 {
 	using SrcType = PixelFormat<srcFormat>;
 	using DstType = PixelFormat<dstFormat>;
 
+	if (srcStride == 0)
+		Util::SafeConvert(ImageLoader::GetMemRequired(width, 1, 1, srcFormat, false), srcStride);
 	if (dstStride == 0)
 		Util::SafeConvert(ImageLoader::GetMemRequired(width, 1, 1, dstFormat, false), dstStride);
 
-	const auto* RESTRICT srcPtr = reinterpret_cast<const SrcType*>(srcRaw);
-	auto* RESTRICT dstPtr = reinterpret_cast<DstType*>(dstRaw);
-
 	assert(srcStride >= sizeof(SrcType) * width);
 	assert(dstStride >= sizeof(DstType) * width);
+	assert(srcStride * (height - 1) + sizeof(SrcType) * width <= srcSize);
+	assert(dstStride * (height - 1) + sizeof(DstType) * width <= dstSize);
+
+	// The scalar path is the reference, and finishes off whatever the kernel leaves
+	const RowKernel kernel = GetRowKernel<srcFormat, dstFormat>(level);
 
 	for (uint32_t y = 0; y < height; y++)
 	{
-		for (uint32_t x = 0; x < height; x++)
-		{
-			const auto& RESTRICT src = srcPtr[x];
-			auto& RESTRICT dst = dstPtr[x];
+		const std::byte* srcRow = srcRaw + y * srcStride;
+		std::byte* dstRow = dstRaw + y * dstStride;
 
-			ConvertChannel<ImageChannel::R>(src, dst);
-			ConvertChannel<ImageChannel::G>(src, dst);
-			ConvertChannel<ImageChannel::B>(src, dst);
-			ConvertChannel<ImageChannel::A>(src, dst);
-		}
-
-		*reinterpret_cast<const std::byte**>(&srcPtr) += srcStride;
-		*reinterpret_cast<std::byte**>(&dstPtr) += dstStride;
+		const uint32_t done = kernel ? kernel(srcRow, dstRow, width) : 0;
+		ConvertRowScalar<srcFormat, dstFormat>(srcRow, dstRow, done, width);
 	}
-
-	assert(reinterpret_cast<const std::byte*>(srcPtr) <= (srcRaw + srcSize));
-	assert(reinterpret_cast<const std::byte*>(dstPtr) <= (dstRaw + dstSize));
 }
 
-void FormatConverter::Convert(
+static void ConvertAtLevel(
 	const std::byte* src, ImageFormat srcFormat, size_t srcSize,
 	std::byte* dst, ImageFormat dstFormat, size_t dstSize,
-	uint32_t width, uint32_t height, size_t srcStride, size_t dstStride)
+	uint32_t width, uint32_t height, size_t srcStride, size_t dstStride, SIMDLevel level)
 {
 	assert(srcSize > 0);
 	assert(dstSize > 0);
 
-	ImageFormatVisit(srcFormat, [&](const auto & srcFormatType)
+	FormatConverter::ImageFormatVisit(srcFormat, [&](const auto & srcFormatType)
 		{
-			ImageFormatVisit(dstFormat, [&](const auto & dstFormatType)
+			FormatConverter::ImageFormatVisit(dstFormat, [&](const auto & dstFormatType)
 				{
 					ConvertImpl<srcFormatType.FORMAT, dstFormatType.FORMAT>(src, srcSize, dst, dstSize,
-						width, height, srcStride, dstStride);
+						width, height, srcStride, dstStride, level);
 				});
 		});
 }
+
+void FormatConverter::Convert(
+	const std::byte* src, ImageFormat srcFormat, size_t srcSize,
+	std::byte* dst, ImageFormat dstFormat, size_t dstSize,
+	uint32_t width, uint32_t height, size_t srcStride, size_t dstStride)
+{
+	ConvertAtLevel(src, srcFormat, srcSize, dst, dstFormat, dstSize,
+		width, height, srcStride, dstStride, GetSIMDLevel());
+}
+
+static constexpr ImageFormat CONVERTIBLE_FORMATS[] =
+{
+	IMAGE_FORMAT_RGBA8888,
+	IMAGE_FORMAT_ABGR8888,
+	IMAGE_FORMAT_RGB888,
+	IMAGE_FORMAT_BGR888,
+	IMAGE_FORMAT_ARGB8888,
+	IMAGE_FORMAT_BGRA8888,
+};
+
+static const char* const SIMD_LEVEL_NAMES[] = { "scalar", "SSE2", "SSSE3", "AVX2" };
+
+CON_COMMAND(mat_vulkan_format_convert_selftest, "Checks every SIMD texture format conversion kernel against the scalar reference.")
+{
+	const auto supported = GetSupportedSIMDLevel();
+	Msg(TF2VULKAN_PREFIX "Format converter self test, CPU supports up to %s\n", SIMD_LEVEL_NAMES[size_t(supported)]);
+
+	// Enough to cover every block count, and every tail length for each kernel
+	constexpr uint32_t MAX_WIDTH = 67;
+	constexpr uint32_t HEIGHT = 3;
+	constexpr size_t GUARD_SIZE = 64; // Kernels store whole 16/32 byte blocks
+	constexpr auto SENTINEL = std::byte(0xCD);
+
+	std::mt19937 rng(1234);
+	uint32_t checks = 0;
+	uint32_t failures = 0;
+
+	for (const auto srcFormat : CONVERTIBLE_FORMATS)
+	{
+		for (const auto dstFormat : CONVERTIBLE_FORMATS)
+		{
+			for (uint32_t width = 1; width <= MAX_WIDTH; width++)
+			{
+				// Both tightly packed and padded rows, so stores past a row's end show up
+				for (const size_t padding : { size_t(0), size_t(7) })
+				{
+					const size_t srcStride = size_t(ImageLoader::GetMemRequired(width, 1, 1, srcFormat, false)) + padding;
+					const size_t dstStride = size_t(ImageLoader::GetMemRequired(width, 1, 1, dstFormat, false)) + padding;
+
+					std::vector<std::byte> src(srcStride * HEIGHT);
+					for (auto& b : src)
+						b = std::byte(rng());
+
+					std::vector<std::byte> reference(dstStride * HEIGHT + GUARD_SIZE, SENTINEL);
+					ConvertAtLevel(src.data(), srcFormat, src.size(), reference.data(), dstFormat, dstStride * HEIGHT,
+						width, HEIGHT, srcStride, dstStride, SIMDLevel::Scalar);
+
+					for (auto level = SIMDLevel::SSE2; level <= supported; level = SIMDLevel(size_t(level) + 1))
+					{
+						std::vector<std::byte> dst(reference.size(), SENTINEL);
+						ConvertAtLevel(src.data(), srcFormat, src.size(), dst.data(), dstFormat, dstStride * HEIGHT,
+							width, HEIGHT, srcStride, dstStride, level);
+
+						checks++;
+						if (dst != reference)
+						{
+							failures++;
+							const auto mismatch = std::mismatch(dst.begin(), dst.end(), reference.begin()).first - dst.begin();
+							Warning(TF2VULKAN_PREFIX "%s -> %s, %s, width %u, padding %zu: first mismatch at byte %zu\n",
+								ImageLoader::GetName(srcFormat), ImageLoader::GetName(dstFormat),
+								SIMD_LEVEL_NAMES[size_t(level)], width, padding, size_t(mismatch));
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (failures)
+		Warning(TF2VULKAN_PREFIX "Format converter self test: %u of %u checks FAILED\n", failures, checks);
+	else
+		Msg(TF2VULKAN_PREFIX "Format converter self test: all %u checks passed\n", checks);
+}
+
+CON_COMMAND(mat_vulkan_format_convert_benchmark, "Measures texture format conversion throughput for each SIMD level.")
+{
+	constexpr uint32_t WIDTH = 1024;
+	constexpr uint32_t HEIGHT = 1024;
+	constexpr int ITERATIONS = 8;
+
+	const auto supported = GetSupportedSIMDLevel();
+	Msg(TF2VULKAN_PREFIX "Format conversion throughput, %ux%u, Mpixels/s (scalar / SSE2 / SSSE3 / AVX2):\n", WIDTH, HEIGHT);
+
+	std::vector<std::byte> src(size_t(WIDTH) * HEIGHT * 4);
+	std::vector<std::byte> dst(size_t(WIDTH) * HEIGHT * 4);
+	std::mt19937 rng(1234);
+	for (auto& b : src)
+		b = std::byte(rng());
+
+	for (const auto srcFormat : CONVERTIBLE_FORMATS)
+	{
+		for (const auto dstFormat : CONVERTIBLE_FORMATS)
+		{
+			if (srcFormat == dstFormat)
+				continue;
+
+			char results[128] = {};
+			size_t resultsLength = 0;
+			for (auto level = SIMDLevel::Scalar; level <= SIMDLevel::AVX2; level = SIMDLevel(size_t(level) + 1))
+			{
+				if (level > supported)
+				{
+					resultsLength += sprintf_s(results + resultsLength, std::size(results) - resultsLength, "%8s", "-");
+					continue;
+				}
+
+				const auto start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < ITERATIONS; i++)
+				{
+					ConvertAtLevel(src.data(), srcFormat, src.size(), dst.data(), dstFormat, dst.size(),
+						WIDTH, HEIGHT, 0, 0, level);
+				}
+				const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+				const double mpixels = double(WIDTH) * HEIGHT * ITERATIONS / elapsed.count() / 1e6;
+				resultsLength += sprintf_s(results + resultsLength, std::size(results) - resultsLength, "%8.0f", mpixels);
+			}
+
+			Msg("  %-10s -> %-10s %s\n", ImageLoader::GetName(srcFormat), ImageLoader::GetName(dstFormat), results);
+		}
+	}
+}
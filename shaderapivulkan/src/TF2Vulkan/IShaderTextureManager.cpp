@@ -1,11 +1,21 @@
 #include "IShaderTextureManager.h"
+#include "DeferredDestructionQueue.h"
 #include "FormatInfo.h"
 #include "VulkanFactories.h"
 #include "TF2Vulkan/TextureData.h"
 #include "FormatConverter.h"
+#include "IStateManagerVulkan.h"
+#include "MaterialSystemHardwareConfig.h"
+#include "StagingArena.h"
+#include "TextureStreamer.h"
+#include "UploadBatch.h"
 
 #include <TF2Vulkan/Util/std_string.h>
 
+#include <tier1/convar.h>
+
+#include <numeric>
+
 #define LOG_FUNC_TEX_NAME(texHandle, texName) \
 	LOG_FUNC_MSG(texName)
 
@@ -17,6 +27,12 @@
 
 using namespace TF2Vulkan;
 
+static ConVar mat_vulkan_texture_streaming("mat_vulkan_texture_streaming", "1", FCVAR_NONE,
+	"Only upload the smallest mips of VTF textures on load, and stream in the rest over the following frames.");
+static ConVar mat_vulkan_texture_stream_tail("mat_vulkan_texture_stream_tail", "128", FCVAR_NONE,
+	"Mips this size (in texels, on their longest side) and smaller are uploaded as soon as a texture is loaded.",
+	true, 1, false, 0);
+
 const IShaderAPITexture* IShaderTextureManager::TryGetTexture(ShaderAPITextureHandle_t texID) const
 {
 	if (auto found = m_Textures.find(texID); found != m_Textures.end())
@@ -127,18 +143,16 @@ ShaderAPITextureHandle_t IShaderTextureManager::CreateTexture(int width, int hei
 	FormatUsage fmtUsage;
 	assert(!(flags & TEXTURE_CREATE_RENDERTARGET) || !(flags & TEXTURE_CREATE_DEPTHBUFFER));
 
-	vk::ImageLayout targetLayout = vk::ImageLayout::eUndefined;
+	// Render targets are transitioned by the first render pass that uses them
 	if (flags & TEXTURE_CREATE_RENDERTARGET)
 	{
 		fmtUsage = FormatUsage::RenderTarget;
 		createInfo.usage |= vk::ImageUsageFlagBits::eColorAttachment;
-		targetLayout = vk::ImageLayout::eColorAttachmentOptimal;
 	}
 	else if (flags & TEXTURE_CREATE_DEPTHBUFFER)
 	{
 		fmtUsage = FormatUsage::DepthStencil;
 		createInfo.usage |= vk::ImageUsageFlagBits::eDepthStencilAttachment;
-		targetLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
 	}
 	else
 	{
@@ -158,17 +172,7 @@ ShaderAPITextureHandle_t IShaderTextureManager::CreateTexture(int width, int hei
 		createInfo.extent.height += (blockSize.height - hDelta) % blockSize.height;
 	}
 
-	auto& newTex = CreateTexture(dbgName, createInfo);
-
-	if (targetLayout != vk::ImageLayout::eUndefined)
-	{
-		assert(newTex.GetImageCreateInfo().mipLevels == 1);
-		TransitionImageLayout(newTex.GetImage(), newTex.GetImageCreateInfo().format,
-			vk::ImageLayout::eUndefined, targetLayout,
-			g_ShaderDevice.GetPrimaryCmdBuf(), 0);
-	}
-
-	return newTex.GetHandle();
+	return CreateTexture(dbgName, createInfo).GetHandle();
 }
 
 void IShaderTextureManager::CreateTextures(ShaderAPITextureHandle_t * handles, int count,
@@ -244,13 +248,20 @@ void IShaderTextureManager::DeleteTexture(ShaderAPITextureHandle_t tex)
 		}
 	}
 
-	auto& cmdBuf = g_ShaderDevice.GetPrimaryCmdBuf();
+	// Cached descriptor sets might be pointing at the image views
+	{
+		std::vector<vk::ImageView> views;
+		views.reserve(realTex.m_ImageViews.size());
+		for (const auto& iv : realTex.m_ImageViews)
+			views.push_back(iv.second.get());
 
-	// Attach this image and imageviews to the primary command buffer so they
-	// stick around until submission
-	cmdBuf.AddResource(std::move(realTex.m_Image));
+		g_StateManagerVulkan.EvictImageViews(views);
+	}
+
+	// Keep the image and image views around until the GPU is done with this frame
 	for (auto& iv : realTex.m_ImageViews)
-		cmdBuf.AddResource(std::move(iv.second));
+		g_DeferredDestruction.Add(std::move(iv.second));
+	g_DeferredDestruction.Add(std::move(realTex.m_Image));
 
 	m_Textures.erase(tex);
 }
@@ -284,11 +295,18 @@ void IShaderTextureManager::TexImageFromVTF(ShaderAPITextureHandle_t texHandle,
 	const auto format = vtf->Format();
 	const auto blockSize = FormatInfo::GetBlockSize(format);
 
+	// Mips finer than this get streamed in
+	uint32_t tailMip = 0;
+	const int tailSize = mat_vulkan_texture_streaming.GetBool() ? mat_vulkan_texture_stream_tail.GetInt() : std::numeric_limits<int>::max();
+
 	for (uint32_t mip = 0; mip < mipCount; mip++)
 	{
 		int width, height, depth;
 		vtf->ComputeMipLevelDimensions(mip, &width, &height, &depth);
 
+		if (std::max(width, height) > tailSize)
+			tailMip = std::min(mip + 1, mipCount - 1);
+
 		const int mipSize = vtf->ComputeMipSize(mip);
 		const int stride = vtf->RowSizeInBytes(mip);
 
@@ -317,7 +335,62 @@ void IShaderTextureManager::TexImageFromVTF(ShaderAPITextureHandle_t texHandle,
 		}
 	}
 
-	UpdateTexture(texHandle, texDatas, arraySize);
+	// Anything still streaming in from an earlier download is stale now
+	tex.m_StreamGeneration++;
+	tex.m_FirstResidentMip = tailMip;
+
+	const auto tailStart = tailMip * faceCount;
+	if (tailStart > 0)
+	{
+		const ImageFormat targetFormat = FormatInfo::ConvertImageFormat(tex.m_CreateInfo.format);
+		g_TextureStreamer.Queue(texHandle, tex.m_StreamGeneration, targetFormat, texDatas, tailStart);
+	}
+
+	UpdateTexture(texHandle, texDatas + tailStart, arraySize - tailStart);
+}
+
+bool IShaderTextureManager::UploadStreamedMip(ShaderAPITextureHandle_t texHandle, uint32_t generation,
+	uint32_t mipLevel, const TextureData* data, size_t count)
+{
+	auto found = m_Textures.find(texHandle);
+	if (found == m_Textures.end())
+		return false;
+
+	auto& tex = found->second;
+	if (tex.m_StreamGeneration != generation)
+		return false;
+
+	if (!UpdateTexture(texHandle, data, count))
+		return false;
+
+	// Uploads land before the rest of the frame, so views created from now on can use it
+	assert(mipLevel + 1 == tex.m_FirstResidentMip);
+	const auto oldViewRange = tex.GetViewRange();
+	tex.m_FirstResidentMip = std::min(tex.m_FirstResidentMip, mipLevel);
+
+	// Nothing will ask for the coarser view again, so don't let it (and the
+	// descriptor sets using it) pile up until the texture is deleted
+	if (tex.GetViewRange() != oldViewRange)
+	{
+		std::vector<vk::ImageView> oldViews;
+		for (auto it = tex.m_ImageViews.begin(); it != tex.m_ImageViews.end(); )
+		{
+			if (it->first.subresourceRange == oldViewRange)
+			{
+				oldViews.push_back(it->second.get());
+				g_DeferredDestruction.Add(std::move(it->second));
+				it = tex.m_ImageViews.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		g_StateManagerVulkan.EvictImageViews(oldViews);
+	}
+
+	return true;
 }
 
 bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, const TextureData* data, size_t count)
@@ -339,8 +412,14 @@ bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, co
 
 	std::vector<vk::BufferImageCopy> copyRegions;
 
-	// Prepare the staging buffer
-	vma::AllocatedBuffer stagingBuf;
+	// Every region has to start on a whole texel block (and a multiple of 4)
+	const auto targetBlockSize = FormatInfo::GetBlockSize(targetFormat);
+	const size_t copyAlignment = std::lcm(g_MatSysConfig.OptimalBufferCopyOffsetAlignment(),
+		std::lcm(size_t(4), size_t(ImageLoader::GetMemRequired(Util::SafeConvert<int>(targetBlockSize.width),
+			Util::SafeConvert<int>(targetBlockSize.height), 1, targetFormat, false))));
+
+	// Prepare the staging memory
+	StagingArena::Allocation staging;
 	{
 		// Calculate required buffer size and initialize copy regions (offsets)
 		size_t totalSize = 0;
@@ -362,6 +441,7 @@ bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, co
 			Util::SafeConvert(slice.m_Height, region.imageExtent.height);
 			Util::SafeConvert(slice.m_Depth, region.imageExtent.depth);
 
+			totalSize = AlignUp(totalSize, copyAlignment);
 			region.bufferOffset = totalSize;
 
 			// bufferRowLength and bufferImageHeight are in texels
@@ -402,17 +482,9 @@ bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, co
 			}
 		}
 
-		// Allocate staging buffer
-		stagingBuf = Factories::BufferFactory{}
-			.SetSize(totalSize)
-			.SetUsage(vk::BufferUsageFlagBits::eTransferSrc)
-			.SetMemoryRequiredFlags(vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent)
-			.SetAllowMapping(true)
-			.SetDebugName(Util::string::concat(tex.m_DebugName, ": UpdateTexture() staging buffer"))
-			.Create();
-
-		// Copy the data into the staging buffer
-		auto& allocation = stagingBuf.GetAllocation();
+		staging = g_StagingArena.Allocate(totalSize, copyAlignment);
+
+		// Copy the data into the staging memory
 		for (size_t i = 0; i < count; i++)
 		{
 			const TextureData& slice = data[i];
@@ -422,7 +494,7 @@ bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, co
 
 			// Record this copy region
 			{
-				const auto& region = copyRegions.at(i);
+				auto& region = copyRegions.at(i);
 				if (slice.m_Format != targetFormat)
 				{
 					assert(!FormatInfo::IsCompressed(slice.m_Format));
@@ -431,72 +503,22 @@ bool IShaderTextureManager::UpdateTexture(ShaderAPITextureHandle_t texHandle, co
 
 					FormatConverter::Convert(
 						reinterpret_cast<const std::byte*>(slice.m_Data), slice.m_Format, slice.m_DataLength,
-						reinterpret_cast<std::byte*>(allocation.data() + region.bufferOffset), targetFormat, targetSliceSize,
+						staging.m_Data + region.bufferOffset, targetFormat, targetSliceSize,
 						slice.m_Width, slice.m_Height, slice.m_Stride);
 				}
 				else
 				{
 					// No conversion necessary
-					allocation.Write(slice.m_Data, slice.m_DataLength, region.bufferOffset);
+					memcpy(staging.m_Data + region.bufferOffset, slice.m_Data, slice.m_DataLength);
 				}
+
+				region.bufferOffset += staging.m_Offset;
 			}
 		}
 	}
 
 	// Copy staging buffer into destination texture
-	{
-		//auto uniqueCmdBuffer = queue.CreateCmdBufferAndBegin();
-		auto& cmdBuffer = g_ShaderDevice.GetPrimaryCmdBuf();//*uniqueCmdBuffer;
-
-		auto pixScope = cmdBuffer.DebugRegionBegin(PIX_COLOR_READWRITE, "ShaderAPI::UpdateTexture(%.*s)", PRINTF_SV(tex.GetDebugName()));
-
-		cmdBuffer.TryEndRenderPass();
-
-		const vk::PipelineStageFlags stageMask = vk::PipelineStageFlagBits::eTransfer;
-
-		// TODO: Use stack allocation
-		// TODO: Combine by mip level/layer
-		std::vector<vk::ImageMemoryBarrier> barriers;
-		for (size_t i = 0; i < count; i++)
-		{
-			auto& barrier = barriers.emplace_back();
-			const auto& slice = data[i];
-
-			barrier.image = tex.m_Image.GetImage();
-			barrier.oldLayout = vk::ImageLayout::eUndefined; // Discard old contents
-			barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
-			barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-			barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
-
-			auto& srr = barrier.subresourceRange;
-			srr.aspectMask = FormatInfo::GetAspects(tex.m_CreateInfo.format);
-			srr.baseMipLevel = slice.m_MipLevel;
-			srr.baseArrayLayer = slice.m_CubeFace;
-			srr.layerCount = 1;
-			srr.levelCount = 1;
-		}
-
-		cmdBuffer.pipelineBarrier(
-			vk::PipelineStageFlagBits::eTransfer,
-			vk::PipelineStageFlagBits::eTransfer,
-			{}, {}, {}, barriers);
-
-		cmdBuffer.copyBufferToImage(stagingBuf.GetBuffer(), tex.m_Image.GetImage(),
-			vk::ImageLayout::eTransferDstOptimal, copyRegions);
-		cmdBuffer.AddResource(std::move(stagingBuf));
-
-		for (auto& barrier : barriers)
-		{
-			barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-			barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-			barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-		}
-
-		cmdBuffer.pipelineBarrier(
-			vk::PipelineStageFlagBits::eTransfer,
-			vk::PipelineStageFlagBits::eFragmentShader,
-			{}, {}, {}, barriers);
-	}
+	g_UploadBatch.CopyBufferToImage(tex, staging.m_Buffer, std::move(copyRegions));
 
 	return true;
 }
@@ -507,12 +529,12 @@ void IShaderTextureManager::SetStandardTextureHandle(StandardTextureId_t id, Sha
 	m_StdTextures.at(id) = tex;
 }
 
-void IShaderTextureManager::TexLodClamp(int something)
+void IShaderTextureManager::TexLodClamp(int finestMip)
 {
 	LOG_FUNC();
 
-	if (something != 0)
-		NOT_IMPLEMENTED_FUNC();
+	auto& tex = m_Textures.at(m_ModifyTexture);
+	tex.m_LodClamp = Util::SafeConvert<uint32_t>(std::max(finestMip, 0));
 }
 
 void IShaderTextureManager::TexLodBias(float bias)
@@ -24,6 +24,11 @@ namespace TF2Vulkan
 		void TexImageFromVTF(ShaderAPITextureHandle_t texHandle, IVTFTexture* vtf, int ivtfFrame);
 		bool UpdateTexture(ShaderAPITextureHandle_t texHandle, const TextureData* data,
 			size_t count);
+
+		// Called by the texture streamer with the next finer mip of a texture.
+		// Returns false if the texture is gone or has been downloaded again since.
+		bool UploadStreamedMip(ShaderAPITextureHandle_t texHandle, uint32_t generation,
+			uint32_t mipLevel, const TextureData* data, size_t count);
 		void TexMinFilter(ShaderAPITextureHandle_t texHandle, ShaderTexFilterMode_t mode);
 		void TexMagFilter(ShaderAPITextureHandle_t texHandle, ShaderTexFilterMode_t mode);
 		void TexWrap(ShaderAPITextureHandle_t tex, ShaderTexCoordComponent_t coord, ShaderTexWrapMode_t wrapMode);
@@ -57,14 +62,21 @@ namespace TF2Vulkan
 			vma::AllocatedImage m_Image;
 			ShaderAPITextureHandle_t m_Handle;
 			std::unordered_map<vk::ImageViewCreateInfo, vk::UniqueImageView> m_ImageViews;
+			ImageLayoutTracker m_LayoutTracker;
 
 			SamplerSettings m_SamplerSettings;
 
+			uint32_t m_FirstResidentMip = 0; // Finer mips are still being streamed in
+			uint32_t m_LodClamp = 0;         // TexLodClamp()
+			uint32_t m_StreamGeneration = 0; // Bumped by every TexImageFromVTF()
+
 			std::string_view GetDebugName() const override { return m_DebugName; }
 			const vk::Image& GetImage() const override { return m_Image.GetImage(); }
 			const vk::ImageCreateInfo& GetImageCreateInfo() const override { return m_CreateInfo; }
 			const vk::ImageView& FindOrCreateView(const vk::ImageViewCreateInfo& createInfo) override;
 			ShaderAPITextureHandle_t GetHandle() const override { return m_Handle; }
+			ImageLayoutTracker& GetLayoutTracker() override { return m_LayoutTracker; }
+			uint32_t GetBaseViewMip() const override { return m_LodClamp > m_FirstResidentMip ? m_LodClamp : m_FirstResidentMip; }
 		};
 		std::unordered_map<ShaderAPITextureHandle_t, ShaderTexture> m_Textures;
 
@@ -83,7 +95,7 @@ namespace TF2Vulkan
 		void TexMinFilter(ShaderTexFilterMode_t mode) override final;
 		void TexMagFilter(ShaderTexFilterMode_t mode) override final;
 		void TexWrap(ShaderTexCoordComponent_t coord, ShaderTexWrapMode_t wrapMode) override final;
-		void TexLodClamp(int something) override final;
+		void TexLodClamp(int finestMip) override final;
 		void TexLodBias(float bias) override final;
 	};
 
@@ -1,15 +1,28 @@
 #pragma once
 
+#include <cstdint>
+
 namespace TF2Vulkan
 {
 	struct LogicalShadowState;
 	struct LogicalDynamicState;
+	enum class LogicalShadowStateID : size_t;
 
 	enum class VulkanStateID : size_t
 	{
 		Invalid = size_t(-1),
 	};
 
+	struct PipelineCompileStats
+	{
+		uint32_t m_Pending = 0;    // Waiting for, or currently on, a compile worker
+		uint32_t m_Completed = 0;  // Total compiled since startup
+		uint32_t m_FallbackDraws = 0;
+		uint32_t m_SkippedDraws = 0;
+		uint32_t m_FoldedClears = 0;  // Became the loadOp of a render pass begin
+		uint32_t m_InPassClears = 0;  // Needed vkCmdClearAttachments
+	};
+
 	class IStateManagerVulkan
 	{
 	protected:
@@ -19,15 +32,56 @@ namespace TF2Vulkan
 		virtual VulkanStateID FindOrCreateState(const LogicalShadowState& staticState,
 			const LogicalDynamicState& dynamicState) = 0;
 
-		virtual void ApplyState(VulkanStateID stateID, const LogicalShadowState& staticState,
+		// Same as above, but repeated lookups for the same snapshot usually hit a
+		// small cache instead of building and hashing a PipelineKey.
+		// staticState must be the state shadowStateID refers to.
+		virtual VulkanStateID FindOrCreateState(LogicalShadowStateID shadowStateID,
+			const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState) = 0;
+
+		// Must be called whenever a render target handle may start referring to an
+		// image with a different format (the backbuffer being recreated)
+		virtual void InvalidateRenderTargets() = 0;
+
+		// Clears the render targets bound in staticState to dynamicState.m_ClearColor,
+		// depth 1 and stencil 0. Unless their render pass is already open, this begins
+		// it with eClear loadOps rather than recording a separate clear.
+		virtual void ClearRenderTargets(const LogicalShadowState& staticState,
+			const LogicalDynamicState& dynamicState, bool clearColor, bool clearDepth, bool clearStencil,
+			uint32_t width, uint32_t height, IVulkanCommandBuffer& buf) = 0;
+
+		// Returns false if neither the pipeline nor a compatible fallback has finished
+		// compiling yet, in which case the draw should be skipped.
+		virtual bool ApplyState(VulkanStateID stateID, const LogicalShadowState& staticState,
 			const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf) = 0;
 
-		VulkanStateID ApplyState(const LogicalShadowState& staticState,
+		// Must be called whenever a buffer referenced by a descriptor is destroyed
+		virtual void FlushDescriptorSetCache() = 0;
+
+		// Must be called before image views are destroyed. Evicts the cached
+		// descriptor sets and framebuffers that refer to any of them.
+		virtual void EvictImageViews(const vk::ArrayProxy<const vk::ImageView>& views) = 0;
+
+		virtual PipelineCompileStats GetPipelineCompileStats() const = 0;
+
+		// Pre-creates every pipeline recorded in the warm-up manifest (see
+		// mat_vulkan_record_pipeline_manifest), blocking until they're compiled.
+		virtual void LoadPipelineManifest() = 0;
+
+		// Stops the pipeline compile workers and writes the warm-up manifest, if
+		// recording. Must happen before the device is destroyed.
+		virtual void Shutdown() = 0;
+
+		bool ApplyState(const LogicalShadowState& staticState,
 			const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
 		{
 			const auto& stateID = FindOrCreateState(staticState, dynamicState);
-			ApplyState(stateID, staticState, dynamicState, buf);
-			return stateID;
+			return ApplyState(stateID, staticState, dynamicState, buf);
+		}
+		bool ApplyState(LogicalShadowStateID shadowStateID, const LogicalShadowState& staticState,
+			const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
+		{
+			const auto& stateID = FindOrCreateState(shadowStateID, staticState, dynamicState);
+			return ApplyState(stateID, staticState, dynamicState, buf);
 		}
 	};
 
@@ -0,0 +1,228 @@
+#include "ImageLayoutTracker.h"
+#include "interface/internal/IVulkanCommandBuffer.h"
+#include "interface/internal/IVulkanQueue.h"
+
+using namespace TF2Vulkan;
+
+using Usage = ImageLayoutTracker::Usage;
+
+static constexpr vk::AccessFlags WRITE_ACCESS =
+	vk::AccessFlagBits::eShaderWrite |
+	vk::AccessFlagBits::eColorAttachmentWrite |
+	vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+	vk::AccessFlagBits::eTransferWrite |
+	vk::AccessFlagBits::eHostWrite |
+	vk::AccessFlagBits::eMemoryWrite;
+
+bool Usage::operator==(const Usage& other) const
+{
+	return m_Layout == other.m_Layout && m_Stages == other.m_Stages && m_Access == other.m_Access;
+}
+
+Usage Usage::TransferDst()
+{
+	return { vk::ImageLayout::eTransferDstOptimal, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite };
+}
+
+Usage Usage::ShaderRead()
+{
+	return { vk::ImageLayout::eShaderReadOnlyOptimal,
+		vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader,
+		vk::AccessFlagBits::eShaderRead };
+}
+
+Usage Usage::ColorAttachment()
+{
+	return { vk::ImageLayout::eColorAttachmentOptimal,
+		vk::PipelineStageFlagBits::eColorAttachmentOutput,
+		vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite };
+}
+
+Usage Usage::DepthStencilAttachment()
+{
+	return { vk::ImageLayout::eDepthStencilAttachmentOptimal,
+		vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+		vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite };
+}
+
+Usage Usage::Present()
+{
+	// The present semaphore takes care of the actual synchronization
+	return { vk::ImageLayout::ePresentSrcKHR, vk::PipelineStageFlagBits::eBottomOfPipe, {} };
+}
+
+ImageLayoutTracker::ImageLayoutTracker(uint32_t mipLevels, uint32_t arrayLayers) :
+	m_MipLevels(mipLevels),
+	m_ArrayLayers(arrayLayers),
+	m_Subresources(size_t(mipLevels) * arrayLayers)
+{
+}
+
+static bool NeedsBarrier(const Usage& oldUsage, const Usage& newUsage)
+{
+	if (oldUsage.m_Layout != newUsage.m_Layout)
+		return true;
+
+	// Read after read is the only thing that doesn't need one
+	return !!(oldUsage.m_Access & WRITE_ACCESS) || !!(newUsage.m_Access & WRITE_ACCESS);
+}
+
+void ImageLayoutTracker::ResolveRange(const vk::ImageSubresourceRange& range,
+	uint32_t& levelCount, uint32_t& layerCount) const
+{
+	levelCount = range.levelCount == VK_REMAINING_MIP_LEVELS ?
+		m_MipLevels - range.baseMipLevel : range.levelCount;
+	layerCount = range.layerCount == VK_REMAINING_ARRAY_LAYERS ?
+		m_ArrayLayers - range.baseArrayLayer : range.layerCount;
+
+	if (range.baseMipLevel + levelCount > m_MipLevels || range.baseArrayLayer + layerCount > m_ArrayLayers)
+		throw VulkanException("Subresource range out of bounds", EXCEPTION_DATA());
+}
+
+void ImageLayoutTracker::Transition(IVulkanCommandBuffer& buf, const vk::Image& image,
+	const vk::ImageSubresourceRange& range, const Usage& newUsage, bool discard)
+{
+	uint32_t levelCount, layerCount;
+	ResolveRange(range, levelCount, layerCount);
+
+	// Adjacent mips that are coming from the same usage share a barrier
+	vk::ImageMemoryBarrier barrier;
+	vk::PipelineStageFlags srcStages;
+	Usage pendingUsage;
+	bool pending = false;
+
+	const auto flush = [&]
+	{
+		if (pending)
+			buf.QueueImageBarrier(srcStages, newUsage.m_Stages, barrier);
+
+		pending = false;
+	};
+
+	for (uint32_t layer = range.baseArrayLayer; layer < range.baseArrayLayer + layerCount; layer++)
+	{
+		for (uint32_t mip = range.baseMipLevel; mip < range.baseMipLevel + levelCount; mip++)
+		{
+			auto& usage = m_Subresources[size_t(layer) * m_MipLevels + mip];
+			if (!NeedsBarrier(usage, newUsage))
+			{
+				// Later writers need to wait on every reader
+				usage.m_Stages |= newUsage.m_Stages;
+				usage.m_Access |= newUsage.m_Access;
+				flush();
+				continue;
+			}
+
+			auto& srr = barrier.subresourceRange;
+			if (pending && usage == pendingUsage && srr.baseArrayLayer == layer &&
+				srr.baseMipLevel + srr.levelCount == mip)
+			{
+				srr.levelCount++;
+			}
+			else
+			{
+				flush();
+
+				barrier = vk::ImageMemoryBarrier{};
+				barrier.image = image;
+				barrier.oldLayout = discard ? vk::ImageLayout::eUndefined : usage.m_Layout;
+				barrier.newLayout = newUsage.m_Layout;
+				barrier.srcAccessMask = usage.m_Access & WRITE_ACCESS;
+				barrier.dstAccessMask = newUsage.m_Access;
+				barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+
+				srr.aspectMask = range.aspectMask;
+				srr.baseMipLevel = mip;
+				srr.levelCount = 1;
+				srr.baseArrayLayer = layer;
+				srr.layerCount = 1;
+
+				srcStages = usage.m_Stages ? usage.m_Stages : vk::PipelineStageFlagBits::eTopOfPipe;
+				pendingUsage = usage;
+				pending = true;
+			}
+
+			usage = newUsage;
+		}
+
+		flush();
+	}
+}
+
+bool ImageLayoutTracker::NeedsTransition(const vk::ImageSubresourceRange& range, const Usage& newUsage) const
+{
+	uint32_t levelCount, layerCount;
+	ResolveRange(range, levelCount, layerCount);
+
+	for (uint32_t layer = range.baseArrayLayer; layer < range.baseArrayLayer + layerCount; layer++)
+	{
+		for (uint32_t mip = range.baseMipLevel; mip < range.baseMipLevel + levelCount; mip++)
+		{
+			if (NeedsBarrier(m_Subresources[size_t(layer) * m_MipLevels + mip], newUsage))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+void ImageLayoutTracker::TransferOwnership(IVulkanCommandBuffer& srcBuf, IVulkanCommandBuffer& dstBuf,
+	const vk::Image& image, const vk::ImageSubresourceRange& range, const Usage& newUsage,
+	const vk::PipelineStageFlags& waitStages)
+{
+	uint32_t levelCount, layerCount;
+	ResolveRange(range, levelCount, layerCount);
+
+	vk::ImageMemoryBarrier barrier;
+	barrier.image = image;
+	barrier.newLayout = newUsage.m_Layout;
+	barrier.srcQueueFamilyIndex = srcBuf.GetQueue().GetQueueFamily();
+	barrier.dstQueueFamilyIndex = dstBuf.GetQueue().GetQueueFamily();
+	barrier.subresourceRange.aspectMask = range.aspectMask;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.layerCount = 1;
+
+	for (uint32_t layer = range.baseArrayLayer; layer < range.baseArrayLayer + layerCount; layer++)
+	{
+		for (uint32_t mip = range.baseMipLevel; mip < range.baseMipLevel + levelCount; mip++)
+		{
+			auto& usage = m_Subresources[size_t(layer) * m_MipLevels + mip];
+			if (usage == newUsage)
+				continue; // Already handed over
+
+			barrier.oldLayout = usage.m_Layout;
+			barrier.subresourceRange.baseMipLevel = mip;
+			barrier.subresourceRange.baseArrayLayer = layer;
+
+			// The layouts have to match on both halves, but each side only
+			// specifies the access on its own queue
+			auto release = barrier;
+			release.srcAccessMask = usage.m_Access & WRITE_ACCESS;
+			srcBuf.QueueImageBarrier(usage.m_Stages ? usage.m_Stages : vk::PipelineStageFlagBits::eTopOfPipe,
+				vk::PipelineStageFlagBits::eBottomOfPipe, release);
+
+			auto acquire = barrier;
+			acquire.dstAccessMask = newUsage.m_Access;
+			dstBuf.QueueImageBarrier(waitStages, newUsage.m_Stages, acquire);
+
+			usage = newUsage;
+		}
+	}
+}
+
+void ImageLayoutTracker::ResetAccess(const vk::PipelineStageFlags& stages)
+{
+	for (auto& usage : m_Subresources)
+	{
+		usage.m_Stages = stages;
+		usage.m_Access = {};
+	}
+}
+
+auto ImageLayoutTracker::GetUsage(uint32_t mipLevel, uint32_t arrayLayer) const -> const Usage&
+{
+	assert(mipLevel < m_MipLevels);
+	assert(arrayLayer < m_ArrayLayers);
+	return m_Subresources[size_t(arrayLayer) * m_MipLevels + mipLevel];
+}
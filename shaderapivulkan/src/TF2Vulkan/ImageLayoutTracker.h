@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace TF2Vulkan
+{
+	class IVulkanCommandBuffer;
+
+	// Remembers the layout of every mip level/array layer of an image, and how it
+	// was last accessed, so barriers can be built from what actually happened to
+	// it rather than from hardcoded guesses.
+	class ImageLayoutTracker final
+	{
+	public:
+		struct Usage final
+		{
+			vk::ImageLayout m_Layout = vk::ImageLayout::eUndefined;
+			vk::PipelineStageFlags m_Stages;
+			vk::AccessFlags m_Access;
+
+			bool operator==(const Usage& other) const;
+			bool operator!=(const Usage& other) const { return !operator==(other); }
+
+			static Usage TransferDst();
+			static Usage ShaderRead();
+			static Usage ColorAttachment();
+			static Usage DepthStencilAttachment();
+			static Usage Present();
+		};
+
+		ImageLayoutTracker() = default;
+		ImageLayoutTracker(uint32_t mipLevels, uint32_t arrayLayers);
+
+		// Queues barriers on buf for every subresource in range that isn't
+		// already usable as newUsage. If discard is true, the old contents of
+		// those subresources aren't preserved.
+		void Transition(IVulkanCommandBuffer& buf, const vk::Image& image, const vk::ImageSubresourceRange& range,
+			const Usage& newUsage, bool discard = false);
+
+		// True if Transition() would queue any barriers for range
+		bool NeedsTransition(const vk::ImageSubresourceRange& range, const Usage& newUsage) const;
+
+		// Like Transition(), but also hands range over from srcBuf's queue family
+		// to dstBuf's: the release half goes on srcBuf, the acquire half on dstBuf.
+		// dstBuf's submission has to wait on srcBuf's (at waitStages).
+		void TransferOwnership(IVulkanCommandBuffer& srcBuf, IVulkanCommandBuffer& dstBuf, const vk::Image& image,
+			const vk::ImageSubresourceRange& range, const Usage& newUsage, const vk::PipelineStageFlags& waitStages);
+
+		// For when something outside the command buffer (a semaphore wait) has
+		// already synchronized with every earlier access. Layouts are unchanged.
+		void ResetAccess(const vk::PipelineStageFlags& stages);
+
+		const Usage& GetUsage(uint32_t mipLevel, uint32_t arrayLayer) const;
+
+	private:
+		void ResolveRange(const vk::ImageSubresourceRange& range, uint32_t& levelCount, uint32_t& layerCount) const;
+
+		uint32_t m_MipLevels = 0;
+		uint32_t m_ArrayLayers = 0;
+		std::vector<Usage> m_Subresources; // Indexed by arrayLayer * m_MipLevels + mipLevel
+	};
+}
@@ -19,6 +19,9 @@
 #include <shaderapi/ishaderapi.h>
 #include <shaderapi/ishadershadow.h>
 
+#include <cstring>
+#include <string_view>
+
 namespace TF2Vulkan
 {
 	enum class LogicalShadowStateID : size_t
@@ -128,8 +131,68 @@ namespace TF2Vulkan
 		// Fog settings
 		ShaderFogMode_t m_FogMode = SHADER_FOGMODE_DISABLED;
 	};
+
+	// Canonical, tightly packed form of a LogicalShadowState. Snapshots are
+	// stored, deduplicated, hashed and compared in this form. The full struct is
+	// only rebuilt (Unpack()) when it's needed to create pipelines.
+	struct PackedShadowState final
+	{
+		explicit PackedShadowState(const LogicalShadowState& state);
+		LogicalShadowState Unpack() const;
+
+		bool operator==(const PackedShadowState& other) const
+		{
+			return !memcmp(this, &other, sizeof(*this));
+		}
+		bool operator!=(const PackedShadowState& other) const { return !operator==(other); }
+
+		VertexFormat_t m_VSVertexFormat;
+		MorphFormat_t m_VSMorphFormat;
+		int32_t m_VSStaticIndex;
+		int32_t m_PSStaticIndex;
+
+		// Interned CUtlSymbol IDs
+		uint16_t m_VSName;
+		uint16_t m_PSName;
+
+		uint16_t m_PSSamplersEnabled; // One bit per sampler
+		uint16_t m_PSSamplersSRGBRead;
+
+		uint32_t m_DepthTest : 1;
+		uint32_t m_DepthWrite : 1;
+		uint32_t m_RSBackFaceCulling : 1;
+		uint32_t m_OMSRGBWrite : 1;
+		uint32_t m_OMColorWrite : 1;
+		uint32_t m_OMAlphaTest : 1;
+		uint32_t m_OMAlphaBlending : 1;
+		uint32_t m_OMAlphaWrite : 1;
+		uint32_t m_DepthCompareFunc : 4;
+		uint32_t m_RSPolyOffsetMode : 2;
+		uint32_t m_RSFrontFacePolyMode : 2; // Relative to SHADER_POLYMODE_POINT
+		uint32_t m_RSBackFacePolyMode : 2;  // Relative to SHADER_POLYMODE_POINT
+		uint32_t m_OMAlphaTestFunc : 4;
+		uint32_t m_OMSrcFactor : 5;
+		uint32_t m_OMDstFactor : 5;
+
+		uint32_t m_OMAlphaTestRef : 8; // Already 0-255, like D3DRS_ALPHAREF
+		uint32_t m_FogMode : 4;
+		uint32_t m_Unused : 20;
+
+		ShaderAPITextureHandle_t m_OMDepthRT;
+		std::array<ShaderAPITextureHandle_t, 4> m_OMColorRTs;
+	};
+	static_assert(std::has_unique_object_representations_v<PackedShadowState>,
+		"PackedShadowState is compared with memcmp, it can't have any padding");
 }
 
+template<> struct ::std::hash<TF2Vulkan::PackedShadowState>
+{
+	inline size_t operator()(const TF2Vulkan::PackedShadowState& v) const
+	{
+		return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(&v), sizeof(v)));
+	}
+};
+
 STD_HASH_DEFINITION(ShaderViewport_t,
 	v.m_nVersion,
 	v.m_nTopLeftX,
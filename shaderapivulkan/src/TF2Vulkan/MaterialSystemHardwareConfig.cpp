@@ -125,6 +125,8 @@ namespace
 		int NumIntegerPixelShaderConstants() const override;
 
 		uint32_t MaxVertexAttributes() const override;
+		size_t MinUniformBufferOffsetAlignment() const override;
+		size_t OptimalBufferCopyOffsetAlignment() const override;
 
 		void Init() override;
 
@@ -652,6 +654,16 @@ uint32_t MaterialSystemHardwareConfig::MaxVertexAttributes() const
 	return GetLimits().maxVertexInputAttributes;
 }
 
+size_t MaterialSystemHardwareConfig::MinUniformBufferOffsetAlignment() const
+{
+	return size_t(GetLimits().minUniformBufferOffsetAlignment);
+}
+
+size_t MaterialSystemHardwareConfig::OptimalBufferCopyOffsetAlignment() const
+{
+	return size_t(GetLimits().optimalBufferCopyOffsetAlignment);
+}
+
 void MaterialSystemHardwareConfig::Init()
 {
 	assert(!m_Init);
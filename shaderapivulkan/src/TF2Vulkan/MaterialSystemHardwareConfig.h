@@ -29,6 +29,8 @@ namespace TF2Vulkan
 		}
 
 		virtual uint32_t MaxVertexAttributes() const = 0;
+		virtual size_t MinUniformBufferOffsetAlignment() const = 0;
+		virtual size_t OptimalBufferCopyOffsetAlignment() const = 0;
 	};
 
 	extern IMaterialSystemHardwareConfigInternal& g_MatSysConfig;
@@ -2,80 +2,57 @@
 
 using namespace TF2Vulkan;
 
-struct ResourceBlob::BufferNode : IResource
-{
-	vk::UniqueBuffer m_Buffer;
-};
-struct ResourceBlob::ImageNode : IResource
-{
-	vk::UniqueImage m_Image;
-};
-struct ResourceBlob::ImageViewNode : IResource
-{
-	vk::UniqueImageView m_ImageView;
-};
-struct ResourceBlob::AllocatedBufferNode : IResource
-{
-	vma::AllocatedBuffer m_Buffer;
-};
-struct ResourceBlob::AllocatedImageNode : IResource
-{
-	vma::AllocatedImage m_Image;
-};
-struct ResourceBlob::DescriptorSetNode : IResource
-{
-	vk::UniqueDescriptorSet m_DescriptorSet;
-};
-
 void ResourceBlob::AddResource(vk::UniqueBuffer&& buffer)
 {
-	auto newNode = std::make_unique<BufferNode>();
-	newNode->m_Buffer = std::move(buffer);
-	AddResource(std::move(newNode));
+	m_Buffers.push_back(std::move(buffer));
 }
 
 void ResourceBlob::AddResource(vk::UniqueImage&& image)
 {
-	auto newNode = std::make_unique<ImageNode>();
-	newNode->m_Image = std::move(image);
-	AddResource(std::move(newNode));
+	m_Images.push_back(std::move(image));
 }
 
 void ResourceBlob::AddResource(vk::UniqueImageView&& imageView)
 {
-	auto newNode = std::make_unique<ImageViewNode>();
-	newNode->m_ImageView = std::move(imageView);
-	AddResource(std::move(newNode));
+	m_ImageViews.push_back(std::move(imageView));
 }
 
 void ResourceBlob::AddResource(vma::AllocatedBuffer&& buffer)
 {
-	auto newNode = std::make_unique<AllocatedBufferNode>();
-	newNode->m_Buffer = std::move(buffer);
-	AddResource(std::move(newNode));
+	m_AllocatedBuffers.push_back(std::move(buffer));
 }
 
 void ResourceBlob::AddResource(vma::AllocatedImage&& image)
 {
-	auto newNode = std::make_unique<AllocatedImageNode>();
-	newNode->m_Image = std::move(image);
-	AddResource(std::move(newNode));
+	m_AllocatedImages.push_back(std::move(image));
 }
 
 void ResourceBlob::AddResource(vk::UniqueDescriptorSet&& descriptorSet)
 {
-	auto newNode = std::make_unique<DescriptorSetNode>();
-	newNode->m_DescriptorSet = std::move(descriptorSet);
-	AddResource(std::move(newNode));
+	m_DescriptorSets.push_back(std::move(descriptorSet));
+}
+
+void ResourceBlob::AddResource(vk::UniqueFramebuffer&& framebuffer)
+{
+	m_Framebuffers.push_back(std::move(framebuffer));
 }
 
 void ResourceBlob::ReleaseAttachedResources()
 {
-	m_FirstNode.reset();
+	// Framebuffers, views and descriptor sets first, since they refer to the images and buffers
+	m_Framebuffers.clear();
+	m_DescriptorSets.clear();
+	m_ImageViews.clear();
+
+	m_Buffers.clear();
+	m_Images.clear();
+	m_AllocatedBuffers.clear();
+	m_AllocatedImages.clear();
 }
 
-void ResourceBlob::AddResource(std::unique_ptr<IResource>&& node)
+bool ResourceBlob::empty() const
 {
-	node->m_Next = std::move(m_FirstNode);
-	m_FirstNode = std::move(node);
+	return m_Buffers.empty() && m_Images.empty() && m_ImageViews.empty() &&
+		m_AllocatedBuffers.empty() && m_AllocatedImages.empty() && m_DescriptorSets.empty() &&
+		m_Framebuffers.empty();
 }
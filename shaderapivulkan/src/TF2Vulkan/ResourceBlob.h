@@ -1,7 +1,11 @@
 #pragma once
 
+#include <vector>
+
 namespace TF2Vulkan
 {
+	// Owns resources until they are released all at once. The vectors keep their
+	// capacity when released, so a reused blob doesn't allocate in steady state.
 	class ResourceBlob
 	{
 	public:
@@ -11,6 +15,7 @@ namespace TF2Vulkan
 		void AddResource(vma::AllocatedBuffer&& buffer);
 		void AddResource(vma::AllocatedImage&& image);
 		void AddResource(vk::UniqueDescriptorSet&& descriptor);
+		void AddResource(vk::UniqueFramebuffer&& framebuffer);
 
 		template<typename TContainer>
 		auto AddResource(TContainer&& container) -> decltype(std::begin(container), std::end(container), AddResource(std::move(*std::begin(container))))
@@ -19,25 +24,16 @@ namespace TF2Vulkan
 				AddResource(std::move(val));
 		}
 
-	protected:
 		void ReleaseAttachedResources();
+		bool empty() const;
 
 	private:
-		struct BufferNode;
-		struct ImageNode;
-		struct ImageViewNode;
-		struct AllocatedBufferNode;
-		struct AllocatedImageNode;
-		struct DescriptorSetNode;
-
-		struct IResource
-		{
-			virtual ~IResource() = default;
-			std::unique_ptr<IResource> m_Next;
-		};
-
-		void AddResource(std::unique_ptr<IResource>&& node);
-
-		std::unique_ptr<IResource> m_FirstNode;
+		std::vector<vk::UniqueBuffer> m_Buffers;
+		std::vector<vk::UniqueImage> m_Images;
+		std::vector<vk::UniqueImageView> m_ImageViews;
+		std::vector<vma::AllocatedBuffer> m_AllocatedBuffers;
+		std::vector<vma::AllocatedImage> m_AllocatedImages;
+		std::vector<vk::UniqueDescriptorSet> m_DescriptorSets;
+		std::vector<vk::UniqueFramebuffer> m_Framebuffers;
 	};
 }
@@ -1,5 +1,6 @@
 #include "FormatInfo.h"
 #include "IStateManagerDynamic.h"
+#include "IStateManagerVulkan.h"
 #include "SamplerSettings.h"
 #include "interface/internal/IShaderDeviceInternal.h"
 #include "interface/internal/IStateManagerStatic.h"
@@ -358,7 +359,6 @@ IShaderTextureManager& TF2Vulkan::g_TextureManager = s_ShaderAPI;
 void ShaderAPI::ClearBuffers(bool clearColor, bool clearDepth, bool clearStencil, int rtWidth, int rtHeight)
 {
 	LOG_FUNC();
-	return; // TODO: Fix renderdoc crash when this is enabled
 	if (!g_StateManagerStatic.IsAnyRenderTargetBound())
 		return;
 
@@ -368,45 +368,14 @@ void ShaderAPI::ClearBuffers(bool clearColor, bool clearDepth, bool clearStencil
 		PRINTF_BOOL(clearColor), PRINTF_BOOL(clearDepth), PRINTF_BOOL(clearStencil),
 		rtWidth, rtHeight);
 
-	const auto curSnapshot = g_StateManagerStatic.TakeSnapshot();
-	g_StateManagerStatic.ApplyState(curSnapshot, cmdBuf);
-	const auto& curState = g_StateManagerStatic.GetState(curSnapshot);
+	const auto curState = g_StateManagerStatic.GetState(g_StateManagerStatic.TakeSnapshot());
 
-	Util::InPlaceVector<vk::ClearAttachment, 2> atts;
-	vk::ClearRect rects[2];
-	{
-		Util::SafeConvert(rtWidth, rects[0].rect.extent.width);
-		Util::SafeConvert(rtHeight, rects[0].rect.extent.height);
-		rects[0].layerCount = 1;
-		rects[1] = rects[0];
-	}
-
-	if (clearColor && curState.m_OMColorRTs[0] >= 0)
-	{
-		auto& att = atts.emplace_back();
-		att.aspectMask |= vk::ImageAspectFlagBits::eColor;
-		Util::algorithm::copy(GetDynamicState().m_ClearColor, att.clearValue.color.float32);
-		att.colorAttachment = 0;
-	}
-
-	if ((clearDepth || clearStencil) && curState.m_OMDepthRT >= 0)
-	{
-		auto& att = atts.emplace_back();
-
-		if (clearColor)
-			att = {};
-
-		if (clearDepth)
-			att.aspectMask |= vk::ImageAspectFlagBits::eDepth;
-
-		if (clearStencil)
-			att.aspectMask |= vk::ImageAspectFlagBits::eStencil;
-
-		att.clearValue.depthStencil.depth = 1;
-		att.clearValue.depthStencil.stencil = 0;
-	}
+	uint32_t width, height;
+	Util::SafeConvert(rtWidth, width);
+	Util::SafeConvert(rtHeight, height);
 
-	cmdBuf.clearAttachments(atts.size(), atts.data(), atts.size(), rects);
+	g_StateManagerVulkan.ClearRenderTargets(curState, GetDynamicState(),
+		clearColor, clearDepth, clearStencil, width, height, cmdBuf);
 }
 
 bool ShaderAPI::SetMode(void* hwnd, int adapter, const ShaderDeviceInfo_t& info)
@@ -458,7 +427,7 @@ IMesh* ShaderAPI::GetDynamicMeshEx(IMaterial* material, VertexFormat_t vertexFor
 	if (auto found = m_DynamicMeshes.find(fmt); found != m_DynamicMeshes.end())
 		return &found->second;
 
-	return &m_DynamicMeshes.emplace(fmt, VulkanMesh(fmt)).first->second;
+	return &m_DynamicMeshes.emplace(fmt, VulkanMesh(fmt, true)).first->second;
 }
 
 bool ShaderAPI::IsTranslucent(StateSnapshot_t id) const
@@ -494,7 +463,7 @@ VertexFormat_t ShaderAPI::ComputeVertexFormat(int snapshotCount, StateSnapshot_t
 	if (snapshotCount <= 0 || !ids)
 		return VERTEX_FORMAT_UNKNOWN;
 
-	const auto& vtxFmt0 = g_StateManagerStatic.GetState(ids[0]).m_VSVertexFormat;
+	const auto vtxFmt0 = g_StateManagerStatic.GetState(ids[0]).m_VSVertexFormat;
 	VertexCompressionType_t compression = CompressionType(vtxFmt0);
 	uint_fast8_t userDataSize = UserDataSize(vtxFmt0);
 	uint_fast8_t boneCount = NumBoneWeights(vtxFmt0);
@@ -505,7 +474,7 @@ VertexFormat_t ShaderAPI::ComputeVertexFormat(int snapshotCount, StateSnapshot_t
 
 	for (int i = 1; i < snapshotCount; i++)
 	{
-		const auto& fmt = g_StateManagerStatic.GetState(*ids).m_VSVertexFormat;
+		const auto fmt = g_StateManagerStatic.GetState(*ids).m_VSVertexFormat;
 
 		if (auto thisComp = CompressionType(fmt); thisComp != compression)
 		{
@@ -689,7 +658,8 @@ void ShaderAPI::SetLinearToGammaConversionTextures(ShaderAPITextureHandle_t srgb
 
 ShaderAPI::ShaderTexture::ShaderTexture(std::string&& debugName, ShaderAPITextureHandle_t handle,
 	const vk::ImageCreateInfo& ci, vma::AllocatedImage&& img) :
-	m_DebugName(std::move(debugName)), m_Handle(handle), m_CreateInfo(ci), m_Image(std::move(img))
+	m_DebugName(std::move(debugName)), m_Handle(handle), m_CreateInfo(ci), m_Image(std::move(img)),
+	m_LayoutTracker(ci.mipLevels, ci.arrayLayers)
 {
 }
 
@@ -718,7 +688,8 @@ void ShaderAPI::RenderPass(int passID, int passCount)
 	cmdBuf.InsertDebugLabel("ShaderAPI::RenderPass(%i, %i)", passID, passCount);
 
 	g_StateManagerDynamic.PreDraw();
-	g_StateManagerStatic.ApplyCurrentState(cmdBuf);
+	if (!g_StateManagerStatic.ApplyCurrentState(cmdBuf))
+		return; // Pipeline still compiling in the background
 
 	auto& activeMesh = GetActiveMesh();
 	activeMesh.m_Mesh->DrawInternal(cmdBuf, activeMesh.m_FirstIndex, activeMesh.m_IndexCount);
@@ -1,14 +1,29 @@
+#include "DeferredDestructionQueue.h"
 #include "FormatInfo.h"
 #include "interface/internal/IShaderAPIInternal.h"
 #include "interface/internal/IShaderAPITexture.h"
 #include "IShaderTextureManager.h"
+#include "IStateManagerVulkan.h"
 #include "interface/internal/IShaderDeviceInternal.h"
 #include "ShaderDeviceMgr.h"
+#include "StagingArena.h"
+#include "TextureStreamer.h"
+#include "UploadBatch.h"
 #include "VulkanCommandBufferBase.h"
 #include "VulkanMesh.h"
 
 #include <TF2Vulkan/Util/interface.h>
 
+#include <filesystem.h>
+#include <tier1/convar.h>
+#include <tier1/utlbuffer.h>
+#include <tier2/tier2.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <future>
+
 #pragma push_macro("min")
 #pragma push_macro("max")
 
@@ -25,10 +40,12 @@ namespace
 	{
 		const vk::Queue& GetQueue() const override { return m_Queue; }
 		const vk::CommandPool& GetCmdPool() const override { return m_CommandPool.get(); }
+		uint32_t GetQueueFamily() const override { return m_QueueFamily; }
 		const vk::Device& GetDevice() const override;
 
 		vk::Queue m_Queue;
 		vk::UniqueCommandPool m_CommandPool;
+		uint32_t m_QueueFamily = 0;
 	};
 
 	struct VulkanSwapChain
@@ -42,17 +59,27 @@ namespace
 		{
 			vk::Image m_Image;
 			vk::UniqueImageView m_ImageView;
-
-			vk::UniqueSemaphore m_ImageAvailableSemaphore;
-			vk::UniqueSemaphore m_RenderFinishedSemaphore;
-			vk::UniqueFence m_InFlightFence;
-
-			std::unique_ptr<IVulkanCommandBuffer> m_PrimaryCmdBuf;
+			ImageLayoutTracker m_LayoutTracker{ 1, 1 };
 		};
 
 		std::vector<PerImage> m_Images;
 
-		uint32_t m_CurrentFrame = 0;
+		uint32_t m_CurrentImage = 0; // Acquired at the start of every frame
+	};
+
+	// Everything needed to record a frame while previous ones are still executing
+	struct FrameSlot
+	{
+		vk::UniqueSemaphore m_ImageAvailableSemaphore;
+		vk::UniqueSemaphore m_RenderFinishedSemaphore;
+		vk::UniqueFence m_InFlightFence;
+
+		std::unique_ptr<IVulkanCommandBuffer> m_PrimaryCmdBuf;
+		std::unique_ptr<IVulkanCommandBuffer> m_UploadCmdBuf; // Submitted right before m_PrimaryCmdBuf
+
+		// Only if there's a separate transfer queue
+		std::unique_ptr<IVulkanCommandBuffer> m_TransferCmdBuf;
+		vk::UniqueSemaphore m_TransferFinishedSemaphore;
 	};
 
 	class ShaderDevice final : public IShaderDeviceInternal
@@ -132,9 +159,20 @@ namespace
 
 		bool IsReady() const override;
 		IVulkanCommandBuffer& GetPrimaryCmdBuf() override;
+		uint64_t GetFrameNumber() const override { return m_Data.m_FrameNumber; }
+		const vk::PipelineCache& GetPipelineCache() const override { return m_Data.m_PipelineCache.get(); }
+		void SavePipelineCache() override;
 		const vk::DispatchLoaderDynamic& GetDynamicDispatch() const override { return m_Data.m_DynamicLoader; }
+		bool HasExtendedDynamicState() const override { return m_Data.m_ExtendedDynamicState; }
 
 	private:
+		void CreateFrameSlots();
+		void BeginFrame();
+		FrameSlot& GetCurrentFrameSlot();
+
+		void SavePipelineCacheAsync();
+		void WritePipelineCache();
+
 		// In a struct so we can easily reset all the vulkan-related stuff on shutdown
 		struct VulkanData : VulkanInitData
 		{
@@ -152,8 +190,20 @@ namespace
 
 			const IShaderAPITexture* m_DepthTexture = nullptr;
 
+			uint64_t m_FrameNumber = 0;
+
+			vk::UniquePipelineCache m_PipelineCache;
+			size_t m_PipelineCacheSavedSize = 0;
+
+			std::array<FrameSlot, MAX_FRAMES_IN_FLIGHT> m_FrameSlots;
+			uint32_t m_FramesInFlight = 0; // Zero until SetMode() is done
+
 		} m_Data;
 
+		// Periodic saves run here, so serializing the cache doesn't hitch the frame.
+		// Destroyed before m_Data, which waits for it.
+		std::future<void> m_PipelineCacheSave;
+
 		struct BackbufferColorTexture : IShaderAPITexture
 		{
 			std::string_view GetDebugName() const override { return "__rt_tf2vulkan_backbuffer"; }
@@ -162,11 +212,19 @@ namespace
 			const vk::ImageView& FindOrCreateView() override;
 			const vk::ImageView& FindOrCreateView(const vk::ImageViewCreateInfo& createInfo) override { NOT_IMPLEMENTED_FUNC(); }
 			ShaderAPITextureHandle_t GetHandle() const override { return 0; }
+			ImageLayoutTracker& GetLayoutTracker() override;
 		};
 		BackbufferColorTexture m_BackbufferColorTexture;
 	};
 }
 
+static ConVar mat_vulkan_frames_in_flight("mat_vulkan_frames_in_flight", "2", FCVAR_NONE,
+	"Number of frames the CPU may record ahead of the GPU. Takes effect on the next SetMode().",
+	true, 1, true, MAX_FRAMES_IN_FLIGHT);
+
+static constexpr char PIPELINE_CACHE_FILENAME[] = "tf2vulkan_pipelinecache.bin";
+static constexpr uint64_t PIPELINE_CACHE_SAVE_INTERVAL = 60 * 60; // In frames
+
 static ShaderDevice s_Device;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(ShaderDevice, IShaderDevice, SHADER_DEVICE_INTERFACE_VERSION, s_Device);
 IShaderDeviceInternal& TF2Vulkan::g_ShaderDevice = s_Device;
@@ -229,83 +287,196 @@ void ShaderDevice::Present()
 {
 	LOG_FUNC();
 
-	// TODO: What is this function actually even doing
 	auto& scData = m_Data.m_SwapChain;
 	auto& sc = scData.m_SwapChain.get();
-	auto& currentFrame = scData.m_CurrentFrame;
-	auto& curImg = scData.m_Images.at(currentFrame);
-	auto& device = GetVulkanDevice();
+	auto& frame = GetCurrentFrameSlot();
 
-	auto pixScope = curImg.m_PrimaryCmdBuf->DebugRegionBegin("ShaderDevice::Present()");
+#pragma warning(suppress : 4996)
+	auto& primaryCmdBuf = *frame.m_PrimaryCmdBuf;
 
-	constexpr auto timeout = std::numeric_limits<uint32_t>::max();
+	{
+		auto pixScope = primaryCmdBuf.DebugRegionBegin("ShaderDevice::Present()");
 
-	device.waitForFences(curImg.m_InFlightFence.get(), true, timeout);
-	device.resetFences(curImg.m_InFlightFence.get());
+		primaryCmdBuf.TryEndRenderPass();
 
-	const auto [acquireResult, acquireImageIndex] = device.acquireNextImageKHR(sc,
-		std::numeric_limits<uint64_t>::max(), curImg.m_ImageAvailableSemaphore.get(),
-		nullptr);
+		// Prepare swapchain for presentation
+		m_BackbufferColorTexture.Transition(primaryCmdBuf, ImageLayoutTracker::Usage::Present());
+	}
 
-#pragma warning(suppress : 4996)
-	auto& primaryCmdBuf = *curImg.m_PrimaryCmdBuf;
-	primaryCmdBuf.endRenderPass();
+	primaryCmdBuf.end();
 
-	// Prepare swapchain for presentation
-	TransitionImageLayout(curImg.m_Image, scData.m_SwapChainCreateInfo.imageFormat,
-		vk::ImageLayout::eUndefined, vk::ImageLayout::ePresentSrcKHR,
-		primaryCmdBuf, 0);
+	// Same queue, so submission order (and the barriers at the end of the
+	// batch) are enough to have the uploads land before the frame uses them.
+	// Anything copied on the transfer queue is waited for by the upload
+	// submission, only at the stages that read it.
+	if (!g_UploadBatch.IsEmpty())
+	{
+		vk::CommandBufferBeginInfo beginInfo;
+		beginInfo.flags |= vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
 
-	primaryCmdBuf.end();
+		auto& uploadCmdBuf = *frame.m_UploadCmdBuf;
+		uploadCmdBuf.reset();
+		uploadCmdBuf.begin(beginInfo);
+
+		auto transferCmdBuf = frame.m_TransferCmdBuf.get();
+		if (transferCmdBuf)
+		{
+			transferCmdBuf->reset();
+			transferCmdBuf->begin(beginInfo);
+		}
+
+		if (g_UploadBatch.Record(uploadCmdBuf, transferCmdBuf))
+		{
+			vk::SubmitInfo transferSubmitInfo;
+			transferSubmitInfo.signalSemaphoreCount = 1;
+			transferSubmitInfo.pSignalSemaphores = &frame.m_TransferFinishedSemaphore.get();
+			transferCmdBuf->Submit(transferSubmitInfo);
+
+			vk::SubmitInfo uploadSubmitInfo;
+			uploadSubmitInfo.waitSemaphoreCount = 1;
+			uploadSubmitInfo.pWaitSemaphores = &frame.m_TransferFinishedSemaphore.get();
+			const vk::PipelineStageFlags waitStages = UploadBatch::TRANSFER_WAIT_STAGES;
+			uploadSubmitInfo.pWaitDstStageMask = &waitStages;
+			uploadCmdBuf.Submit(uploadSubmitInfo);
+		}
+		else
+		{
+			if (transferCmdBuf)
+				transferCmdBuf->end();
+
+			uploadCmdBuf.Submit();
+		}
+	}
 
 	auto& q = m_Data.m_GraphicsQueue.m_Queue;
 	{
 		vk::SubmitInfo submitInfo;
 		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = &curImg.m_ImageAvailableSemaphore.get();
+		submitInfo.pWaitSemaphores = &frame.m_ImageAvailableSemaphore.get();
 
 		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = &curImg.m_RenderFinishedSemaphore.get();
+		submitInfo.pSignalSemaphores = &frame.m_RenderFinishedSemaphore.get();
 
+		// The swap chain image is only ever a color attachment, so only color output
+		// has to wait for it. Its first layout transition of the frame chains from
+		// this stage (see BeginFrame()), and everything before that can overlap
+		// with the acquire.
 		const vk::PipelineStageFlags waitStages = vk::PipelineStageFlagBits::eColorAttachmentOutput;
 		submitInfo.pWaitDstStageMask = &waitStages;
 
-		primaryCmdBuf.Submit(submitInfo, curImg.m_InFlightFence.get());
-
-		device.waitForFences(curImg.m_InFlightFence.get(), true, timeout);
+		primaryCmdBuf.Submit(submitInfo, frame.m_InFlightFence.get());
 	}
 
 	// Present
 	{
 		vk::PresentInfoKHR pInfo;
 
-		pInfo.pWaitSemaphores = &curImg.m_RenderFinishedSemaphore.get();
+		pInfo.pWaitSemaphores = &frame.m_RenderFinishedSemaphore.get();
 		pInfo.waitSemaphoreCount = 1;
 
 		pInfo.pSwapchains = &sc;
 		pInfo.swapchainCount = 1;
 
-		pInfo.pImageIndices = &currentFrame;
+		pInfo.pImageIndices = &scData.m_CurrentImage;
 
 		q.presentKHR(pInfo);
+	}
+
+	m_Data.m_FrameNumber++;
+	BeginFrame();
+
+	// Streamed mips uploaded now land before anything in the new frame samples them
+	g_TextureStreamer.Update();
+
+	if ((m_Data.m_FrameNumber % PIPELINE_CACHE_SAVE_INTERVAL) == 0)
+		SavePipelineCacheAsync();
+}
+
+void ShaderDevice::BeginFrame()
+{
+	auto& device = GetVulkanDevice();
+	auto& scData = m_Data.m_SwapChain;
+	auto& frame = GetCurrentFrameSlot();
+
+	// This is the only place the CPU waits on the GPU: for the last submission
+	// that used this frame slot, m_FramesInFlight frames ago.
+	device.waitForFences(frame.m_InFlightFence.get(), true, std::numeric_limits<uint64_t>::max());
+	device.resetFences(frame.m_InFlightFence.get());
 
-		q.waitIdle();
+	if (m_Data.m_FrameNumber >= m_Data.m_FramesInFlight)
+	{
+		const auto completedFrame = m_Data.m_FrameNumber - m_Data.m_FramesInFlight;
+		g_DeferredDestruction.ReleaseCompleted(completedFrame);
+		g_StagingArena.ReleaseCompleted(completedFrame);
 	}
 
-	// Reset the command buffer
+	auto& primaryCmdBuf = *frame.m_PrimaryCmdBuf;
+	primaryCmdBuf.reset();
+
+	vk::CommandBufferBeginInfo beginInfo;
+	beginInfo.flags |= vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+	primaryCmdBuf.begin(beginInfo);
+
+	const auto acquired = device.acquireNextImageKHR(scData.m_SwapChain.get(),
+		std::numeric_limits<uint64_t>::max(), frame.m_ImageAvailableSemaphore.get(), nullptr);
+	scData.m_CurrentImage = acquired.value;
+
+	// The image available semaphore is waited on at eColorAttachmentOutput, so the
+	// first barrier on the image has to start from that stage to chain off the
+	// wait. The first render pass this frame does the actual transition, from
+	// whatever layout the image was last left in.
+	scData.m_Images.at(scData.m_CurrentImage).m_LayoutTracker.ResetAccess(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+}
+
+FrameSlot& ShaderDevice::GetCurrentFrameSlot()
+{
+	assert(m_Data.m_FramesInFlight > 0);
+	return m_Data.m_FrameSlots.at(size_t(m_Data.m_FrameNumber % m_Data.m_FramesInFlight));
+}
+
+void ShaderDevice::CreateFrameSlots()
+{
+	auto& device = GetVulkanDevice();
+
+	vk::SemaphoreCreateInfo sCI;
+
+	vk::FenceCreateInfo fCI;
+	fCI.flags = vk::FenceCreateFlagBits::eSignaled;
+
+	const auto framesInFlight = std::clamp<uint32_t>(
+		mat_vulkan_frames_in_flight.GetInt(), 1, MAX_FRAMES_IN_FLIGHT);
+
+	for (uint32_t i = 0; i < framesInFlight; i++)
 	{
-		primaryCmdBuf.reset();
+		auto& frame = m_Data.m_FrameSlots.at(i);
 
-		vk::CommandBufferBeginInfo beginInfo;
-		beginInfo.flags |= vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-		primaryCmdBuf.begin(beginInfo);
+		char buf[128];
+		frame.m_ImageAvailableSemaphore = device.createSemaphoreUnique(sCI);
+		sprintf_s(buf, "TF2Vulkan Image Available Semaphore #%u", i);
+		SetDebugName(frame.m_ImageAvailableSemaphore, buf);
+
+		frame.m_RenderFinishedSemaphore = device.createSemaphoreUnique(sCI);
+		sprintf_s(buf, "TF2Vulkan Render Finished Semaphore #%u", i);
+		SetDebugName(frame.m_RenderFinishedSemaphore, buf);
+
+		frame.m_InFlightFence = device.createFenceUnique(fCI);
+		sprintf_s(buf, "TF2Vulkan In Flight Fence #%u", i);
+		SetDebugName(frame.m_InFlightFence, buf);
 
-		TransitionImageLayout(curImg.m_Image, scData.m_SwapChainCreateInfo.imageFormat,
-			vk::ImageLayout::ePresentSrcKHR, vk::ImageLayout::eColorAttachmentOptimal,
-			primaryCmdBuf, 0);
+		frame.m_PrimaryCmdBuf = GetGraphicsQueue().CreateCmdBuffer();
+		frame.m_UploadCmdBuf = GetGraphicsQueue().CreateCmdBuffer();
+
+		if (m_Data.m_TransferQueue)
+		{
+			frame.m_TransferCmdBuf = m_Data.m_TransferQueue->CreateCmdBuffer();
+
+			frame.m_TransferFinishedSemaphore = device.createSemaphoreUnique(sCI);
+			sprintf_s(buf, "TF2Vulkan Transfer Finished Semaphore #%u", i);
+			SetDebugName(frame.m_TransferFinishedSemaphore, buf);
+		}
 	}
 
-	currentFrame = (currentFrame + 1) % scData.m_Images.size();
+	m_Data.m_FramesInFlight = framesInFlight;
 }
 
 void ShaderDevice::GetWindowSize(int& width, int& height) const
@@ -375,15 +546,13 @@ void ShaderDevice::DestroyPixelShader(PixelShaderHandle_t shader)
 
 IMesh* ShaderDevice::CreateStaticMesh(VertexFormat_t format, const char* textureBudgetGroup, IMaterial* material)
 {
-	// TODO
-	NOT_IMPLEMENTED_FUNC_NOBREAK();
-	return new VulkanMesh(VertexFormat(format));
+	LOG_FUNC();
+	return new VulkanMesh(VertexFormat(format), false);
 }
 
 void ShaderDevice::DestroyStaticMesh(IMesh* mesh)
 {
-	// TODO
-	NOT_IMPLEMENTED_FUNC_NOBREAK();
+	LOG_FUNC();
 	delete assert_cast<VulkanMesh*>(mesh);
 }
 
@@ -473,6 +642,8 @@ static VulkanQueue CreateQueueWrapper(const vk::Device& device, uint32_t queueFa
 	if (!retVal.m_Queue)
 		Error(TF2VULKAN_PREFIX "Failed to retrieve %s queue from index %u\n", queueType, queueFamily);
 
+	retVal.m_QueueFamily = queueFamily;
+
 	retVal.m_CommandPool = CreateCommandPool(device, queueFamily);
 
 	char buf[128];
@@ -485,6 +656,102 @@ static VulkanQueue CreateQueueWrapper(const vk::Device& device, uint32_t queueFa
 	return retVal;
 }
 
+// Returns an empty vector if there's no usable cache on disk
+static std::vector<std::byte> LoadPipelineCacheData()
+{
+	CUtlBuffer buf;
+	if (!g_pFullFileSystem || !g_pFullFileSystem->ReadFile(PIPELINE_CACHE_FILENAME, "MOD", buf))
+		return {};
+
+	const size_t size = Util::SafeConvert<size_t>(buf.TellPut());
+
+	// Layout of VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+	struct Header
+	{
+		uint32_t m_Length;
+		uint32_t m_Version;
+		uint32_t m_VendorID;
+		uint32_t m_DeviceID;
+		uint8_t m_UUID[VK_UUID_SIZE];
+	} header;
+
+	if (size < sizeof(header))
+	{
+		Warning(TF2VULKAN_PREFIX "Ignoring truncated pipeline cache %s\n", PIPELINE_CACHE_FILENAME);
+		return {};
+	}
+
+	memcpy(&header, buf.Base(), sizeof(header));
+
+	// A cache from another driver or GPU is useless, and some drivers don't handle it gracefully
+	const auto props = g_ShaderDeviceMgr.GetAdapter().getProperties();
+	if (header.m_Length < sizeof(header) ||
+		header.m_Version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+		header.m_VendorID != props.vendorID ||
+		header.m_DeviceID != props.deviceID ||
+		memcmp(header.m_UUID, props.pipelineCacheUUID, VK_UUID_SIZE))
+	{
+		Msg(TF2VULKAN_PREFIX "Pipeline cache %s is from a different device or driver, discarding\n",
+			PIPELINE_CACHE_FILENAME);
+		return {};
+	}
+
+	const auto data = reinterpret_cast<const std::byte*>(buf.Base());
+	return std::vector<std::byte>(data, data + size);
+}
+
+void ShaderDevice::SavePipelineCache()
+{
+	LOG_FUNC();
+
+	if (m_PipelineCacheSave.valid())
+		m_PipelineCacheSave.wait();
+
+	WritePipelineCache();
+}
+
+void ShaderDevice::SavePipelineCacheAsync()
+{
+	LOG_FUNC();
+
+	// Still writing the last one, try again next interval
+	if (m_PipelineCacheSave.valid() &&
+		m_PipelineCacheSave.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+	{
+		return;
+	}
+
+	m_PipelineCacheSave = std::async(std::launch::async, [this] { WritePipelineCache(); });
+}
+
+void ShaderDevice::WritePipelineCache()
+{
+	// May run on a worker thread (no LOG_FUNC). Only one of these runs at a time,
+	// and vkGetPipelineCacheData doesn't need external synchronization.
+	if (!m_Data.m_PipelineCache || !g_pFullFileSystem)
+		return;
+
+	auto& device = GetVulkanDevice();
+
+	// Pipeline caches only ever grow, so the size tells us if anything was added
+	size_t size = 0;
+	device.getPipelineCacheData(m_Data.m_PipelineCache.get(), &size, nullptr);
+	if (size == m_Data.m_PipelineCacheSavedSize)
+		return;
+
+	const auto data = device.getPipelineCacheData(m_Data.m_PipelineCache.get());
+
+	CUtlBuffer buf;
+	buf.Put(data.data(), Util::SafeConvert<int>(data.size()));
+	if (!g_pFullFileSystem->WriteFile(PIPELINE_CACHE_FILENAME, "MOD", buf))
+	{
+		Warning(TF2VULKAN_PREFIX "Failed to write pipeline cache %s\n", PIPELINE_CACHE_FILENAME);
+		return;
+	}
+
+	m_Data.m_PipelineCacheSavedSize = data.size();
+}
+
 void ShaderDevice::VulkanInit(VulkanInitData&& inData)
 {
 	m_Data = std::move(inData);
@@ -503,6 +770,19 @@ void ShaderDevice::VulkanInit(VulkanInitData&& inData)
 
 	if (m_Data.m_TransferQueueIndex)
 		m_Data.m_TransferQueue = CreateQueueWrapper(device.get(), m_Data.m_TransferQueueIndex.value(), "Transfer");
+
+	// Pipeline cache
+	{
+		const auto initialData = LoadPipelineCacheData();
+
+		vk::PipelineCacheCreateInfo ci;
+		ci.initialDataSize = initialData.size();
+		ci.pInitialData = initialData.data();
+
+		m_Data.m_PipelineCache = device->createPipelineCacheUnique(ci);
+		m_Data.m_PipelineCacheSavedSize = initialData.size();
+		SetDebugName(m_Data.m_PipelineCache, "TF2Vulkan Pipeline Cache");
+	}
 }
 
 const vk::Device& ShaderDevice::GetVulkanDevice()
@@ -603,43 +883,6 @@ bool ShaderDevice::SetMode(void* hwnd, int adapter, const ShaderDeviceInfo_t& in
 			sprintf_s(buf, "TF2Vulkan Swap Chain Image #%zu", index);
 			SetDebugName(img, buf);
 
-			perImg.m_PrimaryCmdBuf = GetGraphicsQueue().CreateCmdBufferAndBegin();
-
-			// Initially, images start in ePresentSrcKHR layout. We want them
-			// to be in eColorAttachmentOptimal, since that's what ::Present()
-			// is expecting, since that's what ::Present() leaves the swapchain
-			// images in after presentation.
-			TransitionImageLayout(img, ci.format,
-				vk::ImageLayout::ePresentSrcKHR, vk::ImageLayout::eColorAttachmentOptimal,
-				*perImg.m_PrimaryCmdBuf, 0);
-
-			index++;
-		}
-	}
-
-	// Synchronization objects
-	{
-		vk::SemaphoreCreateInfo sCI;
-
-		vk::FenceCreateInfo fCI;
-		fCI.flags = vk::FenceCreateFlagBits::eSignaled;
-
-		size_t index = 0;
-		for (auto& img : newSwapChain.m_Images)
-		{
-			char buf[128];
-			img.m_ImageAvailableSemaphore = m_Data.m_Device->createSemaphoreUnique(sCI);
-			sprintf_s(buf, "TF2Vulkan Image Available Semaphore #%zu", index);
-			SetDebugName(img.m_ImageAvailableSemaphore, buf);
-
-			img.m_RenderFinishedSemaphore = m_Data.m_Device->createSemaphoreUnique(sCI);
-			sprintf_s(buf, "TF2Vulkan Render Finished Semaphore #%zu", index);
-			SetDebugName(img.m_RenderFinishedSemaphore, buf);
-
-			img.m_InFlightFence = m_Data.m_Device->createFenceUnique(fCI);
-			sprintf_s(buf, "TF2Vulkan In Flight Fence #%zu", index);
-			SetDebugName(img.m_InFlightFence, buf);
-
 			index++;
 		}
 	}
@@ -660,14 +903,33 @@ bool ShaderDevice::SetMode(void* hwnd, int adapter, const ShaderDeviceInfo_t& in
 		m_Data.m_DepthTexture = &g_TextureManager.CreateTexture("__rt_tf2vulkan_depth", ci);
 	}
 
+	// Framebuffers built on the old swap chain's views go with them
+	{
+		std::vector<vk::ImageView> oldViews;
+		for (const auto& img : m_Data.m_SwapChain.m_Images)
+			oldViews.push_back(img.m_ImageView.get());
+
+		if (!oldViews.empty())
+			g_StateManagerVulkan.EvictImageViews(oldViews);
+	}
+
 	m_Data.m_SwapChain = std::move(newSwapChain);
+	g_StateManagerVulkan.InvalidateRenderTargets();
 
 	if (m_Data.m_TempPrimaryCmdBuf)
 	{
+		// Startup only, so just wait for it rather than tracking it with a fence
 		m_Data.m_TempPrimaryCmdBuf->Submit();
+		m_Data.m_GraphicsQueue.m_Queue.waitIdle();
 		m_Data.m_TempPrimaryCmdBuf.reset();
 	}
 
+	CreateFrameSlots();
+	BeginFrame();
+
+	// Before the first map loads, so those pipelines don't hitch
+	g_StateManagerVulkan.LoadPipelineManifest();
+
 	return true;
 }
 
@@ -689,13 +951,19 @@ void ShaderDevice::SetDebugName(uint64_t obj, vk::ObjectType type, const char* n
 const vk::Image& ShaderDevice::BackbufferColorTexture::GetImage() const
 {
 	auto& sc = s_Device.m_Data.m_SwapChain;
-	return sc.m_Images.at(sc.m_CurrentFrame).m_Image;
+	return sc.m_Images.at(sc.m_CurrentImage).m_Image;
 }
 
 const vk::ImageView& ShaderDevice::BackbufferColorTexture::FindOrCreateView()
 {
 	auto& sc = s_Device.m_Data.m_SwapChain;
-	return sc.m_Images.at(sc.m_CurrentFrame).m_ImageView.get();
+	return sc.m_Images.at(sc.m_CurrentImage).m_ImageView.get();
+}
+
+ImageLayoutTracker& ShaderDevice::BackbufferColorTexture::GetLayoutTracker()
+{
+	auto& sc = s_Device.m_Data.m_SwapChain;
+	return sc.m_Images.at(sc.m_CurrentImage).m_LayoutTracker;
 }
 
 const vk::ImageCreateInfo& ShaderDevice::BackbufferColorTexture::GetImageCreateInfo() const
@@ -734,10 +1002,8 @@ bool ShaderDevice::IsReady() const
 
 IVulkanCommandBuffer& ShaderDevice::GetPrimaryCmdBuf()
 {
-	auto& scData = m_Data.m_SwapChain;
-
-	if (scData.m_Images.size() > scData.m_CurrentFrame)
-		return *scData.m_Images[scData.m_CurrentFrame].m_PrimaryCmdBuf;
+	if (m_Data.m_FramesInFlight > 0)
+		return *GetCurrentFrameSlot().m_PrimaryCmdBuf;
 	else
 		return *m_Data.m_TempPrimaryCmdBuf;
 }
@@ -1,5 +1,10 @@
+#include "DeferredDestructionQueue.h"
+#include "IStateManagerVulkan.h"
 #include "MaterialSystemHardwareConfig.h"
 #include "ShaderDeviceMgr.h"
+#include "StagingArena.h"
+#include "TextureStreamer.h"
+#include "VulkanRingBuffer.h"
 #include "interface/internal/IShaderDeviceInternal.h"
 
 #include <TF2Vulkan/Util/interface.h>
@@ -10,6 +15,7 @@
 #include <tier2/tier2.h>
 #include <tier3/tier3.h>
 
+#include <limits>
 #include <optional>
 #include <vector>
 
@@ -21,6 +27,7 @@ namespace
 	{
 	public:
 		InitReturnVal_t Init() override;
+		void Shutdown() override;
 		bool Connect(CreateInterfaceFn factory) override;
 		void* QueryInterface(const char* interfaceName) override;
 
@@ -200,7 +207,8 @@ static vk::UniqueInstance CreateInstance()
 {
 	vk::ApplicationInfo appInfo(
 		"Team Fortress 2 (TF2Vulkan renderer)", VK_MAKE_VERSION(1, 0, 0),
-		"Valve Source Engine (TF2 branch) (TF2Vulkan)", VK_MAKE_VERSION(1, 0, 0));
+		"Valve Source Engine (TF2 branch) (TF2Vulkan)", VK_MAKE_VERSION(1, 0, 0),
+		VK_API_VERSION_1_1); // For vkGetPhysicalDeviceFeatures2
 
 	vk::InstanceCreateInfo createInfo;
 	createInfo.pApplicationInfo = &appInfo;
@@ -285,7 +293,28 @@ static QueueFamilies FindQueueFamilies(const vk::PhysicalDevice& adapter)
 	return retVal;
 }
 
-static vk::UniqueDevice CreateDevice(vk::PhysicalDevice& adapter, QueueFamilies& queues)
+static bool SupportsExtendedDynamicState(const vk::PhysicalDevice& adapter)
+{
+	if (adapter.getProperties().apiVersion < VK_API_VERSION_1_1)
+		return false;
+
+	const auto extensions = adapter.enumerateDeviceExtensionProperties();
+	const bool hasExtension = std::any_of(extensions.begin(), extensions.end(), [](const vk::ExtensionProperties& ext)
+		{
+			return !strcmp(ext.extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+		});
+
+	if (!hasExtension)
+		return false;
+
+	const auto features = adapter.getFeatures2<vk::PhysicalDeviceFeatures2,
+		vk::PhysicalDeviceExtendedDynamicStateFeaturesEXT>();
+
+	return features.get<vk::PhysicalDeviceExtendedDynamicStateFeaturesEXT>().extendedDynamicState;
+}
+
+static vk::UniqueDevice CreateDevice(vk::PhysicalDevice& adapter, QueueFamilies& queues,
+	bool& extendedDynamicState)
 {
 	vk::DeviceCreateInfo createInfo;
 
@@ -298,12 +327,23 @@ static vk::UniqueDevice CreateDevice(vk::PhysicalDevice& adapter, QueueFamilies&
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.queueCreateInfoCount = queueCreateInfos.size();
 
-	constexpr const char* DEVICE_EXTENSIONS[] =
+	std::vector<const char*> deviceExtensions =
 	{
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 	};
-	createInfo.ppEnabledExtensionNames = DEVICE_EXTENSIONS;
-	createInfo.enabledExtensionCount = std::size(DEVICE_EXTENSIONS);
+
+	// Optional, lets depth/stencil/cull state be set per draw instead of baked into pipelines
+	vk::PhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures;
+	extendedDynamicState = SupportsExtendedDynamicState(adapter);
+	if (extendedDynamicState)
+	{
+		deviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+		extendedDynamicStateFeatures.extendedDynamicState = true;
+		createInfo.pNext = &extendedDynamicStateFeatures;
+	}
+
+	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	Util::SafeConvert(deviceExtensions.size(), createInfo.enabledExtensionCount);
 
 	return adapter.createDeviceUnique(createInfo);
 }
@@ -406,9 +446,11 @@ InitReturnVal_t ShaderDeviceMgr::Init()
 	g_MatSysConfig.Init();
 
 	QueueFamilies queueFamilies;
-	if (auto device = CreateDevice(m_Adapter, queueFamilies))
+	bool extendedDynamicState;
+	if (auto device = CreateDevice(m_Adapter, queueFamilies, extendedDynamicState))
 	{
 		IShaderDeviceInternal::VulkanInitData initData;
+		initData.m_ExtendedDynamicState = extendedDynamicState;
 		initData.m_DeviceIndex = Util::SafeConvert<uint32_t>(m_AdapterIndex);
 		initData.m_GraphicsQueueIndex = queueFamilies.m_Graphics.value().m_Index;
 
@@ -430,6 +472,29 @@ InitReturnVal_t ShaderDeviceMgr::Init()
 	return InitReturnVal_t::INIT_OK;
 }
 
+void ShaderDeviceMgr::Shutdown()
+{
+	LOG_FUNC();
+
+	if (m_HasBeenInit)
+	{
+		g_StateManagerVulkan.Shutdown();
+		g_TextureStreamer.Shutdown();
+		g_ShaderDevice.SavePipelineCache();
+
+		// These are statics, so they would otherwise be freed during static
+		// destruction, after the allocator and device might already be gone
+		g_ShaderDevice.GetVulkanDevice().waitIdle();
+		g_DynamicVertexRing.Release();
+		g_DynamicIndexRing.Release();
+		g_UniformRing.Release();
+		g_StagingArena.Release();
+		g_DeferredDestruction.ReleaseCompleted(std::numeric_limits<uint64_t>::max());
+	}
+
+	CBaseAppSystem::Shutdown();
+}
+
 void* ShaderDeviceMgr::QueryInterface(const char* interfaceName)
 {
 	NOT_IMPLEMENTED_FUNC();
@@ -0,0 +1,208 @@
+#include "DeferredDestructionQueue.h"
+#include "StagingArena.h"
+#include "VulkanFactories.h"
+
+#include <tier1/convar.h>
+
+#include <algorithm>
+
+using namespace TF2Vulkan;
+
+static StagingArena s_StagingArena;
+StagingArena& TF2Vulkan::g_StagingArena = s_StagingArena;
+
+CON_COMMAND(mat_vulkan_staging_stats, "Prints staging memory usage for uploads.")
+{
+	const auto stats = g_StagingArena.GetStats();
+	Msg(TF2VULKAN_PREFIX "Staging: %zu KiB reserved, %zu KiB waiting on the GPU. %llu block allocations, %llu overflow buffers.\n",
+		stats.m_ReservedBytes / 1024, stats.m_InUseBytes / 1024,
+		stats.m_BlockAllocations, stats.m_OverflowAllocations);
+}
+
+static constexpr bool IsPowerOfTwo(size_t value)
+{
+	return value && !(value & (value - 1));
+}
+
+void StagingArena::AddChunk(uint32_t sizeClass)
+{
+	auto& sc = m_SizeClasses[sizeClass];
+	const size_t blockSize = size_t(1) << (MIN_BLOCK_SIZE_LOG2 + sizeClass);
+	const auto blockCount = Util::SafeConvert<uint32_t>(CHUNK_SIZE / blockSize);
+
+	auto chunk = std::find_if(sc.m_Chunks.begin(), sc.m_Chunks.end(),
+		[](const Chunk& c) { return !c.m_Buffer.GetBuffer(); });
+	if (chunk == sc.m_Chunks.end())
+		chunk = sc.m_Chunks.emplace(chunk);
+
+	const auto chunkIndex = Util::SafeConvert<uint32_t>(chunk - sc.m_Chunks.begin());
+
+	char dbgName[128];
+	sprintf_s(dbgName, "TF2Vulkan Staging Arena (%zu KiB blocks) #%u", blockSize / 1024, chunkIndex);
+
+	chunk->m_Buffer = Factories::BufferFactory{}
+		.SetUsage(vk::BufferUsageFlagBits::eTransferSrc)
+		.SetSize(CHUNK_SIZE)
+		.SetMemoryRequiredFlags(vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent)
+		.SetAllowMapping(true)
+		.SetDebugName(dbgName)
+		.Create();
+	chunk->m_FreeBlockCount = blockCount;
+
+	// Reversed so blocks get handed out front to back
+	for (uint32_t i = blockCount; i-- > 0; )
+		sc.m_FreeBlocks.push_back({ sizeClass, chunkIndex, i });
+
+	m_Stats.m_ReservedBytes += CHUNK_SIZE;
+}
+
+auto StagingArena::GetCurrentBucket() -> std::vector<Block>&
+{
+	const auto frameNumber = g_ShaderDevice.GetFrameNumber();
+	auto& bucket = m_Buckets[frameNumber % MAX_FRAMES_IN_FLIGHT];
+
+	if (bucket.m_FrameNumber != frameNumber)
+	{
+		// The frame that last used this bucket must have been released already
+		assert(bucket.m_Blocks.empty());
+		bucket.m_FrameNumber = frameNumber;
+	}
+
+	return bucket.m_Blocks;
+}
+
+auto StagingArena::Allocate(size_t size, size_t alignment) -> Allocation
+{
+	assert(alignment > 0);
+
+	// Blocks start on a multiple of their (power of two) size, which covers any
+	// smaller power of two alignment. Anything else needs room to be padded out.
+	size_t paddedSize = size;
+	if (!IsPowerOfTwo(alignment) || alignment > (size_t(1) << MIN_BLOCK_SIZE_LOG2))
+		paddedSize += alignment - 1;
+
+	Allocation retVal;
+	retVal.m_Size = size;
+
+	if (paddedSize > (size_t(1) << MAX_BLOCK_SIZE_LOG2))
+	{
+		// Too big for any size class, these are rare enough to get their own buffer
+		auto buffer = Factories::BufferFactory{}
+			.SetUsage(vk::BufferUsageFlagBits::eTransferSrc)
+			.SetSize(size)
+			.SetMemoryRequiredFlags(vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent)
+			.SetAllowMapping(true)
+			.SetDebugName("TF2Vulkan Staging Arena (overflow)")
+			.Create();
+
+		retVal.m_Buffer = buffer.GetBuffer();
+		retVal.m_Data = buffer.GetAllocation().data();
+		g_DeferredDestruction.Add(std::move(buffer));
+
+		std::lock_guard lock(m_Mutex);
+		m_Stats.m_OverflowAllocations++;
+		return retVal;
+	}
+
+	uint32_t sizeClass = 0;
+	while ((size_t(1) << (MIN_BLOCK_SIZE_LOG2 + sizeClass)) < paddedSize)
+		sizeClass++;
+
+	std::lock_guard lock(m_Mutex);
+
+	auto& sc = m_SizeClasses[sizeClass];
+	if (sc.m_FreeBlocks.empty())
+		AddChunk(sizeClass);
+
+	const Block block = sc.m_FreeBlocks.back();
+	sc.m_FreeBlocks.pop_back();
+	GetCurrentBucket().push_back(block);
+
+	const size_t blockSize = size_t(1) << (MIN_BLOCK_SIZE_LOG2 + sizeClass);
+	auto& chunk = sc.m_Chunks[block.m_Chunk];
+	chunk.m_FreeBlockCount--;
+	chunk.m_LastUsedFrame = g_ShaderDevice.GetFrameNumber();
+
+	retVal.m_Buffer = chunk.m_Buffer.GetBuffer();
+	retVal.m_Offset = AlignUp<vk::DeviceSize>(vk::DeviceSize(block.m_Index) * blockSize, alignment);
+	retVal.m_Data = chunk.m_Buffer.GetAllocation().data() + retVal.m_Offset;
+
+	m_Stats.m_InUseBytes += blockSize;
+	m_Stats.m_BlockAllocations++;
+	return retVal;
+}
+
+void StagingArena::ReleaseCompleted(uint64_t completedFrame)
+{
+	std::lock_guard lock(m_Mutex);
+
+	for (auto& bucket : m_Buckets)
+	{
+		if (bucket.m_FrameNumber > completedFrame)
+			continue;
+
+		for (const auto& block : bucket.m_Blocks)
+		{
+			auto& sc = m_SizeClasses[block.m_SizeClass];
+			sc.m_FreeBlocks.push_back(block);
+			sc.m_Chunks[block.m_Chunk].m_FreeBlockCount++;
+			m_Stats.m_InUseBytes -= size_t(1) << (MIN_BLOCK_SIZE_LOG2 + block.m_SizeClass);
+		}
+
+		bucket.m_Blocks.clear();
+	}
+
+	TrimChunks(completedFrame);
+}
+
+void StagingArena::TrimChunks(uint64_t completedFrame)
+{
+	if (completedFrame < TRIM_AFTER_FRAMES)
+		return;
+
+	for (uint32_t sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++)
+	{
+		auto& sc = m_SizeClasses[sizeClass];
+		const auto blockCount = uint32_t(CHUNK_SIZE >> (MIN_BLOCK_SIZE_LOG2 + sizeClass));
+
+		for (uint32_t i = 0; i < sc.m_Chunks.size(); i++)
+		{
+			auto& chunk = sc.m_Chunks[i];
+			if (!chunk.m_Buffer.GetBuffer() || chunk.m_FreeBlockCount != blockCount ||
+				chunk.m_LastUsedFrame > completedFrame - TRIM_AFTER_FRAMES)
+			{
+				continue;
+			}
+
+			sc.m_FreeBlocks.erase(std::remove_if(sc.m_FreeBlocks.begin(), sc.m_FreeBlocks.end(),
+				[&](const Block& block) { return block.m_Chunk == i; }), sc.m_FreeBlocks.end());
+
+			// Nothing has used it since completedFrame - TRIM_AFTER_FRAMES, so the GPU is done with it
+			chunk = Chunk{};
+			m_Stats.m_ReservedBytes -= CHUNK_SIZE;
+		}
+	}
+}
+
+void StagingArena::Release()
+{
+	std::lock_guard lock(m_Mutex);
+
+	for (auto& sc : m_SizeClasses)
+	{
+		sc.m_Chunks.clear();
+		sc.m_FreeBlocks.clear();
+	}
+
+	for (auto& bucket : m_Buckets)
+		bucket.m_Blocks.clear();
+
+	m_Stats.m_ReservedBytes = 0;
+	m_Stats.m_InUseBytes = 0;
+}
+
+auto StagingArena::GetStats() const -> Stats
+{
+	std::lock_guard lock(m_Mutex);
+	return m_Stats;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "interface/internal/IShaderDeviceInternal.h"
+
+#include <array>
+#include <mutex>
+#include <vector>
+
+namespace TF2Vulkan
+{
+	// Persistently mapped, host-visible memory for uploads. Requests are rounded
+	// up to a power of two size class and handed out as blocks carved from a few
+	// large buffers, so level loads don't create (and fragment VMA with) thousands
+	// of short-lived staging buffers. Anything bigger than the largest class gets
+	// its own buffer. Everything allocated during a frame is recycled once the GPU
+	// has finished that frame, and buffers that stay entirely unused for a while
+	// are freed, so a load time burst doesn't stay reserved.
+	class StagingArena final
+	{
+	public:
+		struct Allocation
+		{
+			vk::Buffer m_Buffer;
+			vk::DeviceSize m_Offset = 0;
+			std::byte* m_Data = nullptr;
+			size_t m_Size = 0;
+
+			explicit operator bool() const { return !!m_Data; }
+		};
+
+		// Only valid for commands recorded during the current frame
+		[[nodiscard]] Allocation Allocate(size_t size, size_t alignment = 1);
+
+		// Recycles everything allocated during completedFrame or earlier
+		void ReleaseCompleted(uint64_t completedFrame);
+
+		// Frees every buffer. The GPU must be done with all of them.
+		void Release();
+
+		struct Stats
+		{
+			size_t m_ReservedBytes = 0;   // Total size of the size class buffers
+			size_t m_InUseBytes = 0;      // Blocks waiting on the GPU
+			uint64_t m_BlockAllocations = 0;
+			uint64_t m_OverflowAllocations = 0;
+		};
+		Stats GetStats() const;
+
+	private:
+		static constexpr size_t MIN_BLOCK_SIZE_LOG2 = 12; // 4 KiB
+		static constexpr size_t MAX_BLOCK_SIZE_LOG2 = 22; // 4 MiB
+		static constexpr size_t SIZE_CLASS_COUNT = MAX_BLOCK_SIZE_LOG2 - MIN_BLOCK_SIZE_LOG2 + 1;
+		static constexpr size_t CHUNK_SIZE = 16 * 1024 * 1024;
+		static constexpr uint64_t TRIM_AFTER_FRAMES = 300; // Chunks unused for this long are freed
+
+		struct Block
+		{
+			uint32_t m_SizeClass;
+			uint32_t m_Chunk;
+			uint32_t m_Index;
+		};
+
+		struct Chunk
+		{
+			vma::AllocatedBuffer m_Buffer; // Empty once trimmed, the slot is reused
+			uint32_t m_FreeBlockCount = 0;
+			uint64_t m_LastUsedFrame = 0;
+		};
+
+		struct SizeClass
+		{
+			std::vector<Chunk> m_Chunks;
+			std::vector<Block> m_FreeBlocks;
+		};
+
+		void AddChunk(uint32_t sizeClass);
+		void TrimChunks(uint64_t completedFrame);
+		auto GetCurrentBucket() -> std::vector<Block>&;
+
+		std::array<SizeClass, SIZE_CLASS_COUNT> m_SizeClasses;
+
+		struct Bucket
+		{
+			uint64_t m_FrameNumber = 0;
+			std::vector<Block> m_Blocks;
+		};
+		std::array<Bucket, MAX_FRAMES_IN_FLIGHT> m_Buckets;
+
+		Stats m_Stats;
+		mutable std::mutex m_Mutex;
+	};
+
+	extern StagingArena& g_StagingArena;
+}
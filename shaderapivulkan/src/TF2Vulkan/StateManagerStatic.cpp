@@ -3,10 +3,12 @@
 #include "IStateManagerVulkan.h"
 #include "shaders/VulkanShaderManager.h"
 
+#include <TF2Vulkan/Util/ConcurrentLookup.h>
 #include <TF2Vulkan/Util/DirtyVar.h>
 #include <TF2Vulkan/Util/interface.h>
 
-#include <unordered_map>
+#include <algorithm>
+#include <cmath>
 
 using namespace TF2Vulkan;
 using namespace Util;
@@ -16,8 +18,8 @@ namespace
 	class ShadowStateManager final : public IStateManagerStatic
 	{
 	public:
-		void ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf);
-		void ApplyCurrentState(IVulkanCommandBuffer& buf);
+		bool ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf);
+		bool ApplyCurrentState(IVulkanCommandBuffer& buf);
 		void SetDefaultState() override final;
 
 		void DepthFunc(ShaderDepthFunc_t func) override final;
@@ -110,20 +112,22 @@ namespace
 
 		void SetState(LogicalShadowStateID id) override;
 		using IStateManagerStatic::GetState;
-		const LogicalShadowState& GetState(LogicalShadowStateID id) const override;
+		LogicalShadowState GetState(LogicalShadowStateID id) const override;
 
 		const TF2Vulkan::IVulkanShader& GetPixelShader() const override;
 		const TF2Vulkan::IVulkanShader& GetVertexShader() const override;
 
 	protected:
 		bool HasStateChanged() const;
+		const PackedShadowState& GetPackedState(LogicalShadowStateID id) const;
 
 	private:
 		bool m_Dirty = true;
 		LogicalShadowState m_State;
+		LogicalShadowStateID m_StateID = LogicalShadowStateID::Invalid; // Only valid if !m_Dirty
 
-		std::unordered_map<LogicalShadowState, LogicalShadowStateID> m_StatesToIDs;
-		std::vector<const LogicalShadowState*> m_IDsToStates;
+		Util::ConcurrentLookupMap<PackedShadowState, LogicalShadowStateID> m_StatesToIDs;
+		std::vector<const PackedShadowState*> m_IDsToStates;
 	};
 }
 
@@ -132,16 +136,18 @@ EXPOSE_SINGLE_INTERFACE_GLOBALVAR(ShadowStateManager, IShaderShadow, SHADERSHADO
 
 IStateManagerStatic& TF2Vulkan::g_StateManagerStatic = s_SSM;
 
-void ShadowStateManager::ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf)
+bool ShadowStateManager::ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf)
 {
 	LOG_FUNC();
-	g_StateManagerVulkan.ApplyState(GetState(id), g_StateManagerDynamic.GetDynamicState(), buf);
+	return g_StateManagerVulkan.ApplyState(id, GetState(id), g_StateManagerDynamic.GetDynamicState(), buf);
 }
 
-void ShadowStateManager::ApplyCurrentState(IVulkanCommandBuffer& buf)
+bool ShadowStateManager::ApplyCurrentState(IVulkanCommandBuffer& buf)
 {
 	LOG_FUNC();
-	ApplyState(TakeSnapshot(), buf);
+
+	// m_State is equivalent to the snapshot, no need to unpack it
+	return g_StateManagerVulkan.ApplyState(TakeSnapshot(), m_State, g_StateManagerDynamic.GetDynamicState(), buf);
 }
 
 void ShadowStateManager::SetDefaultState()
@@ -461,39 +467,41 @@ void ShadowStateManager::BlendOpSeparateAlpha(ShaderBlendOp_t op)
 
 LogicalShadowStateID ShadowStateManager::TakeSnapshot()
 {
-	if (auto found = m_StatesToIDs.find(m_State); found != m_StatesToIDs.end())
-		return found->second;
+	if (!m_Dirty)
+		return m_StateID;
 
-	// Couldn't find it, add it now
-	LogicalShadowStateID nextID = LogicalShadowStateID(m_IDsToStates.size());
-	auto emplaced = m_StatesToIDs.emplace(m_State, nextID);
-	m_IDsToStates.push_back(&emplaced.first->first);
+	// Only used if we haven't seen this state before
+	const LogicalShadowStateID nextID = LogicalShadowStateID(m_IDsToStates.size());
+	m_StateID = m_StatesToIDs.FindOrInsert(PackedShadowState(m_State),
+		[&] { return nextID; },
+		[&](const PackedShadowState& state, LogicalShadowStateID&) { m_IDsToStates.push_back(&state); });
 
-	return nextID;
+	m_Dirty = false;
+	return m_StateID;
 }
 
 bool ShadowStateManager::IsTranslucent(LogicalShadowStateID id) const
 {
 	// TODO: How is "is translucent" actually computed?
-	return GetState(id).m_OMAlphaBlending;
+	return GetPackedState(id).m_OMAlphaBlending;
 }
 
 bool ShadowStateManager::IsAlphaTested(LogicalShadowStateID id) const
 {
-	return GetState(id).m_OMAlphaTest;
+	return GetPackedState(id).m_OMAlphaTest;
 }
 
 bool ShadowStateManager::UsesVertexAndPixelShaders(LogicalShadowStateID id) const
 {
-	const auto& state = GetState(id);
+	const auto& state = GetPackedState(id);
 
-	assert(!state.m_VSName == !state.m_PSName);
-	return !!state.m_VSName;
+	assert((state.m_VSName == UTL_INVAL_SYMBOL) == (state.m_PSName == UTL_INVAL_SYMBOL));
+	return state.m_VSName != UTL_INVAL_SYMBOL;
 }
 
 bool ShadowStateManager::IsDepthWriteEnabled(LogicalShadowStateID id) const
 {
-	return GetState(id).m_DepthWrite;
+	return GetPackedState(id).m_DepthWrite;
 }
 
 void ShadowStateManager::SetRenderTargetEx(int rtID, ShaderAPITextureHandle_t colTex, ShaderAPITextureHandle_t depthTex)
@@ -510,14 +518,117 @@ bool ShadowStateManager::HasStateChanged() const
 void ShadowStateManager::SetState(LogicalShadowStateID id)
 {
 	LOG_FUNC();
-	m_State = *m_IDsToStates.at(Util::SafeConvert<size_t>(id));
+	m_State = GetState(id);
+	m_StateID = id;
+	m_Dirty = false;
+}
+
+LogicalShadowState ShadowStateManager::GetState(LogicalShadowStateID id) const
+{
+	return GetPackedState(id).Unpack();
 }
 
-auto ShadowStateManager::GetState(LogicalShadowStateID id) const -> const LogicalShadowState &
+auto ShadowStateManager::GetPackedState(LogicalShadowStateID id) const -> const PackedShadowState &
 {
 	return *m_IDsToStates.at(Util::SafeConvert<size_t>(id));
 }
 
+template<size_t bits, typename T>
+static uint32_t PackBits(const T& value, uint32_t bias = 0)
+{
+	const auto packed = uint32_t(value) - bias;
+	assert(packed < (1u << bits));
+	return packed;
+}
+
+PackedShadowState::PackedShadowState(const LogicalShadowState& state) :
+	m_VSVertexFormat(state.m_VSVertexFormat),
+	m_VSMorphFormat(state.m_VSMorphFormat),
+	m_VSStaticIndex(state.m_VSStaticIndex),
+	m_PSStaticIndex(state.m_PSStaticIndex),
+
+	m_VSName(UtlSymId_t(state.m_VSName)),
+	m_PSName(UtlSymId_t(state.m_PSName)),
+
+	m_PSSamplersEnabled(0),
+	m_PSSamplersSRGBRead(0),
+
+	m_DepthTest(state.m_DepthTest),
+	m_DepthWrite(state.m_DepthWrite),
+	m_RSBackFaceCulling(state.m_RSBackFaceCulling),
+	m_OMSRGBWrite(state.m_OMSRGBWrite),
+	m_OMColorWrite(state.m_OMColorWrite),
+	m_OMAlphaTest(state.m_OMAlphaTest),
+	m_OMAlphaBlending(state.m_OMAlphaBlending),
+	m_OMAlphaWrite(state.m_OMAlphaWrite),
+	m_DepthCompareFunc(PackBits<4>(state.m_DepthCompareFunc)),
+	m_RSPolyOffsetMode(PackBits<2>(state.m_RSPolyOffsetMode)),
+	m_RSFrontFacePolyMode(PackBits<2>(state.m_RSFrontFacePolyMode, SHADER_POLYMODE_POINT)),
+	m_RSBackFacePolyMode(PackBits<2>(state.m_RSBackFacePolyMode, SHADER_POLYMODE_POINT)),
+	m_OMAlphaTestFunc(PackBits<4>(state.m_OMAlphaTestFunc)),
+	m_OMSrcFactor(PackBits<5>(state.m_OMSrcFactor)),
+	m_OMDstFactor(PackBits<5>(state.m_OMDstFactor)),
+
+	m_OMAlphaTestRef(std::clamp<long>(std::lround(state.m_OMAlphaTestRef), 0, 255)),
+	m_FogMode(PackBits<4>(state.m_FogMode)),
+	m_Unused(0),
+
+	m_OMDepthRT(state.m_OMDepthRT),
+	m_OMColorRTs(state.m_OMColorRTs)
+{
+	static_assert(std::tuple_size_v<decltype(state.m_PSSamplers)> <= 16);
+	for (size_t i = 0; i < state.m_PSSamplers.size(); i++)
+	{
+		if (state.m_PSSamplers[i].m_Enabled)
+			m_PSSamplersEnabled |= uint16_t(1 << i);
+		if (state.m_PSSamplers[i].m_SRGBRead)
+			m_PSSamplersSRGBRead |= uint16_t(1 << i);
+	}
+}
+
+LogicalShadowState PackedShadowState::Unpack() const
+{
+	LogicalShadowState retVal;
+
+	retVal.m_VSName = CUtlSymbolDbg(UtlSymId_t(m_VSName));
+	retVal.m_VSStaticIndex = m_VSStaticIndex;
+	retVal.m_VSVertexFormat = VertexFormat(m_VSVertexFormat);
+	retVal.m_VSMorphFormat = m_VSMorphFormat;
+
+	retVal.m_PSName = CUtlSymbolDbg(UtlSymId_t(m_PSName));
+	retVal.m_PSStaticIndex = m_PSStaticIndex;
+	for (size_t i = 0; i < retVal.m_PSSamplers.size(); i++)
+	{
+		retVal.m_PSSamplers[i].m_Enabled = !!(m_PSSamplersEnabled & (1 << i));
+		retVal.m_PSSamplers[i].m_SRGBRead = !!(m_PSSamplersSRGBRead & (1 << i));
+	}
+
+	retVal.m_DepthCompareFunc = ShaderDepthFunc_t(m_DepthCompareFunc);
+	retVal.m_DepthTest = m_DepthTest;
+	retVal.m_DepthWrite = m_DepthWrite;
+
+	retVal.m_RSBackFaceCulling = m_RSBackFaceCulling;
+	retVal.m_RSPolyOffsetMode = PolygonOffsetMode_t(m_RSPolyOffsetMode);
+	retVal.m_RSFrontFacePolyMode = ShaderPolyMode_t(m_RSFrontFacePolyMode + SHADER_POLYMODE_POINT);
+	retVal.m_RSBackFacePolyMode = ShaderPolyMode_t(m_RSBackFacePolyMode + SHADER_POLYMODE_POINT);
+
+	retVal.m_OMSRGBWrite = m_OMSRGBWrite;
+	retVal.m_OMColorWrite = m_OMColorWrite;
+	retVal.m_OMAlphaTest = m_OMAlphaTest;
+	retVal.m_OMAlphaTestFunc = ShaderAlphaFunc_t(m_OMAlphaTestFunc);
+	retVal.m_OMAlphaTestRef = float(m_OMAlphaTestRef);
+	retVal.m_OMAlphaBlending = m_OMAlphaBlending;
+	retVal.m_OMAlphaWrite = m_OMAlphaWrite;
+	retVal.m_OMSrcFactor = ShaderBlendFactor_t(m_OMSrcFactor);
+	retVal.m_OMDstFactor = ShaderBlendFactor_t(m_OMDstFactor);
+	retVal.m_OMDepthRT = m_OMDepthRT;
+	retVal.m_OMColorRTs = m_OMColorRTs;
+
+	retVal.m_FogMode = ShaderFogMode_t(m_FogMode);
+
+	return retVal;
+}
+
 bool ShadowStateManager::IsAnyRenderTargetBound() const
 {
 	for (auto& id : m_State.m_OMColorRTs)
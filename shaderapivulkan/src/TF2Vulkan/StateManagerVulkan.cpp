@@ -1,4 +1,6 @@
  #include "interface/internal/IShaderAPIInternal.h"
+#include "DeferredDestructionQueue.h"
+#include "FormatInfo.h"
 #include "IShaderTextureManager.h"
 #include "IStateManagerVulkan.h"
 #include "LogicalState.h"
@@ -7,17 +9,32 @@
 #include "interface/internal/IShaderDeviceInternal.h"
 #include "shaders/VulkanShaderManager.h"
 #include "VulkanFactories.h"
+#include "VulkanRingBuffer.h"
 
+#include <TF2Vulkan/Util/ConcurrentLookup.h>
+#include <TF2Vulkan/Util/FourCC.h>
 #include <TF2Vulkan/Util/MemoryPool.h>
+#include <TF2Vulkan/Util/std_algorithm.h>
 #include <TF2Vulkan/Util/std_array.h>
 
 #include <stdshader_dx9_tf2vulkan/ShaderData.h>
 
+#include <filesystem.h>
+#include <tier1/convar.h>
+#include <tier1/utlbuffer.h>
+#include <tier2/tier2.h>
+
 #undef min
 #undef max
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <forward_list>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 using namespace TF2Vulkan;
@@ -25,44 +42,99 @@ using namespace TF2Vulkan;
 static constexpr auto BINDING_SAMPLER_OFFSET = 100;
 static constexpr auto BINDING_TEXTURE_OFFSET = 200;
 
+// Per descriptor pool, once full new sets are only used for the current frame
+static constexpr uint32_t MAX_CACHED_DESCRIPTOR_SETS = 512;
+
+// Sets per transient descriptor pool, more pools are created as needed
+static constexpr uint32_t TRANSIENT_POOL_SETS = 1024;
+
+static ConVar mat_vulkan_async_pipelines("mat_vulkan_async_pipelines", "1", FCVAR_NONE,
+	"Compile new graphics pipelines on background threads. Draws are skipped (or use a compatible "
+	"pipeline with a different shader combo) until they are ready.");
+static ConVar mat_vulkan_pipeline_compile_budget("mat_vulkan_pipeline_compile_budget", "8", FCVAR_NONE,
+	"Maximum number of pipeline compiles handed to the background workers per frame.",
+	true, 1, false, 0);
+static ConVar mat_vulkan_record_pipeline_manifest("mat_vulkan_record_pipeline_manifest", "0", FCVAR_NONE,
+	"Write every pipeline created this session to the warm-up manifest at shutdown. "
+	"Pipelines in the manifest are pre-created at startup.");
+
+static constexpr char PIPELINE_MANIFEST_FILENAME[] = "tf2vulkan_pipelines.manifest";
+static constexpr Util::FourCC PIPELINE_MANIFEST_MAGIC("TVPM");
+static constexpr uint32_t PIPELINE_MANIFEST_VERSION = 2; // Bump whenever PipelineManifestEntry changes
+
 namespace
 {
 	struct SamplerKey
 	{
 		SamplerKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState, Sampler_t sampler);
-		SamplerKey(const SamplerSettings& settings) : m_Settings(settings) {}
+		SamplerKey(const SamplerSettings& settings) : m_Settings(settings) { UpdateHash(); }
 		DEFAULT_STRONG_EQUALITY_OPERATOR(SamplerKey);
 
 		SamplerSettings m_Settings;
+
+		// Must be called again after modifying the key
+		void UpdateHash() { m_Hash = Util::hash_value(m_Settings); }
+		size_t m_Hash = 0;
 	};
 }
 
-STD_HASH_DEFINITION(SamplerKey,
-	v.m_Settings
-);
+STD_HASH_PRECOMPUTED_DEFINITION(SamplerKey);
 
 namespace
 {
+	// Only what affects render pass compatibility (and ops), so all render
+	// targets with the same formats share a render pass and pipelines
 	struct RenderPassKey
 	{
-		constexpr RenderPassKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
+		RenderPassKey() { UpdateHash(); }
+		RenderPassKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
 		DEFAULT_STRONG_ORDERING_OPERATOR(RenderPassKey);
 
-		ShaderAPITextureHandle_t m_OMDepthRT;
-		std::array<ShaderAPITextureHandle_t, 4> m_OMColorRTs;
+		struct Attachment
+		{
+			DEFAULT_STRONG_ORDERING_OPERATOR(Attachment);
+
+			vk::Format m_Format = vk::Format::eUndefined; // eUndefined if unused
+			vk::SampleCountFlagBits m_Samples = vk::SampleCountFlagBits::e1;
+			vk::AttachmentLoadOp m_LoadOp = vk::AttachmentLoadOp::eLoad;
+			vk::AttachmentStoreOp m_StoreOp = vk::AttachmentStoreOp::eStore;
+			vk::AttachmentLoadOp m_StencilLoadOp = vk::AttachmentLoadOp::eLoad;
+			vk::AttachmentStoreOp m_StencilStoreOp = vk::AttachmentStoreOp::eStore;
+
+			bool operator!() const { return m_Format == vk::Format::eUndefined; }
+		};
+
+		Attachment m_DepthAttachment;
+		std::array<Attachment, 4> m_ColorAttachments;
+
+		// Must be called again after modifying the key
+		size_t ComputeHash() const;
+		void UpdateHash() { m_Hash = ComputeHash(); }
+		size_t m_Hash = 0;
 	};
 }
 
-STD_HASH_DEFINITION(RenderPassKey,
-	v.m_OMDepthRT,
-	v.m_OMColorRTs
+STD_HASH_DEFINITION(RenderPassKey::Attachment,
+	v.m_Format,
+	v.m_Samples,
+	v.m_LoadOp,
+	v.m_StoreOp,
+	v.m_StencilLoadOp,
+	v.m_StencilStoreOp
 );
 
+STD_HASH_PRECOMPUTED_DEFINITION(RenderPassKey);
+
+size_t RenderPassKey::ComputeHash() const
+{
+	return Util::hash_multi(m_DepthAttachment, m_ColorAttachments);
+}
+
 namespace
 {
 	struct PipelineLayoutKey
 	{
-		constexpr PipelineLayoutKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
+		PipelineLayoutKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
 		DEFAULT_STRONG_ORDERING_OPERATOR(PipelineLayoutKey);
 
 		CUtlSymbolDbg m_VSName;
@@ -71,62 +143,187 @@ namespace
 
 		CUtlSymbolDbg m_PSName;
 		int m_PSStaticIndex;
+
+		// Must be called again after modifying the key
+		size_t ComputeHash() const;
+		void UpdateHash() { m_Hash = ComputeHash(); }
+		size_t m_Hash = 0;
 	};
 }
 
-STD_HASH_DEFINITION(PipelineLayoutKey,
-	v.m_VSName,
-	v.m_VSStaticIndex,
-	v.m_VSVertexFormat,
+STD_HASH_PRECOMPUTED_DEFINITION(PipelineLayoutKey);
 
-	v.m_PSName,
-	v.m_PSStaticIndex
+size_t PipelineLayoutKey::ComputeHash() const
+{
+	return Util::hash_multi(
+		m_VSName,
+		m_VSStaticIndex,
+		m_VSVertexFormat,
+
+		m_PSName,
+		m_PSStaticIndex);
+}
+
+namespace
+{
+	// Set per draw when VK_EXT_extended_dynamic_state is available, otherwise part of the PipelineKey
+	struct ExtendedDynamicStateKey
+	{
+		constexpr ExtendedDynamicStateKey() = default;
+		ExtendedDynamicStateKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
+		DEFAULT_STRONG_ORDERING_OPERATOR(ExtendedDynamicStateKey);
+
+		ShaderDepthFunc_t m_DepthCompareFunc = SHADER_DEPTHFUNC_ALWAYS;
+		bool m_DepthTest = false;
+		bool m_DepthWrite = false;
+
+		bool m_RSBackFaceCulling = false;
+
+		bool m_StencilEnable = false;
+		StencilOperation_t m_StencilFailOp = STENCILOPERATION_KEEP;
+		StencilOperation_t m_StencilDepthFailOp = STENCILOPERATION_KEEP;
+		StencilOperation_t m_StencilPassOp = STENCILOPERATION_KEEP;
+		StencilComparisonFunction_t m_StencilCompareFunc = STENCILCOMPARISONFUNCTION_ALWAYS;
+	};
+}
+
+STD_HASH_DEFINITION(ExtendedDynamicStateKey,
+	v.m_DepthCompareFunc,
+	v.m_DepthTest,
+	v.m_DepthWrite,
+
+	v.m_RSBackFaceCulling,
+
+	v.m_StencilEnable,
+	v.m_StencilFailOp,
+	v.m_StencilDepthFailOp,
+	v.m_StencilPassOp,
+	v.m_StencilCompareFunc
 );
 
 namespace
 {
-	struct PipelineKey final : RenderPassKey, PipelineLayoutKey
+	struct PipelineKey final : RenderPassKey, PipelineLayoutKey, ExtendedDynamicStateKey
 	{
 		PipelineKey(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState);
 		DEFAULT_STRONG_ORDERING_OPERATOR(PipelineKey);
 
-		ShaderDepthFunc_t m_DepthCompareFunc;
-		bool m_DepthTest;
-		bool m_DepthWrite;
-
-		bool m_RSBackFaceCulling;
 		ShaderPolyMode_t m_RSPolyMode;
 
 		ShaderBlendFactor_t m_OMSrcFactor;
 		ShaderBlendFactor_t m_OMDstFactor;
 
-		Util::InPlaceVector<ShaderViewport_t, 4> m_Viewports;
+		// Must be called again after modifying the key (or any of its bases)
+		size_t ComputeHash() const;
+		void UpdateHash();
+		size_t m_Hash = 0;
 	};
 }
 
-STD_HASH_DEFINITION(PipelineKey,
-	static_cast<const RenderPassKey&>(v),
-	static_cast<const PipelineLayoutKey&>(v),
+STD_HASH_PRECOMPUTED_DEFINITION(PipelineKey);
 
-	v.m_DepthCompareFunc,
-	v.m_DepthTest,
-	v.m_DepthWrite,
+size_t PipelineKey::ComputeHash() const
+{
+	return Util::hash_multi(
+		RenderPassKey::ComputeHash(),
+		PipelineLayoutKey::ComputeHash(),
+		static_cast<const ExtendedDynamicStateKey&>(*this),
 
-	v.m_RSBackFaceCulling,
-	v.m_RSPolyMode,
+		m_RSPolyMode,
 
-	v.m_OMSrcFactor,
-	v.m_OMDstFactor,
+		m_OMSrcFactor,
+		m_OMDstFactor);
+}
+
+void PipelineKey::UpdateHash()
+{
+	RenderPassKey::UpdateHash();
+	PipelineLayoutKey::UpdateHash();
+	m_Hash = ComputeHash();
+}
+
+namespace
+{
+	// Pipelines sharing one of these only differ in shader combo (specialization
+	// constants), so they have identically defined layouts, compatible render passes
+	// and the same blend/depth/raster state. Drawing with one in place of another
+	// only gets the shading slightly wrong for a few frames.
+	struct FallbackPipelineKey final : RenderPassKey, ExtendedDynamicStateKey
+	{
+		FallbackPipelineKey(const PipelineKey& key);
+		DEFAULT_STRONG_EQUALITY_OPERATOR(FallbackPipelineKey);
+
+		CUtlSymbolDbg m_VSName;
+		VertexFormat m_VSVertexFormat;
+		CUtlSymbolDbg m_PSName;
+
+		ShaderPolyMode_t m_RSPolyMode;
+		ShaderBlendFactor_t m_OMSrcFactor;
+		ShaderBlendFactor_t m_OMDstFactor;
+	};
+}
 
-	v.m_Viewports
+STD_HASH_DEFINITION(FallbackPipelineKey,
+	static_cast<const RenderPassKey&>(v),
+	static_cast<const ExtendedDynamicStateKey&>(v),
+	v.m_VSName,
+	v.m_VSVertexFormat,
+	v.m_PSName,
+	v.m_RSPolyMode,
+	v.m_OMSrcFactor,
+	v.m_OMDstFactor
 );
 
 namespace
 {
-	struct RenderPass;
+	// The manifest is a header, then m_NameCount null terminated shader names,
+	// then m_EntryCount entries referring to those names by index.
+	struct PipelineManifestHeader
+	{
+		Util::FourCC m_Magic;
+		uint32_t m_Version;
+		uint32_t m_NameCount;
+		uint32_t m_EntryCount;
+	};
+
+#pragma pack(push, 1)
+	struct PipelineManifestEntry
+	{
+		enum Flags : uint8_t
+		{
+			DepthTest = (1 << 0),
+			DepthWrite = (1 << 1),
+			BackFaceCulling = (1 << 2),
+		};
+
+		uint16_t m_VSName;
+		uint16_t m_PSName;
+		int32_t m_VSStaticIndex;
+		int32_t m_PSStaticIndex;
+		uint64_t m_VSVertexFormat;
+
+		// VkFormat of each attachment, VK_FORMAT_UNDEFINED if unused
+		uint32_t m_ColorFormats[4];
+		uint32_t m_DepthFormat;
+		uint8_t m_ColorSamples[4];
+		uint8_t m_DepthSamples;
+
+		uint8_t m_Flags;
+		uint8_t m_DepthCompareFunc;
+		uint8_t m_RSPolyMode;
+		uint8_t m_OMSrcFactor;
+		uint8_t m_OMDstFactor;
+	};
+#pragma pack(pop)
+}
+
+namespace
+{
+	// Image views are what actually differ between framebuffers, the render pass
+	// is only used for creation (any compatible one will do)
 	struct FramebufferKey final
 	{
-		FramebufferKey(const RenderPass& rp);
+		FramebufferKey(const LogicalShadowState& staticState, const RenderPassKey& rpKey);
 		DEFAULT_STRONG_ORDERING_OPERATOR(FramebufferKey);
 
 		struct RTRef
@@ -140,8 +337,7 @@ namespace
 
 		std::array<RTRef, 4> m_OMColorRTs;
 		RTRef m_OMDepthRT;
-
-		const RenderPass* m_RenderPass;
+		size_t m_Hash = 0;
 	};
 }
 
@@ -150,10 +346,7 @@ STD_HASH_DEFINITION(FramebufferKey::RTRef,
 	v.m_Extent
 );
 
-STD_HASH_DEFINITION(FramebufferKey,
-	v.m_OMDepthRT,
-	v.m_OMColorRTs
-);
+STD_HASH_PRECOMPUTED_DEFINITION(FramebufferKey);
 
 namespace
 {
@@ -171,6 +364,48 @@ STD_HASH_DEFINITION(DescriptorPoolKey,
 	v.m_Layout
 );
 
+namespace
+{
+	struct DescriptorSetKey final
+	{
+		DescriptorSetKey(const DescriptorSetLayout& layout) : m_Layout(&layout) {}
+		DEFAULT_STRONG_ORDERING_OPERATOR(DescriptorSetKey);
+
+		// One per layout binding, only the member matching the descriptor type is set
+		struct Resource final
+		{
+			DEFAULT_STRONG_ORDERING_OPERATOR(Resource);
+
+			vk::Sampler m_Sampler;
+			vk::ImageView m_ImageView;
+			vk::Buffer m_Buffer;
+			vk::DeviceSize m_Range = 0;
+		};
+
+		const DescriptorSetLayout* m_Layout;
+		Util::InPlaceVector<Resource, 64> m_Resources;
+
+		// Must be called once m_Resources is filled in
+		size_t ComputeHash() const;
+		void UpdateHash() { m_Hash = ComputeHash(); }
+		size_t m_Hash = 0;
+	};
+}
+
+STD_HASH_DEFINITION(DescriptorSetKey::Resource,
+	v.m_Sampler,
+	v.m_ImageView,
+	v.m_Buffer,
+	v.m_Range
+);
+
+STD_HASH_PRECOMPUTED_DEFINITION(DescriptorSetKey);
+
+size_t DescriptorSetKey::ComputeHash() const
+{
+	return Util::hash_multi(m_Layout, m_Resources);
+}
+
 namespace
 {
 	struct Sampler final
@@ -189,6 +424,9 @@ namespace
 		vk::DescriptorPoolCreateInfo m_CreateInfo;
 		vk::UniqueDescriptorPool m_DescriptorPool;
 
+		// Sets held by the descriptor set cache, which never go back to the pool on their own
+		mutable uint32_t m_CachedSetCount = 0;
+
 		void FixupPointers();
 		bool operator!() const { return !m_DescriptorPool; }
 	};
@@ -287,6 +525,7 @@ namespace
 	struct Pipeline final
 	{
 		std::vector<ShaderStageCreateInfo> m_ShaderStageCIs;
+		std::vector<vk::PipelineShaderStageCreateInfo> m_ShaderStages;
 
 		std::vector<vk::VertexInputAttributeDescription> m_VertexInputAttributeDescriptions;
 		std::vector<vk::VertexInputBindingDescription> m_VertexInputBindingDescriptions;
@@ -294,8 +533,6 @@ namespace
 
 		vk::PipelineInputAssemblyStateCreateInfo m_InputAssemblyStateCI;
 
-		std::vector<vk::Viewport> m_Viewports;
-		vk::Rect2D m_Scissor;
 		vk::PipelineViewportStateCreateInfo m_ViewportStateCI;
 
 		vk::PipelineRasterizationStateCreateInfo m_RasterizationStateCI;
@@ -307,57 +544,299 @@ namespace
 
 		vk::PipelineDepthStencilStateCreateInfo m_DepthStencilStateCI;
 
+		std::vector<vk::DynamicState> m_DynamicStates;
+		vk::PipelineDynamicStateCreateInfo m_DynamicStateCI;
+
 		const PipelineLayout* m_Layout = nullptr;
 		const RenderPass* m_RenderPass = nullptr;
 
 		vk::GraphicsPipelineCreateInfo m_CreateInfo;
-		vk::UniquePipeline m_Pipeline;
+		vk::UniquePipeline m_Pipeline; // Null until compiled
 
 		void FixupPointers();
 		bool operator!() const { return !m_Pipeline; }
-		VulkanStateID m_ID;
+		VulkanStateID m_ID = VulkanStateID::Invalid;
+		const PipelineKey* m_Key = nullptr;
 	};
 
 	class StateManagerVulkan final : public IStateManagerVulkan
 	{
 	public:
-		void ApplyState(VulkanStateID stateID,
+		~StateManagerVulkan();
+
+		bool ApplyState(VulkanStateID stateID,
 			const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState,
 			IVulkanCommandBuffer& buf) override;
 
 		VulkanStateID FindOrCreateState(const LogicalShadowState& staticState,
 			const LogicalDynamicState& dynamicState) override;
+		VulkanStateID FindOrCreateState(LogicalShadowStateID shadowStateID,
+			const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState) override;
+		void InvalidateRenderTargets() override;
+
+		void ClearRenderTargets(const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState,
+			bool clearColor, bool clearDepth, bool clearStencil, uint32_t width, uint32_t height,
+			IVulkanCommandBuffer& buf) override;
+
+		void FlushDescriptorSetCache() override;
+		void EvictImageViews(const vk::ArrayProxy<const vk::ImageView>& views) override;
+
+		PipelineCompileStats GetPipelineCompileStats() const override;
+		void LoadPipelineManifest() override;
+		void Shutdown() override;
 
 	private:
-		void ApplyRenderPass(const RenderPass& renderPass, IVulkanCommandBuffer& buf);
+		Pipeline& FindOrCreatePipeline(const PipelineKey& key, bool async);
+		void SavePipelineManifest();
+
+		void QueuePipelineCompile(Pipeline& pipeline);
+		void StartCompileWorkers();
+		void DispatchPipelineCompiles();
+		void DispatchAllPipelineCompiles();
+		void WaitForPipelineCompiles();
+		void RetireCompiledPipelines();
+		void PipelineCompileWorker();
+		const Pipeline* FindFallbackPipeline(const Pipeline& pipeline) const;
+
+		vk::DescriptorSet AllocateTransientDescriptorSet(const DescriptorSetLayout& layout);
+		void RetireCachedDescriptorSet(const DescriptorSetKey& key, vk::UniqueDescriptorSet&& set);
+		void ReleaseRetiredDescriptorSets();
+
+		void ApplyRenderPass(const RenderPass& renderPass, const LogicalShadowState& staticState,
+			IVulkanCommandBuffer& buf);
+		static void BeginRenderPass(const RenderPass& renderPass, const Framebuffer& framebuffer,
+			const LogicalShadowState& staticState, const vk::ArrayProxy<const vk::ClearValue>& clearValues,
+			IVulkanCommandBuffer& buf);
 		void ApplyDescriptorSets(const Pipeline& pipeline,
 			const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf);
 
 		const DescriptorPool& FindOrCreateDescriptorPool(const DescriptorPoolKey& key);
 		const PipelineLayout& FindOrCreatePipelineLayout(const PipelineLayoutKey& key);
 		const RenderPass& FindOrCreateRenderPass(const RenderPassKey& key);
-		const Framebuffer& FindOrCreateFramebuffer(const FramebufferKey& key);
+		const Framebuffer& FindOrCreateFramebuffer(const FramebufferKey& key, const RenderPass& renderPass);
 		const Sampler& FindOrCreateSampler(const SamplerKey& sampler);
 
 		Pipeline CreatePipeline(const PipelineKey& key,
 			const PipelineLayout& layout,
 			const RenderPass& renderPass) const;
+		static vk::UniquePipeline CompilePipeline(const Pipeline& pipeline);
 
+		// Lookups that hit never lock, m_Mutex only serializes creation (and
+		// everything else that mutates shared state)
 		std::recursive_mutex m_Mutex;
 
-		std::unordered_map<PipelineKey, Pipeline> m_StatesToPipelines;
-		std::vector<const Pipeline*> m_IDsToPipelines;
-		std::unordered_map<PipelineLayoutKey, PipelineLayout> m_StatesToLayouts;
-		std::unordered_map<RenderPassKey, RenderPass> m_StatesToRenderPasses;
-		std::unordered_map<FramebufferKey, Framebuffer> m_StatesToFramebuffers;
-		std::unordered_map<DescriptorPoolKey, DescriptorPool> m_StatesToDescPools;
-		std::unordered_map<SamplerKey, Sampler> m_StatesToSamplers;
+		Util::ConcurrentLookupMap<PipelineKey, Pipeline> m_StatesToPipelines;
+		Util::ConcurrentAppendVector<const Pipeline*> m_IDsToPipelines;
+		Util::ConcurrentLookupMap<PipelineLayoutKey, PipelineLayout> m_StatesToLayouts;
+		Util::ConcurrentLookupMap<RenderPassKey, RenderPass> m_StatesToRenderPasses;
+		Util::ConcurrentLookupMap<FramebufferKey, Framebuffer> m_StatesToFramebuffers;
+		Util::ConcurrentLookupMap<DescriptorPoolKey, DescriptorPool> m_StatesToDescPools;
+		Util::ConcurrentLookupMap<SamplerKey, Sampler> m_StatesToSamplers;
+		Util::ConcurrentLookupMap<DescriptorSetKey, vk::UniqueDescriptorSet> m_DescriptorSetCache;
+
+		// Cached descriptor sets referring to each image view, so destroying a view
+		// only evicts those. Points at the keys inside m_DescriptorSetCache.
+		std::unordered_map<VkImageView, std::vector<const DescriptorSetKey*>> m_ViewsToDescriptorSets;
+
+		// Same for framebuffers, pointing at the keys inside m_StatesToFramebuffers
+		std::unordered_map<VkImageView, std::vector<const FramebufferKey*>> m_ViewsToFramebuffers;
+
+		// Uncached sets are never freed individually, the whole frame's pools are
+		// reset at once when the frame comes back around
+		struct TransientDescriptorPools final
+		{
+			std::vector<vk::UniqueDescriptorPool> m_Pools;
+			size_t m_CurrentPool = 0;
+		};
+		std::array<TransientDescriptorPools, MAX_FRAMES_IN_FLIGHT> m_TransientPools;
+		uint64_t m_TransientPoolsFrame = uint64_t(-1);
+
+		// Cached sets dropped from the cache while recorded commands may still use
+		// them. They keep their pool's slot (m_CachedSetCount) until they're freed.
+		struct RetiredDescriptorSet final
+		{
+			vk::UniqueDescriptorSet m_Set;
+			const DescriptorPool* m_Pool;
+			uint64_t m_FrameNumber;
+		};
+		std::deque<RetiredDescriptorSet> m_RetiredDescriptorSets;
+
+		// Background pipeline compilation. Pipelines waiting for this frame's budget
+		// live in m_PendingCompiles (under m_Mutex), everything handed to the workers
+		// goes through m_CompileMutex.
+		struct CompiledPipeline final
+		{
+			Pipeline* m_Pipeline;
+			vk::UniquePipeline m_Result;
+		};
+		std::deque<Pipeline*> m_PendingCompiles;
+		uint64_t m_CompileBudgetFrame = uint64_t(-1);
+		uint32_t m_CompilesDispatchedThisFrame = 0;
+		Util::ConcurrentLookupMap<FallbackPipelineKey, const Pipeline*> m_FallbackPipelines;
+
+		std::mutex m_CompileMutex;
+		std::condition_variable m_CompileCV;
+		std::condition_variable m_CompileIdleCV;
+		std::deque<Pipeline*> m_CompileQueue;
+		uint32_t m_CompilesInFlight = 0;
+		std::vector<CompiledPipeline> m_CompiledPipelines;
+		std::vector<std::thread> m_CompileWorkers;
+		bool m_ShutdownCompileWorkers = false;
+
+		// Bumped by InvalidateRenderTargets(), invalidates every thread's state ID cache
+		std::atomic<uint32_t> m_RenderTargetGeneration = 0;
+
+		std::atomic<uint32_t> m_PendingCompileCount = 0;
+		std::atomic<uint32_t> m_CompletedCompileCount = 0;
+		std::atomic<uint32_t> m_FallbackDrawCount = 0;
+		std::atomic<uint32_t> m_SkippedDrawCount = 0;
+		std::atomic<uint32_t> m_FoldedClearCount = 0;
+		std::atomic<uint32_t> m_InPassClearCount = 0;
 	};
 }
 
 static StateManagerVulkan s_SMVulkan;
 IStateManagerVulkan& TF2Vulkan::g_StateManagerVulkan = s_SMVulkan;
 
+CON_COMMAND(mat_vulkan_pipeline_stats, "Prints background pipeline compile counters.")
+{
+	const auto stats = g_StateManagerVulkan.GetPipelineCompileStats();
+	Msg(TF2VULKAN_PREFIX "Pipelines: %u pending, %u compiled. Draws: %u using fallback, %u skipped.\n",
+		stats.m_Pending, stats.m_Completed, stats.m_FallbackDraws, stats.m_SkippedDraws);
+	Msg(TF2VULKAN_PREFIX "Clears: %u folded into render pass begin, %u recorded inside a pass.\n",
+		stats.m_FoldedClears, stats.m_InPassClears);
+}
+
+// Returns the average wall clock time of one lookup, with threadCount threads
+// doing lookups at the same time. lookup(i) has to return i.
+template<typename TLookup>
+static double RunLookupBenchmark(uint32_t threadCount, uint32_t keyCount, uint32_t lookupsPerThread, const TLookup& lookup)
+{
+	// Coprime with keyCount, so each thread visits every key in its own order
+	constexpr uint32_t STRIDE = 7919;
+	assert(keyCount % STRIDE != 0);
+	assert(lookupsPerThread % keyCount == 0);
+
+	std::atomic<bool> start = false;
+	std::atomic<uint64_t> checksum = 0;
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < threadCount; t++)
+	{
+		threads.emplace_back([&, t]
+			{
+				while (!start.load(std::memory_order_acquire))
+					std::this_thread::yield();
+
+				uint64_t sum = 0;
+				uint32_t key = (t * 977) % keyCount;
+				for (uint32_t i = 0; i < lookupsPerThread; i++)
+				{
+					key = (key + STRIDE) % keyCount;
+					sum += lookup(key);
+				}
+
+				checksum += sum;
+			});
+	}
+
+	const auto begin = std::chrono::high_resolution_clock::now();
+	start.store(true, std::memory_order_release);
+	for (auto& thread : threads)
+		thread.join();
+
+	const std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - begin;
+	if (checksum != uint64_t(keyCount - 1) * keyCount / 2 * threadCount * (lookupsPerThread / keyCount))
+		Warning(TF2VULKAN_PREFIX "Lookup benchmark checksum mismatch\n");
+
+	return elapsed.count() / lookupsPerThread;
+}
+
+namespace
+{
+	// What every lookup cost before keys carried their own hash
+	struct RehashingKeyHash final
+	{
+		template<typename TKey>
+		size_t operator()(const TKey& key) const { return key.ComputeHash(); }
+	};
+}
+
+template<typename TKey>
+static void BenchmarkKeyLookups(const char* keyName, const std::vector<TKey>& keys, uint32_t maxThreads)
+{
+	const auto keyCount = uint32_t(keys.size());
+	const uint32_t lookupsPerThread = keyCount * 32;
+
+	Util::ConcurrentLookupMap<TKey, uint32_t> lockFree;
+	std::unordered_map<TKey, uint32_t, RehashingKeyHash> locked;
+	std::mutex lockedMutex;
+	for (uint32_t i = 0; i < keyCount; i++)
+	{
+		lockFree.FindOrInsert(keys[i], [&] { return i; });
+		locked.emplace(keys[i], i);
+	}
+
+	Msg(TF2VULKAN_PREFIX "%u %s lookups, ns per lookup (ConcurrentLookupMap / mutex + rehashing unordered_map):\n",
+		keyCount, keyName);
+	for (uint32_t threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		const double lockFreeTime = RunLookupBenchmark(threads, keyCount, lookupsPerThread,
+			[&](uint32_t i) { return *lockFree.Find(keys[i]); });
+
+		const double lockedTime = RunLookupBenchmark(threads, keyCount, lookupsPerThread,
+			[&](uint32_t i)
+			{
+				std::lock_guard lock(lockedMutex);
+				return locked.find(keys[i])->second;
+			});
+
+		Msg("  %2u threads: %8.1f %8.1f\n", threads, lockFreeTime, lockedTime);
+	}
+}
+
+CON_COMMAND(mat_vulkan_lookup_benchmark, "Compares PipelineKey and DescriptorSetKey lookups against the old mutex-guarded, rehashing std::unordered_map. Optional argument: max thread count.")
+{
+	constexpr uint32_t KEY_COUNT = 10240;
+	constexpr uint32_t SHADER_COMBOS = 128;
+	constexpr size_t RESOURCES_PER_SET = 24; // Textures, samplers and uniform blocks of a typical material
+
+	const uint32_t maxThreads = args.ArgC() > 1 ? uint32_t(std::max(atoi(args.Arg(1)), 1)) :
+		std::max(std::thread::hardware_concurrency(), 1u);
+
+	{
+		// Same way the manifest builds them, only the shader combos differ
+		std::vector<PipelineKey> keys;
+		keys.reserve(KEY_COUNT);
+		for (uint32_t i = 0; i < KEY_COUNT; i++)
+		{
+			LogicalShadowState shadowState;
+			shadowState.m_VSStaticIndex = int(i % SHADER_COMBOS);
+			shadowState.m_PSStaticIndex = int(i / SHADER_COMBOS);
+			keys.emplace_back(shadowState, LogicalDynamicState{});
+		}
+
+		BenchmarkKeyLookups("PipelineKey", keys, maxThreads);
+	}
+
+	{
+		// Only the address of the layout is part of the key
+		DescriptorSetLayout layout;
+
+		std::vector<DescriptorSetKey> keys;
+		keys.reserve(KEY_COUNT);
+		for (uint32_t i = 0; i < KEY_COUNT; i++)
+		{
+			auto& key = keys.emplace_back(layout);
+			for (size_t r = 0; r < RESOURCES_PER_SET; r++)
+				key.m_Resources.emplace_back().m_Range = vk::DeviceSize(i) * RESOURCES_PER_SET + r;
+
+			key.UpdateHash();
+		}
+
+		BenchmarkKeyLookups("DescriptorSetKey", keys, maxThreads);
+	}
+}
+
 template<typename T, typename TSize>
 static void AttachVector(const T*& destData, TSize& destSize, const std::vector<T>& src)
 {
@@ -423,7 +902,7 @@ static void CreateBindings(DescriptorSetLayout& layout, const CUtlSymbolDbg& sha
 		auto& cbufOut = bindings.emplace_back();
 		cbufOut.binding = cbufIn.m_Binding;
 		cbufOut.descriptorCount = 1;
-		cbufOut.descriptorType = vk::DescriptorType::eUniformBuffer;
+		cbufOut.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		cbufOut.stageFlags = reflectionData.m_ShaderStage;
 
 		auto& bufType = bufTypes.emplace_back();
@@ -540,23 +1019,21 @@ static RenderPass CreateRenderPass(const RenderPassKey& key)
 
 		// Color attachments
 		{
-			for (auto& colorTexID : key.m_OMColorRTs)
+			for (auto& colorAtt : key.m_ColorAttachments)
 			{
-				if (colorTexID < 0)
+				if (!colorAtt)
 					continue;
 
-				auto& colorTex = FindTexture(colorTexID);
-
 				vk::AttachmentDescription& att = retVal.m_Attachments.emplace_back();
 				att.initialLayout = vk::ImageLayout::eColorAttachmentOptimal;
 				att.finalLayout = vk::ImageLayout::eColorAttachmentOptimal;
-				att.samples = vk::SampleCountFlagBits::e1;
-				att.loadOp = vk::AttachmentLoadOp::eLoad; // TODO: Switch to eClear when we call ClearBuffers()
-				att.storeOp = vk::AttachmentStoreOp::eStore;
-				att.stencilLoadOp = vk::AttachmentLoadOp::eLoad; // TODO: Switch to eClear when we call ClearBuffers()
-				att.stencilStoreOp = vk::AttachmentStoreOp::eStore;
+				att.samples = colorAtt.m_Samples;
+				att.loadOp = colorAtt.m_LoadOp;
+				att.storeOp = colorAtt.m_StoreOp;
+				att.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+				att.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
 
-				att.format = colorTex.GetImageCreateInfo().format;
+				att.format = colorAtt.m_Format;
 
 				vk::AttachmentReference& attRef = sp.m_ColorAttachments.emplace_back();
 				attRef.layout = vk::ImageLayout::eColorAttachmentOptimal;
@@ -565,19 +1042,28 @@ static RenderPass CreateRenderPass(const RenderPassKey& key)
 		}
 
 		// Depth attachments
-		if (key.m_OMDepthRT >= 0)
+		if (const auto& depthAtt = key.m_DepthAttachment; !!depthAtt)
 		{
 			vk::AttachmentDescription& att = retVal.m_Attachments.emplace_back();
 
 			att.initialLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
 			att.finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
-			att.samples = vk::SampleCountFlagBits::e1;
-			att.loadOp = vk::AttachmentLoadOp::eLoad; // TODO: Switch to eClear when we call ClearBuffers()
-			att.storeOp = vk::AttachmentStoreOp::eStore;
-			att.stencilLoadOp = vk::AttachmentLoadOp::eLoad; // TODO: Switch to eClear when we call ClearBuffers()
-			att.stencilStoreOp = vk::AttachmentStoreOp::eStore;
+			att.samples = depthAtt.m_Samples;
+			att.loadOp = depthAtt.m_LoadOp;
+			att.storeOp = depthAtt.m_StoreOp;
+			if (FormatInfo::GetAspects(depthAtt.m_Format) & vk::ImageAspectFlagBits::eStencil)
+			{
+				att.stencilLoadOp = depthAtt.m_StencilLoadOp;
+				att.stencilStoreOp = depthAtt.m_StencilStoreOp;
+			}
+			else
+			{
+				// Nothing to preserve
+				att.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+				att.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+			}
 
-			att.format = FindTexture(key.m_OMDepthRT, true).GetImageCreateInfo().format;
+			att.format = depthAtt.m_Format;
 
 			vk::AttachmentReference& attRef = sp.m_DepthStencilAttachment;
 			attRef.layout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
@@ -652,6 +1138,47 @@ static vk::CompareOp ConvertCompareOp(ShaderDepthFunc_t op)
 	}
 }
 
+static vk::CompareOp ConvertCompareOp(StencilComparisonFunction_t func)
+{
+	switch (func)
+	{
+	case STENCILCOMPARISONFUNCTION_NEVER:         return vk::CompareOp::eNever;
+	case STENCILCOMPARISONFUNCTION_LESS:          return vk::CompareOp::eLess;
+	case STENCILCOMPARISONFUNCTION_EQUAL:         return vk::CompareOp::eEqual;
+	case STENCILCOMPARISONFUNCTION_LESSEQUAL:     return vk::CompareOp::eLessOrEqual;
+	case STENCILCOMPARISONFUNCTION_GREATER:       return vk::CompareOp::eGreater;
+	case STENCILCOMPARISONFUNCTION_NOTEQUAL:      return vk::CompareOp::eNotEqual;
+	case STENCILCOMPARISONFUNCTION_GREATEREQUAL:  return vk::CompareOp::eGreaterOrEqual;
+	case STENCILCOMPARISONFUNCTION_ALWAYS:        return vk::CompareOp::eAlways;
+
+	default:
+		throw VulkanException("Unknown StencilComparisonFunction_t", EXCEPTION_DATA());
+	}
+}
+
+static vk::StencilOp ConvertStencilOp(StencilOperation_t op)
+{
+	switch (op)
+	{
+	case STENCILOPERATION_KEEP:     return vk::StencilOp::eKeep;
+	case STENCILOPERATION_ZERO:     return vk::StencilOp::eZero;
+	case STENCILOPERATION_REPLACE:  return vk::StencilOp::eReplace;
+	case STENCILOPERATION_INCRSAT:  return vk::StencilOp::eIncrementAndClamp;
+	case STENCILOPERATION_DECRSAT:  return vk::StencilOp::eDecrementAndClamp;
+	case STENCILOPERATION_INVERT:   return vk::StencilOp::eInvert;
+	case STENCILOPERATION_INCR:     return vk::StencilOp::eIncrementAndWrap;
+	case STENCILOPERATION_DECR:     return vk::StencilOp::eDecrementAndWrap;
+
+	default:
+		throw VulkanException("Unknown StencilOperation_t", EXCEPTION_DATA());
+	}
+}
+
+static constexpr vk::CullModeFlags ConvertCullMode(bool backFaceCulling)
+{
+	return backFaceCulling ? vk::CullModeFlagBits::eBack : vk::CullModeFlagBits::eNone;
+}
+
 Pipeline StateManagerVulkan::CreatePipeline(const PipelineKey& key, const PipelineLayout& layout,
 	const RenderPass& renderPass) const
 {
@@ -743,32 +1270,14 @@ Pipeline StateManagerVulkan::CreatePipeline(const PipelineKey& key, const Pipeli
 		ci.topology = vk::PrimitiveTopology::eTriangleList;
 	}
 
-	// Viewport/scissor state
+	// Viewport/scissor state, the actual values are dynamic (see ApplyViewport())
 	{
-		// Viewport(s)
-		{
-			auto& ci = retVal.m_ViewportStateCI;
-			for (const auto& vpIn : key.m_Viewports)
-			{
-				auto& vpOut = retVal.m_Viewports.emplace_back();
-				Util::SafeConvert(vpIn.m_nWidth, vpOut.width);
-				Util::SafeConvert(vpIn.m_nHeight, vpOut.height);
-				Util::SafeConvert(vpIn.m_nTopLeftX, vpOut.x);
-				Util::SafeConvert(vpIn.m_nTopLeftY, vpOut.y);
-				Util::SafeConvert(vpIn.m_flMinZ, vpOut.minDepth);
-				Util::SafeConvert(vpIn.m_flMaxZ, vpOut.maxDepth);
-			}
-
-			AttachVector(ci.pViewports, ci.viewportCount, retVal.m_Viewports);
-		}
+		auto& ci = retVal.m_ViewportStateCI;
+		ci.viewportCount = 1;
+		ci.scissorCount = 1;
 
-		// Scissor(s)
-		{
-			retVal.m_Scissor.extent.width = retVal.m_ViewportStateCI.pViewports[0].width;
-			retVal.m_Scissor.extent.height = retVal.m_ViewportStateCI.pViewports[0].height;
-			retVal.m_ViewportStateCI.pScissors = &retVal.m_Scissor;
-			retVal.m_ViewportStateCI.scissorCount = 1;
-		}
+		retVal.m_DynamicStates.push_back(vk::DynamicState::eViewport);
+		retVal.m_DynamicStates.push_back(vk::DynamicState::eScissor);
 	}
 
 	// Rasterization state create info
@@ -777,7 +1286,7 @@ Pipeline StateManagerVulkan::CreatePipeline(const PipelineKey& key, const Pipeli
 
 		ci.frontFace = vk::FrontFace::eClockwise; // Reversed, because we have to invert Y in our vertex shader
 		ci.lineWidth = 1; // default
-		ci.cullMode = key.m_RSBackFaceCulling ? vk::CullModeFlagBits::eBack : vk::CullModeFlagBits::eNone; // FIXME: Temp disabled
+		ci.cullMode = ConvertCullMode(key.m_RSBackFaceCulling);
 		switch (key.m_RSPolyMode)
 		{
 		default:
@@ -829,73 +1338,305 @@ Pipeline StateManagerVulkan::CreatePipeline(const PipelineKey& key, const Pipeli
 		ci.depthTestEnable = key.m_DepthTest;
 		ci.depthWriteEnable = key.m_DepthWrite;
 		ci.depthCompareOp = ConvertCompareOp(key.m_DepthCompareFunc);
+
+		// Reference and masks are dynamic
+		ci.stencilTestEnable = key.m_StencilEnable;
+		ci.front.failOp = ConvertStencilOp(key.m_StencilFailOp);
+		ci.front.passOp = ConvertStencilOp(key.m_StencilPassOp);
+		ci.front.depthFailOp = ConvertStencilOp(key.m_StencilDepthFailOp);
+		ci.front.compareOp = ConvertCompareOp(key.m_StencilCompareFunc);
+		ci.back = ci.front;
 	}
 
-	// Graphics pipeline
+	// Dynamic state
 	{
-		vk::GraphicsPipelineCreateInfo& ci = retVal.m_CreateInfo;
+		auto& dynStates = retVal.m_DynamicStates;
+		dynStates.push_back(vk::DynamicState::eStencilCompareMask);
+		dynStates.push_back(vk::DynamicState::eStencilWriteMask);
+		dynStates.push_back(vk::DynamicState::eStencilReference);
+
+		if (g_ShaderDevice.HasExtendedDynamicState())
+		{
+			dynStates.push_back(vk::DynamicState::eCullModeEXT);
+			dynStates.push_back(vk::DynamicState::eDepthTestEnableEXT);
+			dynStates.push_back(vk::DynamicState::eDepthWriteEnableEXT);
+			dynStates.push_back(vk::DynamicState::eDepthCompareOpEXT);
+			dynStates.push_back(vk::DynamicState::eStencilTestEnableEXT);
+			dynStates.push_back(vk::DynamicState::eStencilOpEXT);
+		}
 
-		retVal.FixupPointers();
+		auto& ci = retVal.m_DynamicStateCI;
+		AttachVector(ci.pDynamicStates, ci.dynamicStateCount, retVal.m_DynamicStates);
+	}
 
-		std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
+	// Graphics pipeline. The create info points into retVal, so FixupPointers() must be
+	// called again once it has reached its final address, and CompilePipeline() does
+	// the actual (slow) work.
+	{
 		for (const auto& stage : retVal.m_ShaderStageCIs)
-			shaderStages.push_back(stage.m_CreateInfo);
-
-		AttachVector(ci.pStages, ci.stageCount, shaderStages);
+			retVal.m_ShaderStages.push_back(stage.m_CreateInfo);
 
 		// ci.subpass = 0;
-		retVal.m_Pipeline = g_ShaderDevice.GetVulkanDevice().createGraphicsPipelineUnique(nullptr, ci);
-
-		char buf[128];
-		sprintf_s(buf, "TF2Vulkan Graphics Pipeline 0x%zX", Util::hash_value(key));
-		g_ShaderDevice.SetDebugName(retVal.m_Pipeline, buf);
 	}
 
 	return retVal;
 }
 
-static Framebuffer CreateFramebuffer(const FramebufferKey& key)
+vk::UniquePipeline StateManagerVulkan::CompilePipeline(const Pipeline& pipeline)
 {
-	Framebuffer retVal;
+	// Runs on the compile workers (no LOG_FUNC, it asserts main thread).
+	// The pipeline cache is internally synchronized.
+	auto retVal = g_ShaderDevice.GetVulkanDevice().createGraphicsPipelineUnique(
+		g_ShaderDevice.GetPipelineCache(), pipeline.m_CreateInfo);
 
-	// Attachments
-	uint32_t width = 0;// std::numeric_limits<uint32_t>::max();
-	uint32_t height = 0;// width;
+	char buf[128];
+	sprintf_s(buf, "TF2Vulkan Graphics Pipeline 0x%zX", Util::hash_value(*pipeline.m_Key));
+	g_ShaderDevice.SetDebugName(retVal, buf);
 
-	std::string debugName = "COL{ ";
-	// Color attachments
-	{
-		bool debugNameFirst = true;
+	return retVal;
+}
 
-		auto& atts = retVal.m_Attachments;
-		for (auto& colorRT : key.m_OMColorRTs)
-		{
-			if (!colorRT)
-				continue;
+void StateManagerVulkan::QueuePipelineCompile(Pipeline& pipeline)
+{
+	m_PendingCompiles.push_back(&pipeline);
+	m_PendingCompileCount++;
+}
 
-			if (debugNameFirst)
-				debugNameFirst = false;
-			else
-				debugName += '/';
+void StateManagerVulkan::DispatchPipelineCompiles()
+{
+	if (const auto frame = g_ShaderDevice.GetFrameNumber(); frame != m_CompileBudgetFrame)
+	{
+		m_CompileBudgetFrame = frame;
+		m_CompilesDispatchedThisFrame = 0;
+	}
 
-			atts.push_back(colorRT.m_ImageView);
+	const auto budget = uint32_t(mat_vulkan_pipeline_compile_budget.GetInt());
+	if (m_PendingCompiles.empty() || m_CompilesDispatchedThisFrame >= budget)
+		return;
 
-			debugName += '\'';
-			debugName += std::to_string((VkImageView)colorRT.m_ImageView);
-			debugName += '\'';
+	{
+		std::lock_guard lock(m_CompileMutex);
+		if (m_ShutdownCompileWorkers)
+			return;
 
-			if (width == 0 || colorRT.m_Extent.width < width)
-				width = colorRT.m_Extent.width;
-			if (height == 0 || colorRT.m_Extent.height < height)
-				height = colorRT.m_Extent.height;
+		StartCompileWorkers();
+
+		while (!m_PendingCompiles.empty() && m_CompilesDispatchedThisFrame < budget)
+		{
+			m_CompileQueue.push_back(m_PendingCompiles.front());
+			m_PendingCompiles.pop_front();
+			m_CompilesDispatchedThisFrame++;
 		}
-		debugName += " }";
 	}
 
-	// (Optional) depth attachment
-	if (!!key.m_OMDepthRT)
-	{
-		retVal.m_Attachments.push_back(key.m_OMDepthRT.m_ImageView);
+	m_CompileCV.notify_all();
+}
+
+void StateManagerVulkan::StartCompileWorkers()
+{
+	// m_CompileMutex must be held
+	if (!m_CompileWorkers.empty())
+		return;
+
+	const auto workerCount = std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+	for (uint32_t i = 0; i < workerCount; i++)
+		m_CompileWorkers.emplace_back(&StateManagerVulkan::PipelineCompileWorker, this);
+}
+
+void StateManagerVulkan::DispatchAllPipelineCompiles()
+{
+	// m_Mutex must be held
+	{
+		std::lock_guard lock(m_CompileMutex);
+		if (m_ShutdownCompileWorkers)
+			return;
+
+		StartCompileWorkers();
+
+		// Ignores the per-frame budget, the caller is going to wait on these anyway
+		m_CompileQueue.insert(m_CompileQueue.end(), m_PendingCompiles.begin(), m_PendingCompiles.end());
+		m_PendingCompiles.clear();
+	}
+
+	m_CompileCV.notify_all();
+}
+
+void StateManagerVulkan::WaitForPipelineCompiles()
+{
+	// m_Mutex must not be held, so other threads can keep using the state manager
+	// while we wait. The compiled pipelines are retired under it afterwards.
+	{
+		std::unique_lock lock(m_CompileMutex);
+		m_CompileIdleCV.wait(lock, [&] { return m_ShutdownCompileWorkers ||
+			(m_CompileQueue.empty() && m_CompilesInFlight == 0); });
+	}
+
+	std::lock_guard lock(m_Mutex);
+	RetireCompiledPipelines();
+}
+
+void StateManagerVulkan::PipelineCompileWorker()
+{
+	while (true)
+	{
+		Pipeline* pipeline;
+		{
+			std::unique_lock lock(m_CompileMutex);
+			m_CompileCV.wait(lock, [&] { return m_ShutdownCompileWorkers || !m_CompileQueue.empty(); });
+			if (m_ShutdownCompileWorkers)
+				return;
+
+			pipeline = m_CompileQueue.front();
+			m_CompileQueue.pop_front();
+			m_CompilesInFlight++;
+		}
+
+		CompiledPipeline result{ pipeline };
+		try
+		{
+			result.m_Result = CompilePipeline(*pipeline);
+		}
+		catch (const std::exception& e)
+		{
+			// Leaves the pipeline null, so its draws keep getting skipped
+			Warning(TF2VULKAN_PREFIX "Failed to compile pipeline 0x%zX: %s\n",
+				Util::hash_value(*pipeline->m_Key), e.what());
+		}
+
+		{
+			std::lock_guard lock(m_CompileMutex);
+			m_CompiledPipelines.push_back(std::move(result));
+			m_CompilesInFlight--;
+		}
+		m_CompileIdleCV.notify_all();
+	}
+}
+
+void StateManagerVulkan::RetireCompiledPipelines()
+{
+	if (m_PendingCompileCount == 0)
+		return;
+
+	std::vector<CompiledPipeline> compiled;
+	{
+		std::lock_guard lock(m_CompileMutex);
+		compiled.swap(m_CompiledPipelines);
+	}
+
+	for (auto& entry : compiled)
+	{
+		auto& pipeline = *entry.m_Pipeline;
+		pipeline.m_Pipeline = std::move(entry.m_Result);
+
+		if (pipeline.m_Pipeline)
+			m_FallbackPipelines.FindOrInsert(FallbackPipelineKey(*pipeline.m_Key), [&] { return &pipeline; });
+
+		m_PendingCompileCount--;
+		m_CompletedCompileCount++;
+	}
+}
+
+const Pipeline* StateManagerVulkan::FindFallbackPipeline(const Pipeline& pipeline) const
+{
+	if (auto found = m_FallbackPipelines.Find(FallbackPipelineKey(*pipeline.m_Key)))
+		return *found;
+
+	return nullptr;
+}
+
+PipelineCompileStats StateManagerVulkan::GetPipelineCompileStats() const
+{
+	PipelineCompileStats retVal;
+	retVal.m_Pending = m_PendingCompileCount;
+	retVal.m_Completed = m_CompletedCompileCount;
+	retVal.m_FallbackDraws = m_FallbackDrawCount;
+	retVal.m_FoldedClears = m_FoldedClearCount;
+	retVal.m_InPassClears = m_InPassClearCount;
+	retVal.m_SkippedDraws = m_SkippedDrawCount;
+	return retVal;
+}
+
+StateManagerVulkan::~StateManagerVulkan()
+{
+	// Shutdown() joins these while the device is still alive. Any still running
+	// here could be inside vkCreateGraphicsPipelines on a device that's about to be
+	// destroyed, and joining them during DLL unload isn't safe either.
+	if (!m_CompileWorkers.empty())
+	{
+		assert(!"StateManagerVulkan destroyed without Shutdown()");
+		Warning(TF2VULKAN_PREFIX "%zu pipeline compile workers still running at exit, Shutdown() was never called\n",
+			m_CompileWorkers.size());
+
+		for (auto& worker : m_CompileWorkers)
+			worker.detach();
+	}
+}
+
+void StateManagerVulkan::Shutdown()
+{
+	LOG_FUNC();
+
+	SavePipelineManifest();
+
+	{
+		std::lock_guard lock(m_CompileMutex);
+		m_ShutdownCompileWorkers = true;
+	}
+	m_CompileCV.notify_all();
+	m_CompileIdleCV.notify_all(); // Queued compiles are dropped, so stop waiting on them
+
+	for (auto& worker : m_CompileWorkers)
+		worker.join();
+
+	m_CompileWorkers.clear();
+
+	// Anything still queued is simply dropped
+	std::lock_guard lock(m_Mutex);
+	RetireCompiledPipelines();
+}
+
+static Framebuffer CreateFramebuffer(const FramebufferKey& key, const RenderPass& renderPass)
+{
+	Framebuffer retVal;
+
+	// Attachments
+	uint32_t width = 0;// std::numeric_limits<uint32_t>::max();
+	uint32_t height = 0;// width;
+
+	std::string debugName = "COL{ ";
+	// Color attachments
+	{
+		bool debugNameFirst = true;
+
+		auto& atts = retVal.m_Attachments;
+		for (auto& colorRT : key.m_OMColorRTs)
+		{
+			if (!colorRT)
+				continue;
+
+			if (debugNameFirst)
+				debugNameFirst = false;
+			else
+				debugName += '/';
+
+			atts.push_back(colorRT.m_ImageView);
+
+			debugName += '\'';
+			debugName += std::to_string((VkImageView)colorRT.m_ImageView);
+			debugName += '\'';
+
+			if (width == 0 || colorRT.m_Extent.width < width)
+				width = colorRT.m_Extent.width;
+			if (height == 0 || colorRT.m_Extent.height < height)
+				height = colorRT.m_Extent.height;
+		}
+		debugName += " }";
+	}
+
+	// (Optional) depth attachment
+	if (!!key.m_OMDepthRT)
+	{
+		retVal.m_Attachments.push_back(key.m_OMDepthRT.m_ImageView);
 
 		debugName += " DEPTH { ";
 		debugName += std::to_string((VkImageView)key.m_OMDepthRT.m_ImageView);
@@ -911,7 +1652,7 @@ static Framebuffer CreateFramebuffer(const FramebufferKey& key)
 
 		AttachVector(ci.pAttachments, ci.attachmentCount, retVal.m_Attachments);
 
-		ci.renderPass = key.m_RenderPass->m_RenderPass.get();
+		ci.renderPass = renderPass.m_RenderPass.get();
 
 		retVal.m_Framebuffer = g_ShaderDevice.GetVulkanDevice().createFramebufferUnique(ci);
 		assert(retVal.m_Framebuffer);
@@ -921,15 +1662,23 @@ static Framebuffer CreateFramebuffer(const FramebufferKey& key)
 	return retVal;
 }
 
-const Framebuffer& StateManagerVulkan::FindOrCreateFramebuffer(const FramebufferKey& key)
+const Framebuffer& StateManagerVulkan::FindOrCreateFramebuffer(const FramebufferKey& key,
+	const RenderPass& renderPass)
 {
-	std::lock_guard lock(m_Mutex);
-
-	auto& fb = m_StatesToFramebuffers[key];
-	if (!fb)
-		fb = CreateFramebuffer(key);
+	if (auto found = m_StatesToFramebuffers.Find(key))
+		return *found;
 
-	return fb;
+	std::lock_guard lock(m_Mutex);
+	return m_StatesToFramebuffers.FindOrInsert(key, [&] { return CreateFramebuffer(key, renderPass); },
+		[&](const FramebufferKey& cachedKey, Framebuffer& fb)
+		{
+			for (const auto& view : fb.m_Attachments)
+			{
+				auto& keys = m_ViewsToFramebuffers[static_cast<VkImageView>(view)];
+				if (keys.empty() || keys.back() != &cachedKey)
+					keys.push_back(&cachedKey);
+			}
+		});
 }
 
 static vk::SamplerAddressMode ConvertAddressMode(ShaderTexWrapMode_t mode)
@@ -1022,64 +1771,227 @@ static Sampler CreateSampler(const SamplerKey& key)
 
 const Sampler& StateManagerVulkan::FindOrCreateSampler(const SamplerKey& key)
 {
+	if (auto found = m_StatesToSamplers.Find(key))
+		return *found;
+
 	std::lock_guard lock(m_Mutex);
+	return m_StatesToSamplers.FindOrInsert(key, [&] { return CreateSampler(key); });
+}
 
-	auto& sampler = m_StatesToSamplers[key];
-	if (!sampler)
-		sampler = CreateSampler(key);
+static vk::Rect2D GetRenderArea(const Framebuffer& fb)
+{
+	vk::Rect2D retVal;
+	retVal.extent.width = fb.m_CreateInfo.width;
+	retVal.extent.height = fb.m_CreateInfo.height;
+	return retVal;
+}
 
-	return sampler;
+// Framebuffers are keyed on image views, so any render pass we'd use with the
+// same one is compatible with the pass that's already open. Load/store ops are
+// the only thing that differs, and those only matter at begin.
+static bool IsFramebufferActive(const Framebuffer& fb, const IVulkanCommandBuffer& buf)
+{
+	const auto active = buf.GetActiveRenderPass();
+	return active &&
+		active->m_BeginInfo.framebuffer == fb.m_Framebuffer.get() &&
+		active->m_BeginInfo.renderArea == GetRenderArea(fb);
 }
 
-void StateManagerVulkan::ApplyRenderPass(const RenderPass& renderPass, IVulkanCommandBuffer& buf)
+void StateManagerVulkan::BeginRenderPass(const RenderPass& renderPass, const Framebuffer& framebuffer,
+	const LogicalShadowState& staticState, const vk::ArrayProxy<const vk::ClearValue>& clearValues,
+	IVulkanCommandBuffer& buf)
 {
-	LOG_FUNC();
+	buf.TryEndRenderPass();
+
+	// Attachments are expected in their attachment layouts at the start of the pass
+	// (and are left that way). If the pass overwrites everything, there's nothing to keep.
+	const auto& key = renderPass.m_Key;
+	for (size_t i = 0; i < key.m_ColorAttachments.size(); i++)
+	{
+		const auto& att = key.m_ColorAttachments[i];
+		if (!!att)
+		{
+			FindTexture(staticState.m_OMColorRTs[i]).Transition(buf,
+				ImageLayoutTracker::Usage::ColorAttachment(), att.m_LoadOp != vk::AttachmentLoadOp::eLoad);
+		}
+	}
+
+	if (const auto& att = key.m_DepthAttachment; !!att)
+	{
+		const bool hasStencil = !!(FormatInfo::GetAspects(att.m_Format) & vk::ImageAspectFlagBits::eStencil);
+		const bool discard = att.m_LoadOp != vk::AttachmentLoadOp::eLoad &&
+			(!hasStencil || att.m_StencilLoadOp != vk::AttachmentLoadOp::eLoad);
+
+		FindTexture(staticState.m_OMDepthRT, true).Transition(buf,
+			ImageLayoutTracker::Usage::DepthStencilAttachment(), discard);
+	}
 
 	vk::RenderPassBeginInfo rpInfo;
 	rpInfo.renderPass = renderPass.m_RenderPass.get();
+	rpInfo.framebuffer = framebuffer.m_Framebuffer.get();
+	rpInfo.renderArea = GetRenderArea(framebuffer);
+	rpInfo.clearValueCount = clearValues.size();
+	rpInfo.pClearValues = clearValues.data();
 
-	vk::ClearValue clearVal[2];
-	clearVal[0].color.float32[0] = 157 / 255.0f;
-	clearVal[0].color.float32[1] =  83 / 255.0f;
-	clearVal[0].color.float32[2] =  34 / 255.0f;
-	clearVal[0].color.float32[3] = 255 / 255.0f;
+	buf.beginRenderPass(rpInfo, vk::SubpassContents::eInline);
+}
 
-	clearVal[1].depthStencil.depth = 1;
-	clearVal[1].depthStencil.stencil = 0;
+void StateManagerVulkan::ApplyRenderPass(const RenderPass& renderPass, const LogicalShadowState& staticState,
+	IVulkanCommandBuffer& buf)
+{
+	LOG_FUNC();
 
-	rpInfo.clearValueCount = std::size(clearVal);
-	rpInfo.pClearValues = clearVal;
+	const auto& fb = FindOrCreateFramebuffer(FramebufferKey(staticState, renderPass.m_Key), renderPass);
 
-	//state.m_RenderPass->m_CreateInfo.
+	// Keep drawing into the open pass for as long as the render targets don't change,
+	// even if it was begun with a different (clearing) variant of this render pass
+	if (!IsFramebufferActive(fb, buf))
+		BeginRenderPass(renderPass, fb, staticState, nullptr, buf);
+}
 
-	// Hack!
-	const auto& fb = FindOrCreateFramebuffer(renderPass);
-	rpInfo.framebuffer = fb.m_Framebuffer.get();
+void StateManagerVulkan::ClearRenderTargets(const LogicalShadowState& staticState,
+	const LogicalDynamicState& dynamicState, bool clearColor, bool clearDepth, bool clearStencil,
+	uint32_t width, uint32_t height, IVulkanCommandBuffer& buf)
+{
+	LOG_FUNC();
 
-	rpInfo.renderArea.extent.width = fb.m_CreateInfo.width;
-	rpInfo.renderArea.extent.height = fb.m_CreateInfo.height;
+	RenderPassKey rpKey(staticState, dynamicState);
+	auto& colorAtt = rpKey.m_ColorAttachments[0];
+	auto& depthAtt = rpKey.m_DepthAttachment;
 
-	if (!buf.IsRenderPassActive(rpInfo, vk::SubpassContents::eInline))
+	clearColor &= !!colorAtt;
+	clearDepth &= !!depthAtt;
+	clearStencil &= !!depthAtt && !!(FormatInfo::GetAspects(depthAtt.m_Format) & vk::ImageAspectFlagBits::eStencil);
+	if (!clearColor && !clearDepth && !clearStencil)
+		return;
+
+	const auto& fb = FindOrCreateFramebuffer(FramebufferKey(staticState, rpKey), FindOrCreateRenderPass(rpKey));
+	const auto renderArea = GetRenderArea(fb);
+
+	vk::ClearValue colorValue;
+	Util::algorithm::copy(dynamicState.m_ClearColor, colorValue.color.float32);
+
+	vk::ClearValue depthValue;
+	depthValue.depthStencil.depth = 1;
+	depthValue.depthStencil.stencil = 0;
+
+	// A clear of the whole framebuffer right as its pass begins costs nothing
+	// extra, so do that unless we're already in the middle of drawing to it
+	if (!IsFramebufferActive(fb, buf) &&
+		width >= renderArea.extent.width && height >= renderArea.extent.height)
 	{
-		if (buf.GetActiveRenderPass())
-			buf.endRenderPass();
+		if (clearColor)
+			colorAtt.m_LoadOp = vk::AttachmentLoadOp::eClear;
+		if (clearDepth)
+			depthAtt.m_LoadOp = vk::AttachmentLoadOp::eClear;
+		if (clearStencil)
+			depthAtt.m_StencilLoadOp = vk::AttachmentLoadOp::eClear;
+
+		rpKey.UpdateHash();
+
+		// Same attachment order as CreateRenderPass()
+		Util::InPlaceVector<vk::ClearValue, 5> clearValues;
+		for (const auto& att : rpKey.m_ColorAttachments)
+		{
+			if (!!att)
+				clearValues.push_back(&att == &colorAtt ? colorValue : vk::ClearValue{});
+		}
+		if (!!depthAtt)
+			clearValues.push_back(depthValue);
 
-		buf.beginRenderPass(rpInfo, vk::SubpassContents::eInline);
+		BeginRenderPass(FindOrCreateRenderPass(rpKey), fb, staticState,
+			{ uint32_t(clearValues.size()), clearValues.data() }, buf);
+		m_FoldedClearCount++;
+		return;
 	}
+
+	if (!IsFramebufferActive(fb, buf))
+		BeginRenderPass(FindOrCreateRenderPass(rpKey), fb, staticState, nullptr, buf);
+
+	Util::InPlaceVector<vk::ClearAttachment, 2> atts;
+	if (clearColor)
+	{
+		auto& att = atts.emplace_back();
+		att.aspectMask = vk::ImageAspectFlagBits::eColor;
+		att.colorAttachment = 0;
+		att.clearValue = colorValue;
+	}
+
+	if (clearDepth || clearStencil)
+	{
+		auto& att = atts.emplace_back();
+		if (clearDepth)
+			att.aspectMask |= vk::ImageAspectFlagBits::eDepth;
+		if (clearStencil)
+			att.aspectMask |= vk::ImageAspectFlagBits::eStencil;
+
+		att.clearValue = depthValue;
+	}
+
+	vk::ClearRect rect;
+	rect.rect.extent.width = std::min(width, renderArea.extent.width);
+	rect.rect.extent.height = std::min(height, renderArea.extent.height);
+	rect.layerCount = 1;
+
+	buf.clearAttachments({ uint32_t(atts.size()), atts.data() }, rect);
+	m_InPassClearCount++;
 }
 
-static const size_t CBUF_OFFSETS[] =
+static VulkanRingBuffer::Allocation WriteUniformBlock(UniformBufferStandardType bufType,
+	const ShaderConstants::ShaderData& data)
 {
-	0,
-	offsetof(ShaderConstants::ShaderData, m_VSData) + offsetof(ShaderConstants::VSData, m_Common),
-	offsetof(ShaderConstants::ShaderData, m_VSData) + offsetof(ShaderConstants::VSData, m_Matrices),
-	offsetof(ShaderConstants::ShaderData, m_VSData) + offsetof(ShaderConstants::VSData, m_Custom),
-	offsetof(ShaderConstants::ShaderData, m_VSData) + offsetof(ShaderConstants::VSData, m_ModelMatrices),
+	const void* src;
+	size_t size;
+	switch (bufType)
+	{
+	default:
+		throw VulkanException("Unknown UniformBufferStandardType", EXCEPTION_DATA());
+
+	case UniformBufferStandardType::VSCommon:
+		src = &data.m_VSData.m_Common;
+		size = sizeof(data.m_VSData.m_Common);
+		break;
+	case UniformBufferStandardType::VSMatrices:
+		src = &data.m_VSData.m_Matrices;
+		size = sizeof(data.m_VSData.m_Matrices);
+		break;
+	case UniformBufferStandardType::VSCustom:
+		src = &data.m_VSData.m_Custom;
+		size = sizeof(data.m_VSData.m_Custom);
+		break;
+	case UniformBufferStandardType::VSModelMatrices:
+		src = &data.m_VSData.m_ModelMatrices;
+		size = sizeof(data.m_VSData.m_ModelMatrices);
+		break;
+	case UniformBufferStandardType::PSCommon:
+		src = &data.m_PSData.m_Common;
+		size = sizeof(data.m_PSData.m_Common);
+		break;
+	case UniformBufferStandardType::PSCustom:
+		src = &data.m_PSData.m_Custom;
+		size = sizeof(data.m_PSData.m_Custom);
+		break;
+	}
 
-	offsetof(ShaderConstants::ShaderData, m_PSData) + offsetof(ShaderConstants::PSData, m_Common),
-	offsetof(ShaderConstants::ShaderData, m_PSData) + offsetof(ShaderConstants::PSData, m_Custom),
-	offsetof(ShaderConstants::ShaderData, m_PSData) + sizeof(ShaderConstants::PSData),
-};
+	auto alloc = g_UniformRing.Allocate(size, g_MatSysConfig.MinUniformBufferOffsetAlignment());
+	memcpy(alloc.m_Data, src, size);
+	return alloc;
+}
+
+// Render targets are left in their attachment layouts, so anything that was
+// drawn to needs a barrier before it can be sampled.
+static void PrepareForSampling(IVulkanTexture& tex, IVulkanCommandBuffer& buf)
+{
+	const auto range = tex.GetViewRange();
+	const auto usage = ImageLayoutTracker::Usage::ShaderRead();
+	if (!tex.GetLayoutTracker().NeedsTransition(range, usage))
+		return;
+
+	// Barriers can't be recorded inside a render pass. This also ends the pass if
+	// tex is one of its attachments, ApplyRenderPass() reopens it if needed.
+	buf.TryEndRenderPass();
+	tex.Transition(buf, range, usage);
+}
 
 void StateManagerVulkan::ApplyDescriptorSets(const Pipeline& pipeline,
 	const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
@@ -1089,139 +2001,483 @@ void StateManagerVulkan::ApplyDescriptorSets(const Pipeline& pipeline,
 	const auto& layouts = pipeline.m_Layout->m_SetLayouts;
 	assert(layouts.size() == 1);
 
-	auto dummyUniformBuf = Factories::BufferFactory{}
-		.SetSize(sizeof(dynamicState.m_ShaderData))
-		.SetAllowMapping(true)
-		.SetMemoryRequiredFlags(vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent)
-		.SetDebugName(__FUNCTION__ "(): Temporary test uniform buffer")
-		.SetUsage(vk::BufferUsageFlagBits::eUniformBuffer)
-		.Create();
-
-	bool cbufUpdated[(size_t)UniformBufferStandardType::COUNT] = {};
-
-	std::vector<vk::UniqueDescriptorSet> descriptorSets;
-	std::vector<vk::WriteDescriptorSet> writes;
-	std::vector<vk::CopyDescriptorSet> copies;
-	std::forward_list<vk::DescriptorImageInfo> imageInfos;
-	std::forward_list<vk::DescriptorBufferInfo> bufferInfos;
+	// Only the blocks this pipeline actually references get written, once per draw
+	VulkanRingBuffer::Allocation cbufAllocs[(size_t)UniformBufferStandardType::COUNT];
+
+	// Dynamic offsets are consumed in binding order
+	std::vector<std::pair<uint32_t, uint32_t>> dynamicOffsets;
+
+	std::vector<vk::DescriptorSet> boundSets;
 	for (const auto& layout : layouts)
 	{
+		// Resolve everything the set refers to, so identical bindings can share a set
+		DescriptorSetKey key(layout);
+		bool cacheable = true;
+
+		assert(layout.m_Bindings.size() == layout.m_BufferTypes.size());
+		for (size_t i = 0; i < layout.m_Bindings.size(); i++)
+		{
+			const vk::DescriptorSetLayoutBinding& binding = layout.m_Bindings.at(i);
+			const UniformBufferStandardType bufType = layout.m_BufferTypes.at(i);
+
+			auto& res = key.m_Resources.emplace_back();
+			switch (binding.descriptorType)
+			{
+			case vk::DescriptorType::eSampler:
+			{
+				// Built once, so its hash is too
+				static const SamplerKey s_DefaultSamplerKey(SamplerSettings{});
+				res.m_Sampler = FindOrCreateSampler(s_DefaultSamplerKey).m_Sampler.get();
+				break;
+			}
+
+			case vk::DescriptorType::eSampledImage:
+			{
+				auto& tex = g_TextureManager.TryGetTexture(
+					dynamicState.m_BoundTextures.at(binding.binding - BINDING_TEXTURE_OFFSET),
+					TEXTURE_BLACK);
+				PrepareForSampling(tex, buf);
+				res.m_ImageView = tex.FindOrCreateView();
+				break;
+			}
+
+			case vk::DescriptorType::eUniformBufferDynamic:
+			{
+				auto& cbufAlloc = cbufAllocs[size_t(bufType)];
+				if (!cbufAlloc)
+					cbufAlloc = WriteUniformBlock(bufType, dynamicState.m_ShaderData);
+
+				res.m_Buffer = cbufAlloc.m_Buffer;
+				res.m_Range = cbufAlloc.m_Size;
+				if (cbufAlloc.m_IsOverflow)
+					cacheable = false;
+
+				auto& dynOffset = dynamicOffsets.emplace_back();
+				dynOffset.first = binding.binding;
+				Util::SafeConvert(cbufAlloc.m_Offset, dynOffset.second);
+				break;
+			}
+
+			default:
+				throw VulkanException("Unexpected DescriptorType", EXCEPTION_DATA());
+			}
+		}
+
+		key.UpdateHash();
+		if (auto found = m_DescriptorSetCache.Find(key))
+		{
+			boundSets.push_back(found->get());
+			continue;
+		}
+
+		// Cache miss, allocate and write a new set
+		std::lock_guard lock(m_Mutex);
+		if (auto found = m_DescriptorSetCache.Find(key))
+		{
+			boundSets.push_back(found->get());
+			continue;
+		}
+
+		ReleaseRetiredDescriptorSets();
+
 		auto& pool = FindOrCreateDescriptorPool(layout);
+		if (pool.m_CachedSetCount >= MAX_CACHED_DESCRIPTOR_SETS)
+			cacheable = false;
 
-		vk::DescriptorSetAllocateInfo allocInfo;
-		allocInfo.descriptorPool = pool.m_DescriptorPool.get();
-		allocInfo.pSetLayouts = &layout.m_Layout.get();
-		allocInfo.descriptorSetCount = 1;
+		vk::UniqueDescriptorSet cachedSet;
+		if (cacheable)
+		{
+			vk::DescriptorSetAllocateInfo allocInfo;
+			allocInfo.descriptorPool = pool.m_DescriptorPool.get();
+			allocInfo.pSetLayouts = &layout.m_Layout.get();
+			allocInfo.descriptorSetCount = 1;
+
+			try
+			{
+				cachedSet = std::move(device.allocateDescriptorSetsUnique(allocInfo).at(0));
+			}
+			catch (const vk::OutOfPoolMemoryError&)
+			{
+				// The count should keep us from getting here, but an uncached set is
+				// still better than losing the draw
+				cacheable = false;
+			}
+			catch (const vk::FragmentedPoolError&)
+			{
+				cacheable = false;
+			}
+		}
 
-		auto& newSet = descriptorSets.emplace_back(std::move(device.allocateDescriptorSetsUnique(allocInfo).at(0)));
+		const vk::DescriptorSet newSet = cacheable ? cachedSet.get() : AllocateTransientDescriptorSet(layout);
 
-		assert(layout.m_Bindings.size() == layout.m_BufferTypes.size());
+		Util::InPlaceVector<vk::WriteDescriptorSet, 64> writes;
+		Util::InPlaceVector<vk::DescriptorImageInfo, 64> imageInfos;
+		Util::InPlaceVector<vk::DescriptorBufferInfo, 64> bufferInfos;
 		for (size_t i = 0; i < layout.m_Bindings.size(); i++)
 		{
-			const vk::DescriptorSetLayoutBinding &binding = layout.m_Bindings.at(i);
-			const UniformBufferStandardType bufType = layout.m_BufferTypes.at(i);
-			const uint_fast8_t bufTypeIndex = uint_fast8_t(bufType);
+			const vk::DescriptorSetLayoutBinding& binding = layout.m_Bindings.at(i);
+			const auto& res = key.m_Resources.at(i);
 
 			auto& write = writes.emplace_back();
 			write.descriptorType = binding.descriptorType;
 			write.descriptorCount = binding.descriptorCount;
 			write.dstBinding = binding.binding;
-			write.dstSet = newSet.get();
+			write.dstSet = newSet;
 
 			switch (write.descriptorType)
 			{
 			case vk::DescriptorType::eSampler:
 			{
-				auto& imgInfo = imageInfos.emplace_front();
-				auto& sampler = FindOrCreateSampler(SamplerSettings{});
-				imgInfo.sampler = sampler.m_Sampler.get();
+				auto& imgInfo = imageInfos.emplace_back();
+				imgInfo.sampler = res.m_Sampler;
 				write.pImageInfo = &imgInfo;
 				break;
 			}
 			case vk::DescriptorType::eSampledImage:
 			{
-				auto& imgInfo = imageInfos.emplace_front();
-				auto& tex = g_TextureManager.TryGetTexture(
-					dynamicState.m_BoundTextures.at(binding.binding - BINDING_TEXTURE_OFFSET),
-					TEXTURE_BLACK);
-				imgInfo.imageView = tex.FindOrCreateView();
-				//imgInfo.sampler = FindOrCreateSampler(SamplerSettings{}).m_Sampler.get();
+				auto& imgInfo = imageInfos.emplace_back();
+				imgInfo.imageView = res.m_ImageView;
 				imgInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 				write.pImageInfo = &imgInfo;
 				break;
 			}
-			case vk::DescriptorType::eUniformBuffer:
+			case vk::DescriptorType::eUniformBufferDynamic:
 			{
-				auto& bufInfo = bufferInfos.emplace_front();
+				auto& bufInfo = bufferInfos.emplace_back();
+				bufInfo.buffer = res.m_Buffer;
+				bufInfo.offset = 0;
+				bufInfo.range = res.m_Range;
 				write.pBufferInfo = &bufInfo;
-				bufInfo.buffer = dummyUniformBuf.GetBuffer();
-				bufInfo.offset = CBUF_OFFSETS[bufTypeIndex];
-				bufInfo.range = CBUF_OFFSETS[bufTypeIndex + 1] - CBUF_OFFSETS[bufTypeIndex];
+				break;
+			}
+			}
+		}
+
+		device.updateDescriptorSets({ uint32_t(writes.size()), writes.data() }, {});
 
-				if (!cbufUpdated[bufTypeIndex])
+		boundSets.push_back(newSet);
+		if (cacheable)
+		{
+			pool.m_CachedSetCount++;
+			m_DescriptorSetCache.FindOrInsert(key, [&] { return std::move(cachedSet); },
+				[&](const DescriptorSetKey& cachedKey, vk::UniqueDescriptorSet&)
 				{
-					auto& alloc = dummyUniformBuf.GetAllocation();
-					switch (bufType)
+					for (const auto& res : cachedKey.m_Resources)
 					{
-					default:
-						assert(!"Unknown buffer type");
-
-					case UniformBufferStandardType::VSCommon:
-						alloc.Write(dynamicState.m_ShaderData.m_VSData.m_Common, bufInfo.offset);
-						break;
-					case UniformBufferStandardType::VSMatrices:
-						alloc.Write(dynamicState.m_ShaderData.m_VSData.m_Matrices, bufInfo.offset);
-						break;
-					case UniformBufferStandardType::VSCustom:
-						alloc.Write(dynamicState.m_ShaderData.m_VSData.m_Custom, bufInfo.offset);
-						break;
-					case UniformBufferStandardType::VSModelMatrices:
-						alloc.Write(dynamicState.m_ShaderData.m_VSData.m_ModelMatrices, bufInfo.offset);
-						break;
-					case UniformBufferStandardType::PSCommon:
-						alloc.Write(dynamicState.m_ShaderData.m_PSData.m_Common, bufInfo.offset);
-						break;
-					case UniformBufferStandardType::PSCustom:
-						alloc.Write(dynamicState.m_ShaderData.m_PSData.m_Custom, bufInfo.offset);
-						break;
+						if (!res.m_ImageView)
+							continue;
+
+						// The same view bound to several slots only needs one entry
+						auto& keys = m_ViewsToDescriptorSets[static_cast<VkImageView>(res.m_ImageView)];
+						if (keys.empty() || keys.back() != &cachedKey)
+							keys.push_back(&cachedKey);
 					}
+				});
+		}
+	}
 
-					cbufUpdated[bufTypeIndex] = true;
-				}
+	std::sort(dynamicOffsets.begin(), dynamicOffsets.end());
+	auto rawOffsets = reinterpret_cast<uint32_t*>(stackalloc(dynamicOffsets.size() * sizeof(uint32_t)));
+	for (size_t i = 0; i < dynamicOffsets.size(); i++)
+		rawOffsets[i] = dynamicOffsets[i].second;
 
-				break;
+	buf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline.m_Layout->m_Layout.get(), 0,
+		boundSets, { dynamicOffsets.size(), rawOffsets });
+}
+
+static vk::UniqueDescriptorPool CreateTransientDescriptorPool(size_t frameIndex, size_t poolIndex)
+{
+	LOG_FUNC();
+
+	const vk::DescriptorPoolSize sizes[] =
+	{
+		{ vk::DescriptorType::eSampler, TRANSIENT_POOL_SETS * 8 },
+		{ vk::DescriptorType::eSampledImage, TRANSIENT_POOL_SETS * 8 },
+		{ vk::DescriptorType::eUniformBufferDynamic, TRANSIENT_POOL_SETS * 6 },
+	};
+
+	vk::DescriptorPoolCreateInfo ci;
+	ci.maxSets = TRANSIENT_POOL_SETS;
+	ci.pPoolSizes = sizes;
+	ci.poolSizeCount = uint32_t(std::size(sizes));
+
+	auto retVal = g_ShaderDevice.GetVulkanDevice().createDescriptorPoolUnique(ci);
+
+	char buf[128];
+	sprintf_s(buf, "TF2Vulkan Transient Descriptor Pool (frame %zu, #%zu)", frameIndex, poolIndex);
+	g_ShaderDevice.SetDebugName(retVal, buf);
+
+	return retVal;
+}
+
+vk::DescriptorSet StateManagerVulkan::AllocateTransientDescriptorSet(const DescriptorSetLayout& layout)
+{
+	auto& device = g_ShaderDevice.GetVulkanDevice();
+
+	const auto frameNumber = g_ShaderDevice.GetFrameNumber();
+	const size_t frameIndex = size_t(frameNumber % MAX_FRAMES_IN_FLIGHT);
+	auto& frame = m_TransientPools[frameIndex];
+
+	// Everything allocated the last time this frame index was used is done with by now
+	if (m_TransientPoolsFrame != frameNumber)
+	{
+		m_TransientPoolsFrame = frameNumber;
+		for (auto& pool : frame.m_Pools)
+			device.resetDescriptorPool(pool.get());
+
+		frame.m_CurrentPool = 0;
+	}
+
+	vk::DescriptorSetAllocateInfo allocInfo;
+	allocInfo.pSetLayouts = &layout.m_Layout.get();
+	allocInfo.descriptorSetCount = 1;
+
+	while (true)
+	{
+		if (frame.m_CurrentPool >= frame.m_Pools.size())
+			frame.m_Pools.push_back(CreateTransientDescriptorPool(frameIndex, frame.m_Pools.size()));
+
+		allocInfo.descriptorPool = frame.m_Pools[frame.m_CurrentPool].get();
+
+		vk::DescriptorSet retVal;
+		switch (const auto result = device.allocateDescriptorSets(&allocInfo, &retVal))
+		{
+		case vk::Result::eSuccess:
+			return retVal;
+
+		case vk::Result::eErrorOutOfPoolMemory:
+		case vk::Result::eErrorFragmentedPool:
+			// Move on to the next pool, creating it if needed
+			frame.m_CurrentPool++;
+			break;
+
+		default:
+			throw VulkanException(result, EXCEPTION_DATA());
+		}
+	}
+}
+
+void StateManagerVulkan::FlushDescriptorSetCache()
+{
+	LOG_FUNC();
+	std::lock_guard lock(m_Mutex);
+
+	m_DescriptorSetCache.ForEach([&](const DescriptorSetKey& key, vk::UniqueDescriptorSet& set)
+		{
+			RetireCachedDescriptorSet(key, std::move(set));
+		});
+
+	// Only called between draws on the main thread, so nobody can be looking anything up
+	m_DescriptorSetCache.Clear();
+	m_ViewsToDescriptorSets.clear();
+}
+
+void StateManagerVulkan::EvictImageViews(const vk::ArrayProxy<const vk::ImageView>& views)
+{
+	LOG_FUNC();
+	std::lock_guard lock(m_Mutex);
+
+	// Same as FlushDescriptorSetCache(), nobody can be looking anything up
+	for (const auto& view : views)
+	{
+		const auto found = m_ViewsToDescriptorSets.find(static_cast<VkImageView>(view));
+		if (found == m_ViewsToDescriptorSets.end())
+			continue;
+
+		const auto keys = std::move(found->second);
+		m_ViewsToDescriptorSets.erase(found);
+
+		for (const DescriptorSetKey* key : keys)
+		{
+			// Unlink it from every other view it refers to
+			for (const auto& res : key->m_Resources)
+			{
+				if (!res.m_ImageView || res.m_ImageView == view)
+					continue;
+
+				if (auto other = m_ViewsToDescriptorSets.find(static_cast<VkImageView>(res.m_ImageView));
+					other != m_ViewsToDescriptorSets.end())
+				{
+					auto& otherKeys = other->second;
+					otherKeys.erase(std::remove(otherKeys.begin(), otherKeys.end(), key), otherKeys.end());
+					if (otherKeys.empty())
+						m_ViewsToDescriptorSets.erase(other);
+				}
 			}
 
-			default:
-				throw VulkanException("Unexpected DescriptorType", EXCEPTION_DATA());
+			RetireCachedDescriptorSet(*key, std::move(*m_DescriptorSetCache.Find(*key)));
+			m_DescriptorSetCache.Erase(*key);
+		}
+	}
+
+	// A new view could be handed the same handle, and then match a framebuffer
+	// built on the destroyed one
+	for (const auto& view : views)
+	{
+		const auto found = m_ViewsToFramebuffers.find(static_cast<VkImageView>(view));
+		if (found == m_ViewsToFramebuffers.end())
+			continue;
+
+		const auto keys = std::move(found->second);
+		m_ViewsToFramebuffers.erase(found);
+
+		for (const FramebufferKey* key : keys)
+		{
+			auto& fb = *m_StatesToFramebuffers.Find(*key);
+			for (const auto& attachment : fb.m_Attachments)
+			{
+				if (attachment == view)
+					continue;
+
+				if (auto other = m_ViewsToFramebuffers.find(static_cast<VkImageView>(attachment));
+					other != m_ViewsToFramebuffers.end())
+				{
+					auto& otherKeys = other->second;
+					otherKeys.erase(std::remove(otherKeys.begin(), otherKeys.end(), key), otherKeys.end());
+					if (otherKeys.empty())
+						m_ViewsToFramebuffers.erase(other);
+				}
 			}
+
+			// Nothing more can be recorded into a render pass on it
+			if (auto& primaryCmdBuf = g_ShaderDevice.GetPrimaryCmdBuf(); IsFramebufferActive(fb, primaryCmdBuf))
+				primaryCmdBuf.TryEndRenderPass();
+
+			g_DeferredDestruction.Add(std::move(fb.m_Framebuffer));
+			m_StatesToFramebuffers.Erase(*key);
 		}
 	}
+}
 
-	device.updateDescriptorSets(writes, copies);
+void StateManagerVulkan::RetireCachedDescriptorSet(const DescriptorSetKey& key, vk::UniqueDescriptorSet&& set)
+{
+	// m_Mutex must be held
+	auto& retired = m_RetiredDescriptorSets.emplace_back();
+	retired.m_Set = std::move(set);
+	retired.m_Pool = &FindOrCreateDescriptorPool(*key.m_Layout);
+	retired.m_FrameNumber = g_ShaderDevice.GetFrameNumber();
+}
+
+void StateManagerVulkan::ReleaseRetiredDescriptorSets()
+{
+	// m_Mutex must be held. Same reasoning as the transient pools: once a frame
+	// index comes back around, the GPU is done with everything recorded for it.
+	const auto frameNumber = g_ShaderDevice.GetFrameNumber();
+	while (!m_RetiredDescriptorSets.empty() &&
+		m_RetiredDescriptorSets.front().m_FrameNumber + MAX_FRAMES_IN_FLIGHT <= frameNumber)
+	{
+		auto& retired = m_RetiredDescriptorSets.front();
+		assert(retired.m_Pool->m_CachedSetCount > 0);
+		retired.m_Pool->m_CachedSetCount--;
+		m_RetiredDescriptorSets.pop_front();
+	}
+}
+
+static void ApplyViewport(const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
+{
+	// Pipelines only have a single viewport (no multiViewport)
+	ShaderViewport_t vpIn;
+	if (!dynamicState.m_Viewports.empty())
+	{
+		vpIn = dynamicState.m_Viewports[0];
+	}
+	else
+	{
+		int bbWidth, bbHeight;
+		g_ShaderDevice.GetBackBufferDimensions(bbWidth, bbHeight);
+		vpIn.Init(0, 0, bbWidth, bbHeight);
+	}
 
-	TF2VULKAN_MAKE_NONUNIQUE_STACK_COPY(rawSets, descriptorSets);
+	vk::Viewport vpOut;
+	Util::SafeConvert(vpIn.m_nWidth, vpOut.width);
+	Util::SafeConvert(vpIn.m_nHeight, vpOut.height);
+	Util::SafeConvert(vpIn.m_nTopLeftX, vpOut.x);
+	Util::SafeConvert(vpIn.m_nTopLeftY, vpOut.y);
+	Util::SafeConvert(vpIn.m_flMinZ, vpOut.minDepth);
+	Util::SafeConvert(vpIn.m_flMaxZ, vpOut.maxDepth);
+	buf.SetViewport(vpOut);
+
+	vk::Rect2D scissor;
+	Util::SafeConvert(vpIn.m_nTopLeftX, scissor.offset.x);
+	Util::SafeConvert(vpIn.m_nTopLeftY, scissor.offset.y);
+	Util::SafeConvert(vpIn.m_nWidth, scissor.extent.width);
+	Util::SafeConvert(vpIn.m_nHeight, scissor.extent.height);
+	buf.SetScissor(scissor);
+}
 
-	buf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline.m_Layout->m_Layout.get(), 0, { descriptorSets.size(), rawSets }, {});
-	buf.AddResource(std::move(dummyUniformBuf));
-	buf.AddResource(std::move(descriptorSets));
+static void ApplyDepthStencilState(const LogicalShadowState& staticState,
+	const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
+{
+	buf.SetStencilReference(dynamicState.m_StencilRef);
+	buf.SetStencilCompareMask(dynamicState.m_StencilTestMask);
+	buf.SetStencilWriteMask(dynamicState.m_StencilWriteMask);
+
+	// Otherwise, baked into the pipeline
+	if (!g_ShaderDevice.HasExtendedDynamicState())
+		return;
+
+	const ExtendedDynamicStateKey state(staticState, dynamicState);
+	buf.SetCullMode(ConvertCullMode(state.m_RSBackFaceCulling));
+	buf.SetDepthTestEnable(state.m_DepthTest);
+	buf.SetDepthWriteEnable(state.m_DepthWrite);
+	buf.SetDepthCompareOp(ConvertCompareOp(state.m_DepthCompareFunc));
+	buf.SetStencilTestEnable(state.m_StencilEnable);
+	buf.SetStencilOp(
+		ConvertStencilOp(state.m_StencilFailOp),
+		ConvertStencilOp(state.m_StencilPassOp),
+		ConvertStencilOp(state.m_StencilDepthFailOp),
+		ConvertCompareOp(state.m_StencilCompareFunc));
 }
 
-void StateManagerVulkan::ApplyState(VulkanStateID id, const LogicalShadowState& staticState,
+bool StateManagerVulkan::ApplyState(VulkanStateID id, const LogicalShadowState& staticState,
 	const LogicalDynamicState& dynamicState, IVulkanCommandBuffer& buf)
 {
 	LOG_FUNC();
-	std::lock_guard lock(m_Mutex);
 
-	auto pixScope = buf.DebugRegionBegin("StateManagerVulkan::ApplyState(%zu)", Util::UValue(id));
+	// Compiled pipelines are only handed over while compiles are outstanding, so
+	// once everything has been built there's nothing left to lock for
+	std::unique_lock lock(m_Mutex, std::defer_lock);
+	if (m_PendingCompileCount > 0)
+	{
+		lock.lock();
+		RetireCompiledPipelines();
+		DispatchPipelineCompiles();
+	}
 
 	const auto& state = *m_IDsToPipelines.at(size_t(id));
 
-	buf.bindPipeline(vk::PipelineBindPoint::eGraphics, state.m_Pipeline.get());
+	// Descriptor sets are still written against our own layout, which is
+	// compatible with the fallback's.
+	const Pipeline* pipeline = &state;
+	if (!state)
+	{
+		if (!lock.owns_lock())
+			lock.lock();
 
-	ApplyRenderPass(*state.m_RenderPass, buf);
+		pipeline = FindFallbackPipeline(state);
+		if (!pipeline)
+		{
+			m_SkippedDrawCount++;
+			return false;
+		}
+
+		m_FallbackDrawCount++;
+	}
+
+	auto pixScope = buf.DebugRegionBegin("StateManagerVulkan::ApplyState(%zu)", Util::UValue(id));
+
+	buf.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline->m_Pipeline.get());
+
+	ApplyViewport(dynamicState, buf);
+	ApplyDepthStencilState(staticState, dynamicState, buf);
 
+	// Descriptor sets go first, since sampled textures may need barriers that
+	// can only be recorded outside of the render pass
 	ApplyDescriptorSets(state, dynamicState, buf);
+
+	ApplyRenderPass(*state.m_RenderPass, staticState, buf);
+
+	return true;
 }
 
 static DescriptorPool CreateDescriptorPool(const DescriptorPoolKey& key)
@@ -1229,7 +2485,8 @@ static DescriptorPool CreateDescriptorPool(const DescriptorPoolKey& key)
 	LOG_FUNC();
 	DescriptorPool retVal;
 
-	constexpr auto POOL_SIZE = 1024;
+	// Only used for cached sets, anything else comes from the transient pools
+	constexpr auto POOL_SIZE = MAX_CACHED_DESCRIPTOR_SETS;
 
 	// Sizes
 	for (const auto& binding : key.m_Layout->m_Bindings)
@@ -1261,62 +2518,329 @@ static DescriptorPool CreateDescriptorPool(const DescriptorPoolKey& key)
 const DescriptorPool& StateManagerVulkan::FindOrCreateDescriptorPool(const DescriptorPoolKey& key)
 {
 	LOG_FUNC();
+	if (auto found = m_StatesToDescPools.Find(key))
+		return *found;
+
 	std::lock_guard lock(m_Mutex);
+	return m_StatesToDescPools.FindOrInsert(key, [&] { return CreateDescriptorPool(key); });
+}
 
-	auto& pool = m_StatesToDescPools[key];
-	if (!pool)
-		pool = CreateDescriptorPool(key);
+const RenderPass& StateManagerVulkan::FindOrCreateRenderPass(const RenderPassKey& key)
+{
+	LOG_FUNC();
+	if (auto found = m_StatesToRenderPasses.Find(key))
+	{
+		assert(!!*found);
+		return *found;
+	}
 
-	return pool;
+	std::lock_guard lock(m_Mutex);
+	return m_StatesToRenderPasses.FindOrInsert(key, [&] { return CreateRenderPass(key); });
 }
 
-const RenderPass& StateManagerVulkan::FindOrCreateRenderPass(const RenderPassKey& key)
+const PipelineLayout& StateManagerVulkan::FindOrCreatePipelineLayout(const PipelineLayoutKey& key)
 {
 	LOG_FUNC();
+	if (auto found = m_StatesToLayouts.Find(key))
+		return *found;
+
 	std::lock_guard lock(m_Mutex);
+	return m_StatesToLayouts.FindOrInsert(key, [&] { return CreatePipelineLayout(key); });
+}
 
-	if (auto found = m_StatesToRenderPasses.find(key); found != m_StatesToRenderPasses.end())
+#include "interface/IMaterialInternal.h"
+
+VulkanStateID StateManagerVulkan::FindOrCreateState(
+	const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState)
+{
+	LOG_FUNC();
+	return FindOrCreatePipeline(PipelineKey(staticState, dynamicState),
+		mat_vulkan_async_pipelines.GetBool()).m_ID;
+}
+
+// Everything in the dynamic state that ends up in a PipelineKey
+static uint32_t GetPipelineDynamicStateBits(const LogicalDynamicState& dynamicState)
+{
+	// PipelineKey ignores all of it, see ApplyDepthStencilState()
+	if (g_ShaderDevice.HasExtendedDynamicState())
+		return 0;
+
+	return
+		(uint32_t(dynamicState.m_ForceDepthFuncEquals) << 0) |
+		(uint32_t(dynamicState.m_StencilEnable) << 1) |
+		((uint32_t(dynamicState.m_StencilFailOp) & 0xF) << 4) |
+		((uint32_t(dynamicState.m_StencilDepthFailOp) & 0xF) << 8) |
+		((uint32_t(dynamicState.m_StencilPassOp) & 0xF) << 12) |
+		((uint32_t(dynamicState.m_StencilCompareFunc) & 0xF) << 16);
+}
+
+VulkanStateID StateManagerVulkan::FindOrCreateState(LogicalShadowStateID shadowStateID,
+	const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState)
+{
+	LOG_FUNC();
+
+	// Direct mapped, per thread so hits don't need any synchronization
+	struct CacheEntry
 	{
-		assert(!!found->second);
-		return found->second;
+		LogicalShadowStateID m_ShadowStateID = LogicalShadowStateID::Invalid;
+		uint32_t m_DynamicStateBits = 0;
+		uint32_t m_RenderTargetGeneration = 0;
+		VulkanStateID m_StateID = VulkanStateID::Invalid;
+	};
+	static constexpr size_t CACHE_SIZE = 256;
+	static thread_local std::array<CacheEntry, CACHE_SIZE> s_Cache;
+
+	const uint32_t dynamicBits = GetPipelineDynamicStateBits(dynamicState);
+	const uint32_t rtGeneration = m_RenderTargetGeneration.load(std::memory_order_relaxed);
+
+	auto& entry = s_Cache[(size_t(shadowStateID) ^ (dynamicBits * 0x9E3779B9u)) % CACHE_SIZE];
+	if (entry.m_ShadowStateID == shadowStateID &&
+		entry.m_DynamicStateBits == dynamicBits &&
+		entry.m_RenderTargetGeneration == rtGeneration)
+	{
+		return entry.m_StateID;
 	}
 
-	return m_StatesToRenderPasses.emplace(key, CreateRenderPass(key)).first->second;
+	entry.m_StateID = FindOrCreateState(staticState, dynamicState);
+	entry.m_ShadowStateID = shadowStateID;
+	entry.m_DynamicStateBits = dynamicBits;
+	entry.m_RenderTargetGeneration = rtGeneration;
+
+	return entry.m_StateID;
 }
 
-const PipelineLayout& StateManagerVulkan::FindOrCreatePipelineLayout(const PipelineLayoutKey& key)
+void StateManagerVulkan::InvalidateRenderTargets()
 {
 	LOG_FUNC();
+	m_RenderTargetGeneration++;
+}
+
+Pipeline& StateManagerVulkan::FindOrCreatePipeline(const PipelineKey& key, bool async)
+{
+	if (auto found = m_StatesToPipelines.Find(key))
+		return *found;
+
 	std::lock_guard lock(m_Mutex);
 
-	auto& layout = m_StatesToLayouts[key];
-	if (!layout)
-		layout = CreatePipelineLayout(key);
+	bool created = false;
+	auto& pl = m_StatesToPipelines.FindOrInsert(key,
+		[&]
+		{
+			created = true;
+			return CreatePipeline(key, FindOrCreatePipelineLayout(key), FindOrCreateRenderPass(key));
+		},
+		[&](const PipelineKey& plKey, Pipeline& newPl)
+		{
+			// Everything readers look at has to be in place before it's published
+			newPl.m_Key = &plKey;
+			newPl.FixupPointers();
+
+			if (!async)
+				newPl.m_Pipeline = CompilePipeline(newPl);
+
+			Util::SafeConvert(m_IDsToPipelines.size(), newPl.m_ID);
+			m_IDsToPipelines.push_back(&newPl);
+		});
+
+	if (created && async)
+		QueuePipelineCompile(pl);
 
-	return layout;
+	return pl;
 }
 
-#include "interface/IMaterialInternal.h"
+void StateManagerVulkan::LoadPipelineManifest()
+{
+	LOG_FUNC();
 
-VulkanStateID StateManagerVulkan::FindOrCreateState(
-	const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState)
+	CUtlBuffer buf;
+	if (!g_pFullFileSystem || !g_pFullFileSystem->ReadFile(PIPELINE_MANIFEST_FILENAME, "MOD", buf))
+		return;
+
+	const auto data = reinterpret_cast<const std::byte*>(buf.Base());
+	const size_t size = Util::SafeConvert<size_t>(buf.TellPut());
+	size_t pos = 0;
+
+	PipelineManifestHeader header;
+	if (size < sizeof(header))
+	{
+		Warning(TF2VULKAN_PREFIX "Ignoring truncated pipeline manifest %s\n", PIPELINE_MANIFEST_FILENAME);
+		return;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	pos += sizeof(header);
+
+	if (header.m_Magic != PIPELINE_MANIFEST_MAGIC || header.m_Version != PIPELINE_MANIFEST_VERSION)
+	{
+		Msg(TF2VULKAN_PREFIX "Pipeline manifest %s is from a different version, ignoring\n",
+			PIPELINE_MANIFEST_FILENAME);
+		return;
+	}
+
+	std::vector<const char*> names;
+	for (uint32_t i = 0; i < header.m_NameCount; i++)
+	{
+		const auto name = reinterpret_cast<const char*>(data + pos);
+		const auto end = static_cast<const char*>(memchr(name, '\0', size - pos));
+		if (!end)
+		{
+			Warning(TF2VULKAN_PREFIX "Ignoring corrupt pipeline manifest %s\n", PIPELINE_MANIFEST_FILENAME);
+			return;
+		}
+
+		names.push_back(name);
+		pos += (end - name) + 1;
+	}
+
+	if ((size - pos) / sizeof(PipelineManifestEntry) < header.m_EntryCount)
+	{
+		Warning(TF2VULKAN_PREFIX "Ignoring truncated pipeline manifest %s\n", PIPELINE_MANIFEST_FILENAME);
+		return;
+	}
+
+	std::unique_lock lock(m_Mutex);
+
+	const auto pipelineCountBefore = m_StatesToPipelines.size();
+	for (uint32_t i = 0; i < header.m_EntryCount; i++)
+	{
+		PipelineManifestEntry entry;
+		memcpy(&entry, data + pos, sizeof(entry));
+		pos += sizeof(entry);
+
+		if (entry.m_VSName >= names.size() || entry.m_PSName >= names.size())
+			continue;
+
+		// Rebuild the states the key would have come from, so it gets normalized the same way
+		LogicalShadowState shadowState;
+		shadowState.m_VSName = names[entry.m_VSName];
+		shadowState.m_VSStaticIndex = entry.m_VSStaticIndex;
+		shadowState.m_VSVertexFormat = VertexFormat(entry.m_VSVertexFormat);
+		shadowState.m_PSName = names[entry.m_PSName];
+		shadowState.m_PSStaticIndex = entry.m_PSStaticIndex;
+		shadowState.m_DepthTest = !!(entry.m_Flags & PipelineManifestEntry::DepthTest);
+		shadowState.m_DepthWrite = !!(entry.m_Flags & PipelineManifestEntry::DepthWrite);
+		shadowState.m_RSBackFaceCulling = !!(entry.m_Flags & PipelineManifestEntry::BackFaceCulling);
+		shadowState.m_DepthCompareFunc = ShaderDepthFunc_t(entry.m_DepthCompareFunc);
+		shadowState.m_RSFrontFacePolyMode = shadowState.m_RSBackFacePolyMode = ShaderPolyMode_t(entry.m_RSPolyMode);
+		shadowState.m_OMSrcFactor = ShaderBlendFactor_t(entry.m_OMSrcFactor);
+		shadowState.m_OMDstFactor = ShaderBlendFactor_t(entry.m_OMDstFactor);
+		shadowState.m_OMDepthRT = entry.m_DepthFormat != VK_FORMAT_UNDEFINED ? 0 : -1;
+
+		try
+		{
+			// Render targets only matter through their formats, so substitute the recorded ones
+			PipelineKey key(shadowState, LogicalDynamicState{});
+			auto& rpKey = static_cast<RenderPassKey&>(key);
+			for (size_t rt = 0; rt < std::size(entry.m_ColorFormats); rt++)
+			{
+				rpKey.m_ColorAttachments[rt].m_Format = vk::Format(entry.m_ColorFormats[rt]);
+				rpKey.m_ColorAttachments[rt].m_Samples = vk::SampleCountFlagBits(entry.m_ColorSamples[rt]);
+			}
+
+			if (!!rpKey.m_DepthAttachment)
+			{
+				rpKey.m_DepthAttachment.m_Format = vk::Format(entry.m_DepthFormat);
+				rpKey.m_DepthAttachment.m_Samples = vk::SampleCountFlagBits(entry.m_DepthSamples);
+			}
+
+			if (!rpKey.m_ColorAttachments[0] && !rpKey.m_ColorAttachments[1] &&
+				!rpKey.m_ColorAttachments[2] && !rpKey.m_ColorAttachments[3])
+			{
+				continue;
+			}
+
+			key.UpdateHash();
+			FindOrCreatePipeline(key, true);
+		}
+		catch (const std::exception& e)
+		{
+			// Most likely a shader that no longer exists
+			Warning(TF2VULKAN_PREFIX "Skipping pipeline manifest entry %u: %s\n", i, e.what());
+		}
+	}
+
+	DispatchAllPipelineCompiles();
+	const auto pipelineCount = m_StatesToPipelines.size() - pipelineCountBefore;
+	lock.unlock();
+
+	WaitForPipelineCompiles();
+
+	Msg(TF2VULKAN_PREFIX "Pre-created %zu pipelines from %s\n", pipelineCount, PIPELINE_MANIFEST_FILENAME);
+}
+
+void StateManagerVulkan::SavePipelineManifest()
 {
 	LOG_FUNC();
+
+	if (!mat_vulkan_record_pipeline_manifest.GetBool() || !g_pFullFileSystem)
+		return;
+
 	std::lock_guard lock(m_Mutex);
 
-	const PipelineKey key(staticState, dynamicState);
-	auto& pl = m_StatesToPipelines[key];
-	if (!pl)
+	std::unordered_map<CUtlSymbolDbg, uint16_t> nameIndices;
+	std::vector<const char*> names;
+	const auto findOrAddName = [&](const CUtlSymbolDbg& name)
 	{
-		pl = CreatePipeline(key,
-			FindOrCreatePipelineLayout(key),
-			FindOrCreateRenderPass(key));
+		auto [it, inserted] = nameIndices.try_emplace(name, uint16_t(names.size()));
+		if (inserted)
+			names.push_back(name.String());
 
-		Util::SafeConvert(m_IDsToPipelines.size(), pl.m_ID);
-		m_IDsToPipelines.push_back(&pl);
+		return it->second;
+	};
+
+	std::vector<PipelineManifestEntry> entries;
+	m_StatesToPipelines.ForEach([&](const PipelineKey& key, const Pipeline& pipeline)
+	{
+		// Out of name indices, drop the rest
+		if (names.size() >= std::numeric_limits<uint16_t>::max() - 1)
+			return;
+
+		auto& entry = entries.emplace_back();
+		entry.m_VSName = findOrAddName(key.m_VSName);
+		entry.m_PSName = findOrAddName(key.m_PSName);
+		entry.m_VSStaticIndex = key.m_VSStaticIndex;
+		entry.m_PSStaticIndex = key.m_PSStaticIndex;
+		entry.m_VSVertexFormat = key.m_VSVertexFormat;
+		entry.m_DepthFormat = uint32_t(key.m_DepthAttachment.m_Format);
+		entry.m_DepthSamples = uint8_t(key.m_DepthAttachment.m_Samples);
+		for (size_t rt = 0; rt < std::size(entry.m_ColorFormats); rt++)
+		{
+			entry.m_ColorFormats[rt] = uint32_t(key.m_ColorAttachments[rt].m_Format);
+			entry.m_ColorSamples[rt] = uint8_t(key.m_ColorAttachments[rt].m_Samples);
+		}
+
+		entry.m_Flags =
+			(key.m_DepthTest ? PipelineManifestEntry::DepthTest : 0) |
+			(key.m_DepthWrite ? PipelineManifestEntry::DepthWrite : 0) |
+			(key.m_RSBackFaceCulling ? PipelineManifestEntry::BackFaceCulling : 0);
+
+		// Stored exactly as keyed. The depth attachment comes back from m_DepthFormat
+		// on replay, not from these flags.
+		entry.m_DepthCompareFunc = uint8_t(key.m_DepthCompareFunc);
+		entry.m_RSPolyMode = uint8_t(key.m_RSPolyMode);
+		entry.m_OMSrcFactor = uint8_t(key.m_OMSrcFactor);
+		entry.m_OMDstFactor = uint8_t(key.m_OMDstFactor);
+	});
+
+	PipelineManifestHeader header;
+	header.m_Magic = PIPELINE_MANIFEST_MAGIC;
+	header.m_Version = PIPELINE_MANIFEST_VERSION;
+	Util::SafeConvert(names.size(), header.m_NameCount);
+	Util::SafeConvert(entries.size(), header.m_EntryCount);
+
+	CUtlBuffer buf;
+	buf.Put(&header, sizeof(header));
+	for (const char* name : names)
+		buf.Put(name, Util::SafeConvert<int>(strlen(name) + 1));
+	buf.Put(entries.data(), Util::SafeConvert<int>(entries.size() * sizeof(entries[0])));
+
+	if (!g_pFullFileSystem->WriteFile(PIPELINE_MANIFEST_FILENAME, "MOD", buf))
+	{
+		Warning(TF2VULKAN_PREFIX "Failed to write pipeline manifest %s\n", PIPELINE_MANIFEST_FILENAME);
+		return;
 	}
 
-	return pl.m_ID;
+	Msg(TF2VULKAN_PREFIX "Wrote %zu pipelines to %s\n", entries.size(), PIPELINE_MANIFEST_FILENAME);
 }
 
 PipelineKey::PipelineKey(
@@ -1324,41 +2848,60 @@ PipelineKey::PipelineKey(
 
 	RenderPassKey(staticState, dynamicState),
 	PipelineLayoutKey(staticState, dynamicState),
+	ExtendedDynamicStateKey(staticState, dynamicState),
 
-	m_DepthCompareFunc(dynamicState.m_ForceDepthFuncEquals ? SHADER_DEPTHFUNC_EQUAL : staticState.m_DepthCompareFunc),
-	m_DepthTest(staticState.m_DepthTest),
-	m_DepthWrite(staticState.m_DepthWrite),
-
-	m_RSBackFaceCulling(staticState.m_RSBackFaceCulling),
 	m_RSPolyMode(staticState.m_RSFrontFacePolyMode),
 
 	m_OMSrcFactor(staticState.m_OMSrcFactor),
-	m_OMDstFactor(staticState.m_OMDstFactor),
-
-	m_Viewports(dynamicState.m_Viewports)
+	m_OMDstFactor(staticState.m_OMDstFactor)
 {
 	assert((staticState.m_RSFrontFacePolyMode == staticState.m_RSBackFacePolyMode)
 		|| staticState.m_RSBackFaceCulling);
 
-	if (m_Viewports.empty())
-	{
-		auto& vp = m_Viewports.emplace_back();
-		int bbWidth, bbHeight;
-		g_ShaderDevice.GetBackBufferDimensions(bbWidth, bbHeight);
-		vp.Init(0, 0, bbWidth, bbHeight);
-	}
+	// Recorded per draw instead, see ApplyDepthStencilState()
+	if (g_ShaderDevice.HasExtendedDynamicState())
+		static_cast<ExtendedDynamicStateKey&>(*this) = ExtendedDynamicStateKey();
+
+	UpdateHash();
+}
+
+ExtendedDynamicStateKey::ExtendedDynamicStateKey(
+	const LogicalShadowState& staticState, const LogicalDynamicState& dynamicState) :
+
+	m_DepthCompareFunc(dynamicState.m_ForceDepthFuncEquals ? SHADER_DEPTHFUNC_EQUAL : staticState.m_DepthCompareFunc),
+	m_DepthTest(staticState.m_DepthTest),
+	m_DepthWrite(staticState.m_DepthWrite),
 
-	if (staticState.m_OMDepthRT < 0 || (!m_DepthTest && !m_DepthWrite))
+	m_RSBackFaceCulling(staticState.m_RSBackFaceCulling),
+
+	m_StencilEnable(dynamicState.m_StencilEnable),
+	m_StencilFailOp(dynamicState.m_StencilFailOp),
+	m_StencilDepthFailOp(dynamicState.m_StencilDepthFailOp),
+	m_StencilPassOp(dynamicState.m_StencilPassOp),
+	m_StencilCompareFunc(dynamicState.m_StencilCompareFunc)
+{
+	// Nothing to test against
+	if (staticState.m_OMDepthRT < 0)
 	{
-		// Normalize all these so they don't affect the hash
-		m_OMDepthRT = -1;
-		m_DepthCompareFunc = SHADER_DEPTHFUNC_ALWAYS;
 		m_DepthTest = false;
 		m_DepthWrite = false;
+		m_StencilEnable = false;
+	}
+
+	// Normalize all these so they don't affect the hash
+	if (!m_DepthTest && !m_DepthWrite)
+		m_DepthCompareFunc = SHADER_DEPTHFUNC_ALWAYS;
+
+	if (!m_StencilEnable)
+	{
+		m_StencilFailOp = STENCILOPERATION_KEEP;
+		m_StencilDepthFailOp = STENCILOPERATION_KEEP;
+		m_StencilPassOp = STENCILOPERATION_KEEP;
+		m_StencilCompareFunc = STENCILCOMPARISONFUNCTION_ALWAYS;
 	}
 }
 
-constexpr PipelineLayoutKey::PipelineLayoutKey(const LogicalShadowState& staticState,
+PipelineLayoutKey::PipelineLayoutKey(const LogicalShadowState& staticState,
 	const LogicalDynamicState& dynamicState) :
 
 	m_VSName(staticState.m_VSName),
@@ -1368,15 +2911,44 @@ constexpr PipelineLayoutKey::PipelineLayoutKey(const LogicalShadowState& staticS
 	m_PSName(staticState.m_PSName),
 	m_PSStaticIndex(staticState.m_PSStaticIndex)
 {
+	UpdateHash();
+}
+
+static RenderPassKey::Attachment ToAttachment(const IShaderAPITexture* tex)
+{
+	RenderPassKey::Attachment retVal;
+	if (tex)
+	{
+		const auto& ci = tex->GetImageCreateInfo();
+		retVal.m_Format = ci.format;
+		retVal.m_Samples = ci.samples;
+	}
+
+	return retVal;
 }
 
-constexpr RenderPassKey::RenderPassKey(const LogicalShadowState& staticState,
+RenderPassKey::RenderPassKey(const LogicalShadowState& staticState,
 	const LogicalDynamicState& dynamicState) :
 
-	m_OMColorRTs{ staticState.m_OMColorRTs[0], staticState.m_OMColorRTs[1], staticState.m_OMColorRTs[2], staticState.m_OMColorRTs[3] },
-	m_OMDepthRT(staticState.m_OMDepthRT)
+	m_DepthAttachment(ToAttachment(TryFindTexture(staticState.m_OMDepthRT, true)))
+{
+	for (size_t i = 0; i < m_ColorAttachments.size(); i++)
+		m_ColorAttachments[i] = ToAttachment(TryFindTexture(staticState.m_OMColorRTs[i]));
+
+	assert(!!m_ColorAttachments[0] || !!m_ColorAttachments[1] || !!m_ColorAttachments[2] || !!m_ColorAttachments[3]);
+	UpdateHash();
+}
+
+FallbackPipelineKey::FallbackPipelineKey(const PipelineKey& key) :
+	RenderPassKey(key),
+	ExtendedDynamicStateKey(key),
+	m_VSName(key.m_VSName),
+	m_VSVertexFormat(key.m_VSVertexFormat),
+	m_PSName(key.m_PSName),
+	m_RSPolyMode(key.m_RSPolyMode),
+	m_OMSrcFactor(key.m_OMSrcFactor),
+	m_OMDstFactor(key.m_OMDstFactor)
 {
-	assert(m_OMColorRTs[0] >= 0 || m_OMColorRTs[1] >= 0 || m_OMColorRTs[2] >= 0 || m_OMColorRTs[3] >= 0);
 }
 
 FramebufferKey::RTRef::RTRef(IShaderAPITexture* tex) :
@@ -1385,20 +2957,22 @@ FramebufferKey::RTRef::RTRef(IShaderAPITexture* tex) :
 {
 }
 
-FramebufferKey::FramebufferKey(const RenderPass& rp) :
+// Attachments the render pass doesn't have (depth normalized away) are left out
+FramebufferKey::FramebufferKey(const LogicalShadowState& staticState, const RenderPassKey& rpKey) :
 	m_OMColorRTs
 	{
-		TryFindTexture(rp.m_Key.m_OMColorRTs[0]),
-		TryFindTexture(rp.m_Key.m_OMColorRTs[1]),
-		TryFindTexture(rp.m_Key.m_OMColorRTs[2]),
-		TryFindTexture(rp.m_Key.m_OMColorRTs[3]),
+		!!rpKey.m_ColorAttachments[0] ? TryFindTexture(staticState.m_OMColorRTs[0]) : nullptr,
+		!!rpKey.m_ColorAttachments[1] ? TryFindTexture(staticState.m_OMColorRTs[1]) : nullptr,
+		!!rpKey.m_ColorAttachments[2] ? TryFindTexture(staticState.m_OMColorRTs[2]) : nullptr,
+		!!rpKey.m_ColorAttachments[3] ? TryFindTexture(staticState.m_OMColorRTs[3]) : nullptr,
 	},
-	m_OMDepthRT(TryFindTexture(rp.m_Key.m_OMDepthRT, true)),
-	m_RenderPass(&rp)
+	m_OMDepthRT(!!rpKey.m_DepthAttachment ? TryFindTexture(staticState.m_OMDepthRT, true) : nullptr)
 {
 	assert(!!m_OMColorRTs[0] || !!m_OMColorRTs[1] || !!m_OMColorRTs[2] || !!m_OMColorRTs[3]);
 	//if (!m_OMColorRTs[0] && !m_OMColorRTs[1] && !m_OMColorRTs[2] && !m_OMColorRTs[3])
 	//	m_OMColorRTs[0] = TryFindTexture(0);
+
+	m_Hash = Util::hash_multi(m_OMDepthRT, m_OMColorRTs);
 }
 
 void ShaderStageCreateInfo::FixupPointers()
@@ -1416,13 +2990,21 @@ void Pipeline::FixupPointers()
 	for (auto& ci : m_ShaderStageCIs)
 		ci.FixupPointers();
 
+	// Stage create infos are copies, so they need their specialization info refreshed too
+	assert(m_ShaderStages.size() == m_ShaderStageCIs.size());
+	for (size_t i = 0; i < m_ShaderStages.size(); i++)
+		m_ShaderStages[i].pSpecializationInfo = &m_ShaderStageCIs[i].m_SpecializationInfo;
+
 	auto& ci = m_CreateInfo;
+	AttachVector(ci.pStages, ci.stageCount, m_ShaderStages);
 	ci.pVertexInputState = &m_VertexInputStateCI;
 	ci.pInputAssemblyState = &m_InputAssemblyStateCI;
 	ci.pViewportState = &m_ViewportStateCI;
 	ci.pRasterizationState = &m_RasterizationStateCI;
 	ci.pMultisampleState = &m_MultisampleStateCI;
 	ci.pColorBlendState = &m_ColorBlendStateCI;
+	ci.pDepthStencilState = &m_DepthStencilStateCI;
+	ci.pDynamicState = &m_DynamicStateCI;
 	ci.layout = m_Layout->m_Layout.get();
 	ci.renderPass = m_RenderPass->m_RenderPass.get();
 }
@@ -0,0 +1,267 @@
+#include "FormatConverter.h"
+#include "IShaderTextureManager.h"
+#include "TextureStreamer.h"
+
+#include <tier1/convar.h>
+
+#include <algorithm>
+
+#undef min
+#undef max
+
+using namespace TF2Vulkan;
+
+static TextureStreamer s_TextureStreamer;
+TextureStreamer& TF2Vulkan::g_TextureStreamer = s_TextureStreamer;
+
+static ConVar mat_vulkan_texture_stream_budget("mat_vulkan_texture_stream_budget", "8192", FCVAR_NONE,
+	"Maximum KiB of streamed texture mips uploaded per frame. At least one mip is always uploaded.",
+	true, 1, false, 0);
+
+CON_COMMAND(mat_vulkan_texture_stream_stats, "Prints texture streaming progress.")
+{
+	const auto stats = g_TextureStreamer.GetStats();
+	Msg(TF2VULKAN_PREFIX "Texture streaming: %zu textures pending. %llu mips (%llu KiB) streamed, %llu converted on workers, %llu textures cancelled.\n",
+		stats.m_PendingTextures, stats.m_StreamedMips, stats.m_StreamedBytes / 1024,
+		stats.m_Conversions, stats.m_CancelledTextures);
+}
+
+TextureStreamer::~TextureStreamer()
+{
+	// Shutdown() should already have joined these. Joining from here would mean
+	// waiting on threads during DLL unload, so just let them go.
+	for (auto& worker : m_Workers)
+		worker.detach();
+}
+
+void TextureStreamer::Queue(ShaderAPITextureHandle_t texture, uint32_t generation, ImageFormat targetFormat,
+	const TextureData* slices, size_t count)
+{
+	TextureJob job{ texture, generation };
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const auto level = uint32_t(slices[i].m_MipLevel);
+		auto found = std::find_if(job.m_Mips.begin(), job.m_Mips.end(),
+			[&](const auto& mip) { return mip->m_Level == level; });
+
+		if (found == job.m_Mips.end())
+		{
+			auto& mip = job.m_Mips.emplace_back(std::make_shared<MipJob>());
+			mip->m_Level = level;
+			mip->m_TargetFormat = targetFormat;
+			found = job.m_Mips.end() - 1;
+		}
+
+		(*found)->m_Slices.push_back(slices[i]);
+	}
+
+	std::sort(job.m_Mips.begin(), job.m_Mips.end(),
+		[](const auto& a, const auto& b) { return a->m_Level > b->m_Level; });
+
+	// The caller's data (usually the scratch VTF) is gone once we return
+	bool needsConversion = false;
+	for (auto& mip : job.m_Mips)
+	{
+		size_t totalSize = 0;
+		for (const auto& slice : mip->m_Slices)
+			totalSize += slice.m_DataLength;
+
+		mip->m_Data.resize(totalSize);
+
+		size_t offset = 0;
+		for (auto& slice : mip->m_Slices)
+		{
+			memcpy(mip->m_Data.data() + offset, slice.m_Data, slice.m_DataLength);
+			slice.m_Data = mip->m_Data.data() + offset;
+			offset += slice.m_DataLength;
+		}
+
+		if (mip->m_Slices.front().m_Format == targetFormat)
+			mip->m_Ready = true;
+		else
+			needsConversion = true;
+	}
+
+	if (needsConversion)
+	{
+		{
+			std::lock_guard lock(m_WorkMutex);
+			if (m_ShutdownWorkers)
+				return;
+
+			StartWorkers();
+
+			for (const auto& mip : job.m_Mips)
+			{
+				if (!mip->m_Ready)
+					m_WorkQueue.push_back(mip);
+			}
+		}
+
+		m_WorkCV.notify_all();
+	}
+
+	m_Textures.push_back(std::move(job));
+	m_PendingTextures = m_Textures.size();
+}
+
+void TextureStreamer::ConvertMip(MipJob& mip)
+{
+	const auto targetFormat = mip.m_TargetFormat;
+
+	size_t totalSize = 0;
+	for (const auto& slice : mip.m_Slices)
+	{
+		totalSize += ImageLoader::GetMemRequired(Util::SafeConvert<int>(slice.m_Width),
+			Util::SafeConvert<int>(slice.m_Height), Util::SafeConvert<int>(slice.m_Depth), targetFormat, false);
+	}
+
+	std::vector<std::byte> converted(totalSize);
+
+	size_t offset = 0;
+	for (auto& slice : mip.m_Slices)
+	{
+		const size_t dstSize = ImageLoader::GetMemRequired(Util::SafeConvert<int>(slice.m_Width),
+			Util::SafeConvert<int>(slice.m_Height), Util::SafeConvert<int>(slice.m_Depth), targetFormat, false);
+
+		FormatConverter::Convert(
+			reinterpret_cast<const std::byte*>(slice.m_Data), slice.m_Format, slice.m_DataLength,
+			converted.data() + offset, targetFormat, dstSize,
+			Util::SafeConvert<uint32_t>(slice.m_Width), Util::SafeConvert<uint32_t>(slice.m_Height), slice.m_Stride);
+
+		// Tightly packed now
+		slice.m_Format = targetFormat;
+		slice.m_Data = converted.data() + offset;
+		slice.m_DataLength = dstSize;
+		slice.m_Stride = 0;
+		slice.m_SliceStride = 0;
+		offset += dstSize;
+	}
+
+	mip.m_Data = std::move(converted);
+}
+
+void TextureStreamer::StartWorkers()
+{
+	// m_WorkMutex must be held
+	if (!m_Workers.empty())
+		return;
+
+	// Leave most of the cores to the pipeline compile workers and the game
+	const auto workerCount = std::clamp(std::thread::hardware_concurrency() / 4, 1u, 2u);
+	for (uint32_t i = 0; i < workerCount; i++)
+		m_Workers.emplace_back(&TextureStreamer::Worker, this);
+}
+
+void TextureStreamer::Worker()
+{
+	while (true)
+	{
+		std::shared_ptr<MipJob> mip;
+		{
+			std::unique_lock lock(m_WorkMutex);
+			m_WorkCV.wait(lock, [&] { return m_ShutdownWorkers || !m_WorkQueue.empty(); });
+			if (m_ShutdownWorkers)
+				return;
+
+			mip = std::move(m_WorkQueue.front());
+			m_WorkQueue.pop_front();
+		}
+
+		// Textures that were cancelled in the meantime are the only owners left
+		if (mip.use_count() > 1)
+		{
+			try
+			{
+				ConvertMip(*mip);
+				m_Conversions++;
+			}
+			catch (const std::exception& e)
+			{
+				// Uploading it unconverted is still better than never finishing the texture
+				Warning(TF2VULKAN_PREFIX "Failed to convert streamed mip %u: %s\n", mip->m_Level, e.what());
+			}
+		}
+
+		mip->m_Ready.store(true, std::memory_order_release);
+	}
+}
+
+void TextureStreamer::Update()
+{
+	LOG_FUNC();
+
+	const size_t budget = size_t(mat_vulkan_texture_stream_budget.GetInt()) * 1024;
+	size_t spent = 0;
+
+	for (auto it = m_Textures.begin(); it != m_Textures.end() && spent < budget; )
+	{
+		auto& job = *it;
+
+		while (job.m_NextMip < job.m_Mips.size())
+		{
+			auto& mip = *job.m_Mips[job.m_NextMip];
+			if (!mip.m_Ready.load(std::memory_order_acquire))
+				break;
+
+			const size_t size = mip.m_Data.size();
+			if (spent > 0 && spent + size > budget)
+			{
+				spent = budget;
+				break;
+			}
+
+			if (!g_TextureManager.UploadStreamedMip(job.m_Texture, job.m_Generation, mip.m_Level,
+				mip.m_Slices.data(), mip.m_Slices.size()))
+			{
+				m_CancelledTextures++;
+				job.m_NextMip = job.m_Mips.size();
+				break;
+			}
+
+			job.m_Mips[job.m_NextMip].reset();
+			job.m_NextMip++;
+			spent += size;
+			m_StreamedMips++;
+			m_StreamedBytes += size;
+		}
+
+		// Finer mips can't become resident before coarser ones, so a texture
+		// waiting on a conversion doesn't hold up the ones behind it
+		if (job.m_NextMip >= job.m_Mips.size())
+			it = m_Textures.erase(it);
+		else
+			++it;
+	}
+
+	m_PendingTextures = m_Textures.size();
+}
+
+void TextureStreamer::Shutdown()
+{
+	{
+		std::lock_guard lock(m_WorkMutex);
+		m_ShutdownWorkers = true;
+		m_WorkQueue.clear();
+	}
+	m_WorkCV.notify_all();
+
+	for (auto& worker : m_Workers)
+		worker.join();
+
+	m_Workers.clear();
+	m_Textures.clear();
+	m_PendingTextures = 0;
+}
+
+auto TextureStreamer::GetStats() const -> Stats
+{
+	Stats retVal;
+	retVal.m_PendingTextures = m_PendingTextures;
+	retVal.m_StreamedMips = m_StreamedMips;
+	retVal.m_StreamedBytes = m_StreamedBytes;
+	retVal.m_Conversions = m_Conversions;
+	retVal.m_CancelledTextures = m_CancelledTextures;
+	return retVal;
+}
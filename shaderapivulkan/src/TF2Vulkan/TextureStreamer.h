@@ -0,0 +1,89 @@
+#pragma once
+
+#include "TF2Vulkan/TextureData.h"
+
+#include <shaderapi/ishaderapi.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TF2Vulkan
+{
+	// Uploads the finer mips of VTF textures over the frames after they're loaded.
+	// TexImageFromVTF uploads the mip tail right away, so the texture is usable
+	// immediately, and hands everything above it to Queue(). Worker threads convert
+	// those mips to the texture's format, and every frame Update() uploads finished
+	// mips (coarsest first) until mat_vulkan_texture_stream_budget is used up. The
+	// texture manager moves each texture's views down to its finest resident mip.
+	class TextureStreamer final
+	{
+	public:
+		~TextureStreamer();
+
+		// Copies the data out of slices, it doesn't have to outlive this call.
+		// generation identifies this download of the texture, see
+		// IShaderTextureManager::UploadStreamedMip.
+		void Queue(ShaderAPITextureHandle_t texture, uint32_t generation, ImageFormat targetFormat,
+			const TextureData* slices, size_t count);
+
+		// Main thread only, once per frame
+		void Update();
+
+		void Shutdown();
+
+		struct Stats
+		{
+			size_t m_PendingTextures = 0;
+			uint64_t m_StreamedMips = 0;
+			uint64_t m_StreamedBytes = 0;
+			uint64_t m_Conversions = 0;
+			uint64_t m_CancelledTextures = 0; // Deleted or downloaded again before they finished
+		};
+		Stats GetStats() const;
+
+	private:
+		struct MipJob final
+		{
+			uint32_t m_Level;
+			ImageFormat m_TargetFormat;
+			std::vector<TextureData> m_Slices; // m_Data points into m_Data
+			std::vector<std::byte> m_Data;
+			std::atomic<bool> m_Ready = false;
+		};
+
+		struct TextureJob final
+		{
+			ShaderAPITextureHandle_t m_Texture;
+			uint32_t m_Generation;
+			std::vector<std::shared_ptr<MipJob>> m_Mips; // Coarsest first
+			size_t m_NextMip = 0;
+		};
+
+		static void ConvertMip(MipJob& mip);
+		void StartWorkers();
+		void Worker();
+
+		// Main thread only
+		std::deque<TextureJob> m_Textures;
+
+		// Mips waiting on a conversion
+		std::mutex m_WorkMutex;
+		std::condition_variable m_WorkCV;
+		std::deque<std::shared_ptr<MipJob>> m_WorkQueue;
+		std::vector<std::thread> m_Workers;
+		bool m_ShutdownWorkers = false;
+
+		std::atomic<uint64_t> m_StreamedMips = 0;
+		std::atomic<uint64_t> m_StreamedBytes = 0;
+		std::atomic<uint64_t> m_Conversions = 0;
+		std::atomic<uint64_t> m_CancelledTextures = 0;
+		std::atomic<size_t> m_PendingTextures = 0;
+	};
+
+	extern TextureStreamer& g_TextureStreamer;
+}
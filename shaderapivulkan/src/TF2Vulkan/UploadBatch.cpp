@@ -0,0 +1,301 @@
+#include "FormatInfo.h"
+#include "IShaderTextureManager.h"
+#include "UploadBatch.h"
+
+#include <tier1/convar.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#undef min
+#undef max
+
+using namespace TF2Vulkan;
+
+using Usage = ImageLayoutTracker::Usage;
+
+static UploadBatch s_UploadBatch;
+UploadBatch& TF2Vulkan::g_UploadBatch = s_UploadBatch;
+
+CON_COMMAND(mat_vulkan_upload_stats, "Prints how uploads have been batched.")
+{
+	const auto stats = g_UploadBatch.GetStats();
+	Msg(TF2VULKAN_PREFIX "Uploads: %llu batches, %llu image copies, %llu buffer copies (%llu on the transfer queue), %llu extra barriers. %llu render target copies recorded in place.\n",
+		stats.m_Batches, stats.m_ImageCopies, stats.m_BufferCopies, stats.m_TransferQueueCopies,
+		stats.m_ExtraBarriers, stats.m_ImmediateCopies);
+}
+
+static vk::ImageSubresourceRange GetRange(const IVulkanTexture& texture, const vk::BufferImageCopy& region)
+{
+	vk::ImageSubresourceRange range;
+	range.aspectMask = FormatInfo::GetAspects(texture.GetImageCreateInfo().format);
+	range.baseMipLevel = region.imageSubresource.mipLevel;
+	range.levelCount = 1;
+	range.baseArrayLayer = region.imageSubresource.baseArrayLayer;
+	range.layerCount = 1;
+	return range;
+}
+
+// Partial updates (TexSubImage2D) have to keep the rest of the mip
+static bool CoversMip(const IVulkanTexture& texture, const vk::BufferImageCopy& region)
+{
+	const auto& ci = texture.GetImageCreateInfo();
+	const auto mip = region.imageSubresource.mipLevel;
+	const auto mipWidth = std::max(ci.extent.width >> mip, 1u);
+	const auto mipHeight = std::max(ci.extent.height >> mip, 1u);
+
+	return region.imageOffset == vk::Offset3D{} &&
+		region.imageExtent.width >= mipWidth && region.imageExtent.height >= mipHeight;
+}
+
+bool UploadBatch::CanBatch(const IShaderAPITexture& texture)
+{
+	// Anything else only ever changes layout through uploads, so its layout
+	// tracker still describes where the start of the frame left it.
+	constexpr vk::ImageUsageFlags ATTACHMENT_USAGE =
+		vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eDepthStencilAttachment;
+
+	return !(texture.GetImageCreateInfo().usage & ATTACHMENT_USAGE);
+}
+
+void UploadBatch::RecordImmediate(IShaderAPITexture& texture, const vk::Buffer& src,
+	const std::vector<vk::BufferImageCopy>& regions)
+{
+	auto& cmdBuffer = g_ShaderDevice.GetPrimaryCmdBuf();
+
+	auto pixScope = cmdBuffer.DebugRegionBegin(PIX_COLOR_READWRITE, "UploadBatch::RecordImmediate(%.*s)",
+		PRINTF_SV(texture.GetDebugName()));
+
+	cmdBuffer.TryEndRenderPass();
+
+	for (const auto& region : regions)
+		texture.Transition(cmdBuffer, GetRange(texture, region), Usage::TransferDst(), CoversMip(texture, region));
+
+	cmdBuffer.copyBufferToImage(src, texture.GetImage(), vk::ImageLayout::eTransferDstOptimal, regions);
+
+	for (const auto& region : regions)
+		texture.Transition(cmdBuffer, GetRange(texture, region), Usage::ShaderRead());
+}
+
+void UploadBatch::CopyBufferToImage(IShaderAPITexture& texture, const vk::Buffer& src,
+	std::vector<vk::BufferImageCopy>&& regions)
+{
+	if (!CanBatch(texture))
+	{
+		RecordImmediate(texture, src, regions);
+
+		std::lock_guard lock(m_Mutex);
+		m_Stats.m_ImmediateCopies++;
+		return;
+	}
+
+	std::lock_guard lock(m_Mutex);
+	m_ImageCopies.push_back({ texture.GetHandle(), src, std::move(regions) });
+}
+
+void UploadBatch::CopyBuffer(const vk::Buffer& src, const vk::Buffer& dst, const vk::BufferCopy& region,
+	const vk::PipelineStageFlags& dstStages, const vk::AccessFlags& dstAccess)
+{
+	std::lock_guard lock(m_Mutex);
+	m_BufferCopies.push_back({ src, dst, region });
+	m_BufferDstStages |= dstStages;
+	m_BufferDstAccess |= dstAccess;
+}
+
+bool UploadBatch::IsEmpty() const
+{
+	std::lock_guard lock(m_Mutex);
+	return m_ImageCopies.empty() && m_BufferCopies.empty();
+}
+
+bool UploadBatch::CanUseTransferQueue(IShaderAPITexture& texture, const std::vector<vk::BufferImageCopy>& regions)
+{
+	// Nothing needs to be handed over to the transfer queue if nobody has used
+	// the subresources yet. Whole mips also always satisfy the transfer queue's
+	// image granularity.
+	const auto& tracker = texture.GetLayoutTracker();
+	return std::all_of(regions.begin(), regions.end(), [&](const vk::BufferImageCopy& region)
+		{
+			const auto& sub = region.imageSubresource;
+			return CoversMip(texture, region) &&
+				tracker.GetUsage(sub.mipLevel, sub.baseArrayLayer).m_Layout == vk::ImageLayout::eUndefined;
+		});
+}
+
+bool UploadBatch::Record(IVulkanCommandBuffer& buf, IVulkanCommandBuffer* transferBuf)
+{
+	std::lock_guard lock(m_Mutex);
+	if (m_ImageCopies.empty() && m_BufferCopies.empty())
+		return false;
+
+	auto pixScope = buf.DebugRegionBegin(PIX_COLOR_READWRITE, "UploadBatch::Record()");
+
+	const size_t copyCount = m_ImageCopies.size();
+
+	// Textures deleted since their upload are skipped
+	std::vector<IShaderAPITexture*> textures(copyCount);
+	for (size_t i = 0; i < copyCount; i++)
+		textures[i] = g_TextureManager.TryGetTexture(m_ImageCopies[i].m_Texture);
+
+	// Every copy into a texture goes to the same queue, decided before any of
+	// them change its layout
+	std::vector<IVulkanCommandBuffer*> targets(copyCount);
+	{
+		std::unordered_map<IShaderAPITexture*, bool> useTransferQueue;
+		for (size_t i = 0; i < copyCount; i++)
+		{
+			if (textures[i] && transferBuf)
+			{
+				auto [it, inserted] = useTransferQueue.try_emplace(textures[i], true);
+				it->second = it->second && CanUseTransferQueue(*textures[i], m_ImageCopies[i].m_Regions);
+			}
+		}
+
+		for (size_t i = 0; i < copyCount; i++)
+		{
+			if (textures[i])
+				targets[i] = (transferBuf && useTransferQueue.at(textures[i])) ? transferBuf : &buf;
+		}
+	}
+
+	// Copies are held back so all of their transitions share a barrier. Only
+	// writing a subresource that an earlier copy in this batch has already
+	// written needs another one in between.
+	const auto recordImageCopies = [&](IVulkanCommandBuffer& target)
+	{
+		size_t recorded = 0;
+		const auto recordCopies = [&](size_t end)
+		{
+			for (; recorded < end; recorded++)
+			{
+				if (targets[recorded] != &target)
+					continue;
+
+				const auto& copy = m_ImageCopies[recorded];
+				target.copyBufferToImage(copy.m_Src, textures[recorded]->GetImage(),
+					vk::ImageLayout::eTransferDstOptimal, copy.m_Regions);
+			}
+		};
+
+		for (size_t i = 0; i < copyCount; i++)
+		{
+			if (targets[i] != &target)
+				continue;
+
+			auto texture = textures[i];
+			const auto& regions = m_ImageCopies[i].m_Regions;
+			const auto& tracker = texture->GetLayoutTracker();
+			const bool rewrite = std::any_of(regions.begin(), regions.end(), [&](const vk::BufferImageCopy& region)
+				{
+					const auto& sub = region.imageSubresource;
+					return tracker.GetUsage(sub.mipLevel, sub.baseArrayLayer) == Usage::TransferDst();
+				});
+
+			if (rewrite)
+			{
+				recordCopies(i);
+				m_Stats.m_ExtraBarriers++;
+			}
+
+			for (const auto& region : regions)
+				texture->Transition(target, GetRange(*texture, region), Usage::TransferDst(), CoversMip(*texture, region));
+		}
+
+		recordCopies(copyCount);
+	};
+
+	// Staging memory is only ever written by the host, so it can be read from
+	// either queue without an ownership transfer. Every destination buffer is
+	// brand new, so there's nothing to wait for before copying into it.
+	auto& bufferTarget = transferBuf ? *transferBuf : buf;
+	for (const auto& copy : m_BufferCopies)
+		bufferTarget.copyBuffer(copy.m_Src, copy.m_Dst, copy.m_Region);
+
+	recordImageCopies(buf);
+
+	// Everything written above becomes visible to the frame in a single barrier
+	for (size_t i = 0; i < copyCount; i++)
+	{
+		if (targets[i] != &buf)
+			continue;
+
+		auto texture = textures[i];
+		for (const auto& region : m_ImageCopies[i].m_Regions)
+			texture->Transition(buf, GetRange(*texture, region), Usage::ShaderRead());
+	}
+
+	bool usedTransferQueue = false;
+	if (transferBuf)
+	{
+		auto transferScope = transferBuf->DebugRegionBegin(PIX_COLOR_READWRITE, "UploadBatch::Record()");
+
+		recordImageCopies(*transferBuf);
+
+		// The release halves go out together after the copies, and the acquire
+		// halves join the barrier above
+		for (size_t i = 0; i < copyCount; i++)
+		{
+			if (targets[i] != transferBuf)
+				continue;
+
+			auto texture = textures[i];
+			for (const auto& region : m_ImageCopies[i].m_Regions)
+			{
+				texture->GetLayoutTracker().TransferOwnership(*transferBuf, buf, texture->GetImage(),
+					GetRange(*texture, region), Usage::ShaderRead(), TRANSFER_WAIT_STAGES);
+			}
+
+			usedTransferQueue = true;
+			m_Stats.m_TransferQueueCopies++;
+		}
+
+		for (const auto& copy : m_BufferCopies)
+		{
+			vk::BufferMemoryBarrier barrier;
+			barrier.srcQueueFamilyIndex = transferBuf->GetQueue().GetQueueFamily();
+			barrier.dstQueueFamilyIndex = buf.GetQueue().GetQueueFamily();
+			barrier.buffer = copy.m_Dst;
+			barrier.size = VK_WHOLE_SIZE;
+
+			auto release = barrier;
+			release.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+			transferBuf->QueueBufferBarrier(vk::PipelineStageFlagBits::eTransfer,
+				vk::PipelineStageFlagBits::eBottomOfPipe, release);
+
+			auto acquire = barrier;
+			acquire.dstAccessMask = m_BufferDstAccess;
+			buf.QueueBufferBarrier(TRANSFER_WAIT_STAGES, m_BufferDstStages, acquire);
+
+			usedTransferQueue = true;
+			m_Stats.m_TransferQueueCopies++;
+		}
+
+		transferBuf->FlushBarriers();
+	}
+	else if (!m_BufferCopies.empty())
+	{
+		vk::MemoryBarrier barrier;
+		barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+		barrier.dstAccessMask = m_BufferDstAccess;
+		buf.QueueMemoryBarrier(vk::PipelineStageFlagBits::eTransfer, m_BufferDstStages, barrier);
+	}
+
+	buf.FlushBarriers();
+
+	m_Stats.m_Batches++;
+	m_Stats.m_ImageCopies += copyCount;
+	m_Stats.m_BufferCopies += m_BufferCopies.size();
+
+	m_ImageCopies.clear();
+	m_BufferCopies.clear();
+	m_BufferDstStages = {};
+	m_BufferDstAccess = {};
+
+	return usedTransferQueue;
+}
+
+auto UploadBatch::GetStats() const -> Stats
+{
+	std::lock_guard lock(m_Mutex);
+	return m_Stats;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "interface/internal/IShaderAPITexture.h"
+
+#include <mutex>
+#include <vector>
+
+namespace TF2Vulkan
+{
+	class IVulkanCommandBuffer;
+
+	// Collects the uploads issued during a frame and records them into their own
+	// command buffer, submitted ahead of the frame's graphics work. Uploads then
+	// never end a render pass, every transition into a transfer layout goes out in
+	// one barrier before the copies, and one barrier after them makes everything
+	// they wrote visible to the rest of the frame.
+	//
+	// Because the copies land before anything else the frame does, only images
+	// the frame itself can't write to are batched. Render targets are still
+	// copied in place on the primary command buffer.
+	//
+	// On devices with a separate transfer queue, copies into resources that have
+	// never been used before are recorded there instead and handed over to the
+	// graphics queue, which only has to wait for them at the stages that read
+	// them. Partial and repeated uploads stay on the graphics queue, since their
+	// old contents would need to be handed over to the transfer queue first.
+	class UploadBatch final
+	{
+	public:
+		// Regions must already point into src
+		void CopyBufferToImage(IShaderAPITexture& texture, const vk::Buffer& src,
+			std::vector<vk::BufferImageCopy>&& regions);
+
+		// dst must not have been used yet this frame
+		void CopyBuffer(const vk::Buffer& src, const vk::Buffer& dst, const vk::BufferCopy& region,
+			const vk::PipelineStageFlags& dstStages, const vk::AccessFlags& dstAccess);
+
+		bool IsEmpty() const;
+
+		// Records (and forgets) everything collected since the last call. If
+		// transferBuf is given and this returns true, something was recorded on it
+		// and buf's submission has to wait on it at TRANSFER_WAIT_STAGES.
+		bool Record(IVulkanCommandBuffer& buf, IVulkanCommandBuffer* transferBuf = nullptr);
+
+		static constexpr vk::PipelineStageFlags TRANSFER_WAIT_STAGES =
+			vk::PipelineStageFlagBits::eVertexInput |
+			vk::PipelineStageFlagBits::eVertexShader |
+			vk::PipelineStageFlagBits::eFragmentShader;
+
+		struct Stats
+		{
+			uint64_t m_Batches = 0;
+			uint64_t m_ImageCopies = 0;
+			uint64_t m_BufferCopies = 0;
+			uint64_t m_TransferQueueCopies = 0; // Image and buffer copies done on the transfer queue
+			uint64_t m_ExtraBarriers = 0;     // Same subresource written twice in one batch
+			uint64_t m_ImmediateCopies = 0;   // Render targets, recorded on the primary command buffer
+		};
+		Stats GetStats() const;
+
+	private:
+		static bool CanBatch(const IShaderAPITexture& texture);
+		static bool CanUseTransferQueue(IShaderAPITexture& texture, const std::vector<vk::BufferImageCopy>& regions);
+		static void RecordImmediate(IShaderAPITexture& texture, const vk::Buffer& src,
+			const std::vector<vk::BufferImageCopy>& regions);
+
+		struct ImageCopy
+		{
+			ShaderAPITextureHandle_t m_Texture; // Looked up again on Record(), it might be gone by then
+			vk::Buffer m_Src;
+			std::vector<vk::BufferImageCopy> m_Regions;
+		};
+		std::vector<ImageCopy> m_ImageCopies;
+
+		struct BufferCopy
+		{
+			vk::Buffer m_Src;
+			vk::Buffer m_Dst;
+			vk::BufferCopy m_Region;
+		};
+		std::vector<BufferCopy> m_BufferCopies;
+		vk::PipelineStageFlags m_BufferDstStages;
+		vk::AccessFlags m_BufferDstAccess;
+
+		Stats m_Stats;
+		mutable std::mutex m_Mutex;
+	};
+
+	extern UploadBatch& g_UploadBatch;
+}
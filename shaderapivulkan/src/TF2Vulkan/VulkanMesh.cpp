@@ -1,7 +1,9 @@
 #include "IStateManagerDynamic.h"
+#include "DeferredDestructionQueue.h"
 #include "interface/IMaterialInternal.h"
 #include "interface/internal/IShaderDeviceInternal.h"
 #include "interface/internal/IStateManagerStatic.h"
+#include "UploadBatch.h"
 #include "VulkanFactories.h"
 #include "VulkanMesh.h"
 #include <TF2Vulkan/Util/FourCC.h>
@@ -17,8 +19,54 @@ static void AssertCheckHeap()
 #endif
 }
 
-VulkanMesh::VulkanMesh(const VertexFormat& fmt) :
-	m_VertexBuffer(fmt)
+// Hands a GPU buffer off to the deferred destruction queue, so it stays alive
+// until any draws already recorded against it have completed.
+static void RetireGPUBuffer(vma::AllocatedBuffer& buffer)
+{
+	if (buffer.GetBuffer())
+		g_DeferredDestruction.Add(std::move(buffer));
+}
+
+// Uploads static mesh data into a new device-local buffer via a staging buffer,
+// copied by the upload batch ahead of this frame's draws. A new buffer is created
+// each time so draws already recorded against the previous one are unaffected.
+static void UploadStaticBuffer(vma::AllocatedBuffer& gpuBuffer, const vk::BufferUsageFlags& usage,
+	const void* data, size_t dataSize, const void* tailData, size_t tailDataSize, const char* dbgName)
+{
+	const size_t totalSize = dataSize + tailDataSize;
+
+	auto stagingBuf = Factories::BufferFactory{}
+		.SetUsage(vk::BufferUsageFlagBits::eTransferSrc)
+		.SetSize(totalSize)
+		.SetInitialData(data, dataSize)
+		.SetDebugName(std::string(dbgName) + " (staging)")
+		.Create();
+
+	if (tailData && tailDataSize > 0)
+		stagingBuf.GetAllocation().Write(tailData, tailDataSize, dataSize);
+
+	auto gpuBuf = Factories::BufferFactory{}
+		.SetUsage(usage | vk::BufferUsageFlagBits::eTransferDst)
+		.SetSize(totalSize)
+		.SetMemoryRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+		.SetDebugName(dbgName)
+		.Create();
+
+	vk::BufferCopy copyRegion;
+	copyRegion.size = totalSize;
+	g_UploadBatch.CopyBuffer(stagingBuf.GetBuffer(), gpuBuf.GetBuffer(), copyRegion,
+		vk::PipelineStageFlagBits::eVertexInput,
+		vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+
+	g_DeferredDestruction.Add(std::move(stagingBuf));
+
+	RetireGPUBuffer(gpuBuffer);
+	gpuBuffer = std::move(gpuBuf);
+}
+
+VulkanMesh::VulkanMesh(const VertexFormat& fmt, bool isDynamic) :
+	m_VertexBuffer(fmt, isDynamic),
+	m_IndexBuffer(isDynamic)
 {
 }
 
@@ -67,43 +115,32 @@ void VulkanMesh::DrawInternal(IVulkanCommandBuffer& cmdBuf, int firstIndex, int
 
 	auto pixScope = cmdBuf.DebugRegionBegin(Color(128, 255, 128), "VulkanMesh::DrawInternal()");
 
-	auto indexBuf = Factories::BufferFactory{}
-		.SetUsage(vk::BufferUsageFlagBits::eIndexBuffer)
-		.SetInitialData(m_IndexBuffer.IndexData(), m_IndexBuffer.IndexDataSize())
-		.SetDebugName(__FUNCTION__ "(): Test index buffer")
-		.Create();
-
-	auto vertexBuf = Factories::BufferFactory{}
-		.SetUsage(vk::BufferUsageFlagBits::eVertexBuffer)
-		.SetInitialData(m_VertexBuffer.VertexData(), m_VertexBuffer.VertexDataSize())
-		.SetDebugName(__FUNCTION__ "(): Test vertex buffer")
-		.Create();
-
-	auto dummyVertexBuf = Factories::BufferFactory{}
-		.SetUsage(vk::BufferUsageFlagBits::eVertexBuffer)
-		.SetSize(sizeof(s_FallbackMeshData))
-		.SetDebugName(__FUNCTION__ "(): Dummy vertex buffer (unused attributes)")
-		.Create();
+	const auto idxBinding = m_IndexBuffer.GetGPUBinding();
+	const auto vtxBinding = m_VertexBuffer.GetGPUBinding();
+	if (!idxBinding.m_Buffer || !vtxBinding.m_Buffer)
+	{
+		Warning(TF2VULKAN_PREFIX "Skipping draw of mesh with no uploaded vertex/index data\n");
+		return;
+	}
 
-	cmdBuf.bindIndexBuffer(indexBuf.GetBuffer(), 0, vk::IndexType::eUint16);
-	cmdBuf.AddResource(std::move(indexBuf));
+	cmdBuf.bindIndexBuffer(idxBinding.m_Buffer, idxBinding.m_Offset, vk::IndexType::eUint16);
 
 	// Bind vertex buffers
 	{
+		const auto fallbackBinding = m_VertexBuffer.GetGPUFallbackBinding();
+
 		const vk::Buffer vtxBufs[] =
 		{
-			vertexBuf.GetBuffer(),
-			dummyVertexBuf.GetBuffer(),
+			vtxBinding.m_Buffer,
+			fallbackBinding.m_Buffer,
 		};
 		const vk::DeviceSize offsets[] =
 		{
-			0,
-			0,
+			vtxBinding.m_Offset,
+			fallbackBinding.m_Offset,
 		};
 		static_assert(std::size(vtxBufs) == std::size(offsets));
 		cmdBuf.bindVertexBuffers(0, TF2Vulkan::to_array_proxy(vtxBufs), TF2Vulkan::to_array_proxy(offsets));
-		cmdBuf.AddResource(std::move(vertexBuf));
-		cmdBuf.AddResource(std::move(dummyVertexBuf));
 	}
 
 	assert(firstIndex == 0); // TODO: What happens when we actually have offsets?
@@ -287,7 +324,6 @@ void VulkanMesh::ValidateData(int vertexCount, const VertexDesc_t& desc)
 bool VulkanMesh::IsDynamic() const
 {
 	LOG_FUNC();
-	assert(!"Ambiguous");
 
 	const bool vtxDyn = m_VertexBuffer.IsDynamic();
 	const bool idxDyn = m_IndexBuffer.IsDynamic();
@@ -312,10 +348,20 @@ int VulkanMesh::GetRoomRemaining() const
 	return min(vtxRoom, idxRoom);
 }
 
+VulkanIndexBuffer::VulkanIndexBuffer(bool isDynamic) :
+	m_IsDynamic(isDynamic)
+{
+}
+
+VulkanIndexBuffer::~VulkanIndexBuffer()
+{
+	RetireGPUBuffer(m_GPUBuffer);
+}
+
 int VulkanIndexBuffer::IndexCount() const
 {
 	LOG_FUNC();
-	return m_Indices.size();
+	return Util::SafeConvert<int>(m_IndexCount);
 }
 
 MaterialIndexFormat_t VulkanIndexBuffer::IndexFormat() const
@@ -326,8 +372,8 @@ MaterialIndexFormat_t VulkanIndexBuffer::IndexFormat() const
 
 bool VulkanIndexBuffer::IsDynamic() const
 {
-	NOT_IMPLEMENTED_FUNC();
-	return false;
+	LOG_FUNC();
+	return m_IsDynamic;
 }
 
 void VulkanIndexBuffer::BeginCastBuffer(MaterialIndexFormat_t format)
@@ -360,8 +406,19 @@ bool VulkanIndexBuffer::Lock(int maxIndexCount, bool append, IndexDesc_t& desc)
 	desc.m_nOffset = 0;
 	desc.m_nIndexSize = sizeof(m_Indices[0]) >> 1; // Why?
 
-	m_Indices.resize(maxIndexCount);
-	desc.m_pIndices = m_Indices.data();
+	Util::SafeConvert(maxIndexCount, m_IndexCount);
+
+	if (m_IsDynamic)
+	{
+		// Write straight into this frame's region of the ring buffer
+		m_DynamicAlloc = g_DynamicIndexRing.Allocate(m_IndexCount * sizeof(m_Indices[0]), 4);
+		desc.m_pIndices = reinterpret_cast<unsigned short*>(m_DynamicAlloc.m_Data);
+	}
+	else
+	{
+		m_Indices.resize(m_IndexCount);
+		desc.m_pIndices = m_Indices.data();
+	}
 
 	return true;
 }
@@ -370,8 +427,26 @@ void VulkanIndexBuffer::Unlock(int writtenIndexCount, IndexDesc_t& desc)
 {
 	LOG_FUNC();
 	AssertCheckHeap();
-	assert(Util::SafeConvert<size_t>(writtenIndexCount) <= (m_Indices.size() * sizeof(m_Indices[0])));
-	// TODO: Send data to GPU
+	assert(Util::SafeConvert<size_t>(writtenIndexCount) <= m_IndexCount);
+
+	if (m_IsDynamic)
+	{
+		Util::SafeConvert(writtenIndexCount, m_IndexCount);
+		g_DynamicIndexRing.Shrink(m_DynamicAlloc, m_IndexCount * sizeof(m_Indices[0]));
+	}
+	else
+	{
+		UploadToGPU();
+	}
+}
+
+void VulkanIndexBuffer::UploadToGPU()
+{
+	if (m_Indices.empty())
+		return;
+
+	UploadStaticBuffer(m_GPUBuffer, vk::BufferUsageFlagBits::eIndexBuffer,
+		IndexData(), IndexDataSize(), nullptr, 0, "VulkanIndexBuffer (static)");
 }
 
 void VulkanIndexBuffer::ModifyBegin(bool readOnly, int firstIndex, int indexCount, IndexDesc_t& desc)
@@ -394,6 +469,14 @@ void VulkanIndexBuffer::ValidateData(int indexCount, const IndexDesc_t& desc)
 	NOT_IMPLEMENTED_FUNC();
 }
 
+GPUBufferBinding VulkanIndexBuffer::GetGPUBinding() const
+{
+	if (m_IsDynamic)
+		return { m_DynamicAlloc.m_Buffer, m_DynamicAlloc.m_Offset };
+	else
+		return { m_GPUBuffer.GetBuffer() };
+}
+
 const unsigned short* VulkanIndexBuffer::IndexData() const
 {
 	return m_Indices.data();
@@ -404,9 +487,15 @@ size_t VulkanIndexBuffer::IndexDataSize() const
 	return m_Indices.size() * sizeof(m_Indices[0]);
 }
 
-VulkanVertexBuffer::VulkanVertexBuffer(const VertexFormat& format) :
-	m_Format(format)
+VulkanVertexBuffer::VulkanVertexBuffer(const VertexFormat& format, bool isDynamic) :
+	m_Format(format),
+	m_IsDynamic(isDynamic)
+{
+}
+
+VulkanVertexBuffer::~VulkanVertexBuffer()
 {
+	RetireGPUBuffer(m_GPUBuffer);
 }
 
 int VulkanVertexBuffer::VertexCount() const
@@ -423,8 +512,8 @@ VertexFormat_t VulkanVertexBuffer::GetVertexFormat() const
 
 bool VulkanVertexBuffer::IsDynamic() const
 {
-	NOT_IMPLEMENTED_FUNC();
-	return false;
+	LOG_FUNC();
+	return m_IsDynamic;
 }
 
 void VulkanVertexBuffer::BeginCastBuffer(VertexFormat_t format)
@@ -476,7 +565,20 @@ bool VulkanVertexBuffer::Lock(int vertexCount, bool append, VertexDesc_t& desc)
 	const auto vtxElemsCount = uncompressedFormat.GetVertexElements(vtxElems, std::size(vtxElems), &totalVtxSize);
 
 	Util::SafeConvert(vertexCount, m_VertexCount);
-	m_DataBuffer.resize(totalVtxSize * m_VertexCount);;
+	m_VertexSize = totalVtxSize;
+
+	std::byte* vtxData;
+	if (m_IsDynamic)
+	{
+		// Write straight into this frame's region of the ring buffer
+		m_DynamicAlloc = g_DynamicVertexRing.Allocate(totalVtxSize * m_VertexCount);
+		vtxData = m_DynamicAlloc.m_Data;
+	}
+	else
+	{
+		m_DataBuffer.resize(totalVtxSize * m_VertexCount);
+		vtxData = m_DataBuffer.data();
+	}
 
 	Util::SafeConvert(totalVtxSize, desc.m_ActualVertexSize);
 	desc.m_CompressionType = uncompressedFormat.GetCompressionType();
@@ -526,7 +628,7 @@ bool VulkanVertexBuffer::Lock(int vertexCount, bool append, VertexDesc_t& desc)
 		{
 			const auto texCoordIdx = (vtxElem.m_Type->m_Element - VERTEX_ELEMENT_TEXCOORD1D_0) % VERTEX_MAX_TEXTURE_COORDINATES;
 			desc.m_VertexSize_TexCoord[texCoordIdx] = totalVtxSize;
-			desc.m_pTexCoord[texCoordIdx] = reinterpret_cast<float*>(m_DataBuffer.data() + vtxElem.m_Offset);
+			desc.m_pTexCoord[texCoordIdx] = reinterpret_cast<float*>(vtxData + vtxElem.m_Offset);
 
 			break;
 		}
@@ -536,20 +638,20 @@ bool VulkanVertexBuffer::Lock(int vertexCount, bool append, VertexDesc_t& desc)
 		case VERTEX_ELEMENT_USERDATA3:
 		case VERTEX_ELEMENT_USERDATA4:
 			Util::SafeConvert(totalVtxSize, desc.m_VertexSize_UserData);
-			desc.m_pUserData = reinterpret_cast<float*>(m_DataBuffer.data() + vtxElem.m_Offset);
+			desc.m_pUserData = reinterpret_cast<float*>(vtxData + vtxElem.m_Offset);
 			break;
 
 		case VERTEX_ELEMENT_COLOR:
 			Util::SafeConvert(totalVtxSize, desc.m_VertexSize_Color);
-			desc.m_pColor = reinterpret_cast<unsigned char*>(m_DataBuffer.data() + vtxElem.m_Offset);
+			desc.m_pColor = reinterpret_cast<unsigned char*>(vtxData + vtxElem.m_Offset);
 			break;
 		case VERTEX_ELEMENT_POSITION:
 			Util::SafeConvert(totalVtxSize, desc.m_VertexSize_Position);
-			desc.m_pPosition = reinterpret_cast<float*>(m_DataBuffer.data() + vtxElem.m_Offset);
+			desc.m_pPosition = reinterpret_cast<float*>(vtxData + vtxElem.m_Offset);
 			break;
 		case VERTEX_ELEMENT_NORMAL:
 			Util::SafeConvert(totalVtxSize, desc.m_VertexSize_Normal);
-			desc.m_pNormal = reinterpret_cast<float*>(m_DataBuffer.data() + vtxElem.m_Offset);
+			desc.m_pNormal = reinterpret_cast<float*>(vtxData + vtxElem.m_Offset);
 			break;
 		}
 	}
@@ -559,10 +661,39 @@ bool VulkanVertexBuffer::Lock(int vertexCount, bool append, VertexDesc_t& desc)
 
 void VulkanVertexBuffer::Unlock(int vertexCount, VertexDesc_t& desc)
 {
-	NOT_IMPLEMENTED_FUNC_NOBREAK();
+	LOG_FUNC();
 	AssertCheckHeap();
 	ValidateData(vertexCount, desc);
-	// TODO: Send data to GPU
+
+	if (m_IsDynamic)
+	{
+		assert(Util::SafeConvert<size_t>(vertexCount) <= m_VertexCount);
+		Util::SafeConvert(vertexCount, m_VertexCount);
+		g_DynamicVertexRing.Shrink(m_DynamicAlloc, m_VertexCount * m_VertexSize);
+	}
+	else
+	{
+		UploadToGPU();
+	}
+}
+
+void VulkanVertexBuffer::UploadToGPU()
+{
+	if (m_DataBuffer.empty())
+		return;
+
+	// The fallback data for unused attributes lives at the end of the same buffer
+	// so static draws don't need a separate dummy vertex buffer.
+	constexpr size_t FALLBACK_ALIGNMENT = 16;
+	const size_t dataSize = VertexDataSize();
+	const size_t paddedSize = AlignUp(dataSize, FALLBACK_ALIGNMENT);
+
+	std::vector<std::byte> tailData(paddedSize - dataSize + sizeof(s_FallbackMeshData));
+	memcpy(tailData.data() + (paddedSize - dataSize), &s_FallbackMeshData, sizeof(s_FallbackMeshData));
+
+	UploadStaticBuffer(m_GPUBuffer, vk::BufferUsageFlagBits::eVertexBuffer,
+		VertexData(), dataSize, tailData.data(), tailData.size(), "VulkanVertexBuffer (static)");
+	m_GPUFallbackOffset = paddedSize;
 }
 
 void VulkanVertexBuffer::Spew(int vertexCount, const VertexDesc_t& desc)
@@ -601,6 +732,28 @@ void VulkanVertexBuffer::ValidateData(int vertexCount, const VertexDesc_t& desc)
 	}
 }
 
+GPUBufferBinding VulkanVertexBuffer::GetGPUBinding() const
+{
+	if (m_IsDynamic)
+		return { m_DynamicAlloc.m_Buffer, m_DynamicAlloc.m_Offset };
+	else
+		return { m_GPUBuffer.GetBuffer() };
+}
+
+GPUBufferBinding VulkanVertexBuffer::GetGPUFallbackBinding() const
+{
+	if (m_IsDynamic)
+	{
+		const auto reserved = g_DynamicVertexRing.GetReserved();
+		assert(reserved.m_Size >= sizeof(s_FallbackMeshData));
+		return { reserved.m_Buffer, reserved.m_Offset };
+	}
+	else
+	{
+		return { m_GPUBuffer.GetBuffer(), m_GPUFallbackOffset };
+	}
+}
+
 const std::byte* VulkanVertexBuffer::VertexData() const
 {
 	return m_DataBuffer.data();
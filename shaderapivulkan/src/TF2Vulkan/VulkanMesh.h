@@ -1,6 +1,7 @@
 #pragma once
 
 #include "VertexFormat.h"
+#include "VulkanRingBuffer.h"
 
 #include "interface/internal/IMeshInternal.h"
 
@@ -14,10 +15,19 @@ namespace Util
 
 namespace TF2Vulkan
 {
+	struct GPUBufferBinding
+	{
+		vk::Buffer m_Buffer;
+		vk::DeviceSize m_Offset = 0;
+	};
+
 	class VulkanVertexBuffer final : public IVertexBufferInternal
 	{
 	public:
-		explicit VulkanVertexBuffer(const VertexFormat& format);
+		explicit VulkanVertexBuffer(const VertexFormat& format, bool isDynamic = false);
+		VulkanVertexBuffer(VulkanVertexBuffer&&) = default;
+		VulkanVertexBuffer& operator=(VulkanVertexBuffer&&) = default;
+		~VulkanVertexBuffer();
 
 		int VertexCount() const override;
 		VertexFormat_t GetVertexFormat() const override;
@@ -39,16 +49,36 @@ namespace TF2Vulkan
 		const std::byte* VertexData() const;
 		size_t VertexDataSize() const;
 
+		// Null buffer if nothing has been uploaded yet
+		GPUBufferBinding GetGPUBinding() const;
+		GPUBufferBinding GetGPUFallbackBinding() const;
+
 	private:
+		void UploadToGPU();
+
 		VertexFormat m_Format;
+		bool m_IsDynamic;
 
 		std::vector<std::byte> m_DataBuffer;
 		size_t m_VertexCount = 0;
+		size_t m_VertexSize = 0;
+
+		// Static buffers
+		vma::AllocatedBuffer m_GPUBuffer;
+		vk::DeviceSize m_GPUFallbackOffset = 0;
+
+		// Dynamic buffers
+		VulkanRingBuffer::Allocation m_DynamicAlloc;
 	};
 
 	class VulkanIndexBuffer final : public IIndexBufferInternal
 	{
 	public:
+		explicit VulkanIndexBuffer(bool isDynamic = false);
+		VulkanIndexBuffer(VulkanIndexBuffer&&) = default;
+		VulkanIndexBuffer& operator=(VulkanIndexBuffer&&) = default;
+		~VulkanIndexBuffer();
+
 		int IndexCount() const override;
 		MaterialIndexFormat_t IndexFormat() const override;
 
@@ -72,14 +102,28 @@ namespace TF2Vulkan
 		const unsigned short* IndexData() const;
 		size_t IndexDataSize() const;
 
+		// Null buffer if nothing has been uploaded yet
+		GPUBufferBinding GetGPUBinding() const;
+
 	private:
+		void UploadToGPU();
+
+		bool m_IsDynamic;
+
+		size_t m_IndexCount = 0;
+
+		// Static buffers
 		std::vector<unsigned short> m_Indices;
+		vma::AllocatedBuffer m_GPUBuffer;
+
+		// Dynamic buffers
+		VulkanRingBuffer::Allocation m_DynamicAlloc;
 	};
 
 	class VulkanMesh final : public IMeshInternal
 	{
 	public:
-		explicit VulkanMesh(const VertexFormat& fmt);
+		explicit VulkanMesh(const VertexFormat& fmt, bool isDynamic = false);
 
 		void SetPrimitiveType(MaterialPrimitiveType_t type) override;
 
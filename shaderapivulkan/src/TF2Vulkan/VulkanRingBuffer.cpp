@@ -0,0 +1,195 @@
+#include "interface/internal/IShaderDeviceInternal.h"
+#include "DeferredDestructionQueue.h"
+#include "IStateManagerVulkan.h"
+#include "VulkanFactories.h"
+#include "VulkanRingBuffer.h"
+
+using namespace TF2Vulkan;
+
+// Reserved space holds the fallback data bound for unused vertex attributes
+static VulkanRingBuffer s_DynamicVertexRing(vk::BufferUsageFlagBits::eVertexBuffer,
+	8 * 1024 * 1024, "TF2Vulkan Dynamic Vertex Ring", 256);
+static VulkanRingBuffer s_DynamicIndexRing(vk::BufferUsageFlagBits::eIndexBuffer,
+	2 * 1024 * 1024, "TF2Vulkan Dynamic Index Ring");
+static VulkanRingBuffer s_UniformRing(vk::BufferUsageFlagBits::eUniformBuffer,
+	4 * 1024 * 1024, "TF2Vulkan Uniform Ring");
+
+VulkanRingBuffer& TF2Vulkan::g_DynamicVertexRing = s_DynamicVertexRing;
+VulkanRingBuffer& TF2Vulkan::g_DynamicIndexRing = s_DynamicIndexRing;
+VulkanRingBuffer& TF2Vulkan::g_UniformRing = s_UniformRing;
+
+VulkanRingBuffer::VulkanRingBuffer(const vk::BufferUsageFlags& usage, size_t frameSize,
+	std::string&& dbgName, size_t reservedSize) :
+	m_Usage(usage),
+	m_FrameSize(frameSize),
+	m_ReservedSize(reservedSize),
+	m_DebugName(std::move(dbgName))
+{
+}
+
+void VulkanRingBuffer::EnsureCreated()
+{
+	if (m_BufferData)
+		return;
+
+	m_Buffer = Factories::BufferFactory{}
+		.SetUsage(m_Usage)
+		.SetSize(m_ReservedSize + m_FrameSize * MAX_FRAMES_IN_FLIGHT)
+		.SetAllowMapping(true)
+		.SetDebugName(std::string(m_DebugName))
+		.Create();
+
+	m_BufferData = m_Buffer.GetAllocation().data();
+	ENSURE(m_BufferData);
+
+	memset(m_BufferData, 0, m_ReservedSize);
+}
+
+void VulkanRingBuffer::UpdateFrame()
+{
+	EnsureCreated();
+
+	const auto frameNumber = g_ShaderDevice.GetFrameNumber();
+	if (frameNumber == m_FrameNumber)
+		return;
+
+	m_FrameNumber = frameNumber;
+	RetireOverflow();
+
+	// Nothing recorded from here on refers to the old buffer
+	if (m_FrameUsage > m_FrameSize)
+		Grow(m_FrameUsage);
+
+	m_FrameUsage = 0;
+
+	m_Offset = m_ReservedSize + m_FrameSize * size_t(frameNumber % MAX_FRAMES_IN_FLIGHT);
+	m_RegionEnd = m_Offset + m_FrameSize;
+}
+
+void VulkanRingBuffer::Grow(size_t requiredFrameSize)
+{
+	size_t newFrameSize = m_FrameSize;
+	while (newFrameSize < requiredFrameSize)
+		newFrameSize *= 2;
+
+	DevMsg(TF2VULKAN_PREFIX "%s: growing frame regions from %zu to %zu bytes (last frame used %zu)\n",
+		m_DebugName.c_str(), m_FrameSize, newFrameSize, requiredFrameSize);
+
+	// Frames still in flight keep using the old one until they're done
+	auto oldBuffer = std::move(m_Buffer);
+	const std::byte* oldData = m_BufferData;
+
+	m_FrameSize = newFrameSize;
+	m_BufferData = nullptr;
+	EnsureCreated();
+
+	memcpy(m_BufferData, oldData, m_ReservedSize);
+	g_DeferredDestruction.Add(std::move(oldBuffer));
+
+	// Cached descriptor sets point at the old buffer
+	if (m_Usage & vk::BufferUsageFlagBits::eUniformBuffer)
+		g_StateManagerVulkan.FlushDescriptorSetCache();
+}
+
+void VulkanRingBuffer::Release()
+{
+	m_Buffer = vma::AllocatedBuffer{};
+	m_BufferData = nullptr;
+	m_OverflowBuffer = vma::AllocatedBuffer{};
+	m_OverflowSize = 0;
+	m_OverflowOffset = 0;
+
+	m_FrameNumber = uint64_t(-1);
+	m_RegionEnd = 0;
+	m_Offset = 0;
+	m_FrameUsage = 0;
+}
+
+void VulkanRingBuffer::RetireOverflow()
+{
+	if (!m_OverflowBuffer.GetBuffer())
+		return;
+
+	g_DeferredDestruction.Add(std::move(m_OverflowBuffer));
+	m_OverflowSize = 0;
+	m_OverflowOffset = 0;
+}
+
+auto VulkanRingBuffer::Allocate(size_t size, size_t alignment) -> Allocation
+{
+	UpdateFrame();
+
+	Allocation retVal;
+	retVal.m_Size = size;
+
+	if (const auto offset = AlignUp(m_Offset, alignment); (offset + size) <= m_RegionEnd)
+	{
+		m_FrameUsage += offset + size - m_Offset;
+		m_Offset = offset + size;
+		retVal.m_Buffer = m_Buffer.GetBuffer();
+		retVal.m_Offset = offset;
+		retVal.m_Data = m_BufferData + offset;
+		return retVal;
+	}
+
+	// Out of room in this frame's region, so carve out of an overflow buffer instead
+	auto offset = AlignUp(m_OverflowOffset, alignment);
+	if (!m_OverflowBuffer.GetBuffer() || (offset + size) > m_OverflowSize)
+	{
+		RetireOverflow();
+
+		// The ring grows to fit at the start of the next frame
+		DevMsg(TF2VULKAN_PREFIX "%s: frame region (%zu bytes) exhausted, allocating overflow buffer\n",
+			m_DebugName.c_str(), m_FrameSize);
+
+		m_OverflowSize = (std::max)(size, m_FrameSize);
+		m_OverflowBuffer = Factories::BufferFactory{}
+			.SetUsage(m_Usage)
+			.SetSize(m_OverflowSize)
+			.SetAllowMapping(true)
+			.SetDebugName(m_DebugName + " (overflow)")
+			.Create();
+
+		offset = 0;
+	}
+
+	m_FrameUsage += offset + size - m_OverflowOffset;
+	m_OverflowOffset = offset + size;
+	retVal.m_Buffer = m_OverflowBuffer.GetBuffer();
+	retVal.m_Offset = offset;
+	retVal.m_Data = m_OverflowBuffer.GetAllocation().data() + offset;
+	retVal.m_IsOverflow = true;
+	return retVal;
+}
+
+void VulkanRingBuffer::Shrink(Allocation& allocation, size_t newSize)
+{
+	assert(newSize <= allocation.m_Size);
+	if (newSize >= allocation.m_Size)
+		return;
+
+	const size_t allocEnd = size_t(allocation.m_Offset) + allocation.m_Size;
+	if (allocation.m_Buffer == m_Buffer.GetBuffer() && allocEnd == m_Offset)
+	{
+		m_Offset -= allocation.m_Size - newSize;
+		m_FrameUsage -= allocation.m_Size - newSize;
+	}
+	else if (allocation.m_Buffer == m_OverflowBuffer.GetBuffer() && allocEnd == m_OverflowOffset)
+	{
+		m_OverflowOffset -= allocation.m_Size - newSize;
+		m_FrameUsage -= allocation.m_Size - newSize;
+	}
+
+	allocation.m_Size = newSize;
+}
+
+auto VulkanRingBuffer::GetReserved() -> Allocation
+{
+	EnsureCreated();
+
+	Allocation retVal;
+	retVal.m_Buffer = m_Buffer.GetBuffer();
+	retVal.m_Data = m_BufferData;
+	retVal.m_Size = m_ReservedSize;
+	return retVal;
+}
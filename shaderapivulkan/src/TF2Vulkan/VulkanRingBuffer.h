@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+
+namespace TF2Vulkan
+{
+	// Persistently mapped, host-visible buffer split into one region per frame in
+	// flight. Allocations are linear within the current frame's region, and the
+	// region is reused once the frame number wraps back around to it.
+	//
+	// A frame that doesn't fit spills into an overflow buffer, and at the start of
+	// the next frame the whole ring is reallocated with regions big enough for it.
+	class VulkanRingBuffer final
+	{
+	public:
+		VulkanRingBuffer(const vk::BufferUsageFlags& usage, size_t frameSize, std::string&& dbgName,
+			size_t reservedSize = 0);
+
+		struct Allocation
+		{
+			vk::Buffer m_Buffer;
+			vk::DeviceSize m_Offset = 0;
+			std::byte* m_Data = nullptr;
+			size_t m_Size = 0;
+
+			// Overflow buffers are short-lived, so their handles shouldn't be cached
+			bool m_IsOverflow = false;
+
+			explicit operator bool() const { return !!m_Data; }
+		};
+
+		[[nodiscard]] Allocation Allocate(size_t size, size_t alignment = 16);
+
+		// Gives back the unused tail of an allocation, if it was the most recent one
+		void Shrink(Allocation& allocation, size_t newSize);
+
+		// Zero-filled block at the start of the buffer that Allocate() never hands out
+		Allocation GetReserved();
+
+		// Frees the buffers. The GPU must be done with them. The next Allocate()
+		// creates them again.
+		void Release();
+
+	private:
+		void EnsureCreated();
+		void UpdateFrame();
+		void RetireOverflow();
+		void Grow(size_t requiredFrameSize);
+
+		vk::BufferUsageFlags m_Usage;
+		size_t m_FrameSize;
+		size_t m_ReservedSize;
+		std::string m_DebugName;
+
+		vma::AllocatedBuffer m_Buffer;
+		std::byte* m_BufferData = nullptr;
+
+		uint64_t m_FrameNumber = uint64_t(-1);
+		size_t m_RegionEnd = 0;
+		size_t m_Offset = 0;
+		size_t m_FrameUsage = 0; // Including padding and anything that went to overflow buffers
+
+		// Used once the current frame's region fills up
+		vma::AllocatedBuffer m_OverflowBuffer;
+		size_t m_OverflowSize = 0;
+		size_t m_OverflowOffset = 0;
+	};
+
+	extern VulkanRingBuffer& g_DynamicVertexRing;
+	extern VulkanRingBuffer& g_DynamicIndexRing;
+	extern VulkanRingBuffer& g_UniformRing;
+}
@@ -23,6 +23,8 @@ template<typename T1, typename T2> struct ::std::hash<vk::Flags<T1, T2>>
 #define VK_TYPE_HASH(type) STD_HASH_DEFINITION(vk:: ## type, (Vk ## type)v)
 VK_TYPE_HASH(Image);
 VK_TYPE_HASH(ImageView);
+VK_TYPE_HASH(Sampler);
+VK_TYPE_HASH(Buffer);
 #pragma pop_macro("VK_TYPE_HASH")
 
 STD_HASH_DEFINITION(vk::Extent2D,
@@ -62,10 +64,6 @@ STD_HASH_DEFINITION(vk::ImageViewCreateInfo,
 
 namespace TF2Vulkan
 {
-	void TransitionImageLayout(const vk::Image& image, const vk::Format& format,
-		const vk::ImageLayout& oldLayout, const vk::ImageLayout& newLayout,
-		IVulkanCommandBuffer& cmdBuf, uint32_t mipLevel);
-
 	template<typename T, size_t size>
 	inline vk::ArrayProxy<T> to_array_proxy(T(&array)[size])
 	{
@@ -80,6 +78,12 @@ namespace TF2Vulkan
 	vk::Extent2D ToExtent2D(const vk::Extent3D& extent);
 	vk::Extent3D ToExtent3D(const vk::Extent2D& extent);
 
+	template<typename T>
+	constexpr T AlignUp(const T& value, const T& alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
 	enum class ClearValueType : uint_fast8_t
 	{
 		Float,
@@ -104,6 +108,14 @@ inline std::strong_ordering operator<=>(const vk::ImageView& lhs, const vk::Imag
 {
 	return (VkImageView)lhs <=> (VkImageView)rhs;
 }
+inline std::strong_ordering operator<=>(const vk::Sampler& lhs, const vk::Sampler& rhs)
+{
+	return (VkSampler)lhs <=> (VkSampler)rhs;
+}
+inline std::strong_ordering operator<=>(const vk::Buffer& lhs, const vk::Buffer& rhs)
+{
+	return (VkBuffer)lhs <=> (VkBuffer)rhs;
+}
 inline std::strong_ordering operator<=>(const vk::Extent2D& lhs, const vk::Extent2D& rhs)
 {
 	auto result = lhs.width <=> rhs.width;
@@ -27,13 +27,41 @@ const vk::ImageView& IVulkanTexture::FindOrCreateView()
 		throw VulkanException("Unknown vk::ImageType", EXCEPTION_DATA());
 	}
 
-	ci.subresourceRange.aspectMask = FormatInfo::GetAspects(ci.format);
-	ci.subresourceRange.layerCount = imgCreateInfo.arrayLayers;
-	ci.subresourceRange.levelCount = imgCreateInfo.mipLevels;
+	ci.subresourceRange = GetViewRange();
 
 	return FindOrCreateView(ci);
 }
 
+vk::ImageSubresourceRange IVulkanTexture::GetViewRange() const
+{
+	const auto& imgCreateInfo = GetImageCreateInfo();
+
+	vk::ImageSubresourceRange range;
+	range.aspectMask = FormatInfo::GetAspects(imgCreateInfo.format);
+	range.layerCount = imgCreateInfo.arrayLayers;
+	const auto baseMip = GetBaseViewMip();
+	range.baseMipLevel = baseMip < imgCreateInfo.mipLevels ? baseMip : imgCreateInfo.mipLevels - 1;
+	range.levelCount = imgCreateInfo.mipLevels - range.baseMipLevel;
+
+	return range;
+}
+
+void IVulkanTexture::Transition(IVulkanCommandBuffer& buf, const ImageLayoutTracker::Usage& usage, bool discard)
+{
+	vk::ImageSubresourceRange range;
+	range.aspectMask = FormatInfo::GetAspects(GetImageCreateInfo().format);
+	range.levelCount = VK_REMAINING_MIP_LEVELS;
+	range.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+	return Transition(buf, range, usage, discard);
+}
+
+void IVulkanTexture::Transition(IVulkanCommandBuffer& buf, const vk::ImageSubresourceRange& range,
+	const ImageLayoutTracker::Usage& usage, bool discard)
+{
+	return GetLayoutTracker().Transition(buf, GetImage(), range, usage, discard);
+}
+
 int IShaderAPITexture::GetActualWidth() const
 {
 	LOG_FUNC();
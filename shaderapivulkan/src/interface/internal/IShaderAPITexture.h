@@ -1,5 +1,7 @@
 #pragma once
 
+#include "TF2Vulkan/ImageLayoutTracker.h"
+
 #include <materialsystem/itexture.h>
 #include <shaderapi/ishaderdynamic.h>
 
@@ -20,6 +22,19 @@ namespace TF2Vulkan
 
 		virtual const vk::ImageView& FindOrCreateView();
 
+		virtual ImageLayoutTracker& GetLayoutTracker() = 0;
+
+		// Finest mip level included by FindOrCreateView()
+		virtual uint32_t GetBaseViewMip() const { return 0; }
+
+		// Subresources seen through FindOrCreateView()
+		vk::ImageSubresourceRange GetViewRange() const;
+
+		// Transitions every subresource (or just the ones in range) through GetLayoutTracker()
+		void Transition(IVulkanCommandBuffer& buf, const ImageLayoutTracker::Usage& usage, bool discard = false);
+		void Transition(IVulkanCommandBuffer& buf, const vk::ImageSubresourceRange& range,
+			const ImageLayoutTracker::Usage& usage, bool discard = false);
+
 		void GetSize(uint32_t& width, uint32_t& height) const
 		{
 			const auto& ci = GetImageCreateInfo();
@@ -13,6 +13,11 @@ namespace TF2Vulkan
 	class IShaderAPITexture;
 	class IVulkanTexture;
 
+	// Upper limit for mat_vulkan_frames_in_flight. Per-frame resources (ring
+	// buffers etc) are split into this many regions, so they are never reused
+	// while a frame that wrote to them may still be executing.
+	static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+
 #pragma push_macro("SET_DEBUG_NAME_FN")
 #undef SET_DEBUG_NAME_FN
 #define SET_DEBUG_NAME_FN(type) \
@@ -30,6 +35,7 @@ namespace TF2Vulkan
 			vk::UniqueDevice m_Device;
 			uint32_t m_GraphicsQueueIndex = uint32_t(-1);
 			std::optional<uint32_t> m_TransferQueueIndex;
+			bool m_ExtendedDynamicState = false; // VK_EXT_extended_dynamic_state is enabled
 		};
 
 		virtual void VulkanInit(VulkanInitData && data) = 0;
@@ -37,6 +43,7 @@ namespace TF2Vulkan
 		virtual const vk::Device & GetVulkanDevice() = 0;
 		virtual vma::UniqueAllocator & GetVulkanAllocator() = 0;
 		virtual const vk::DispatchLoaderDynamic & GetDynamicDispatch() const = 0;
+		virtual bool HasExtendedDynamicState() const = 0;
 
 		virtual IVulkanQueue & GetGraphicsQueue() = 0;
 
@@ -55,6 +62,13 @@ namespace TF2Vulkan
 
 		virtual IVulkanCommandBuffer& GetPrimaryCmdBuf() = 0;
 
+		// Incremented by every Present()
+		virtual uint64_t GetFrameNumber() const = 0;
+
+		// Loaded from disk at device init, written back periodically and at shutdown
+		virtual const vk::PipelineCache& GetPipelineCache() const = 0;
+		virtual void SavePipelineCache() = 0;
+
 		virtual bool SetMode(void* hwnd, int adapter, const ShaderDeviceInfo_t& info) = 0;
 
 		SET_DEBUG_NAME_FN(Buffer);
@@ -68,6 +82,7 @@ namespace TF2Vulkan
 		SET_DEBUG_NAME_FN(Image);
 		SET_DEBUG_NAME_FN(ImageView);
 		SET_DEBUG_NAME_FN(Pipeline);
+		SET_DEBUG_NAME_FN(PipelineCache);
 		SET_DEBUG_NAME_FN(PipelineLayout);
 		SET_DEBUG_NAME_FN(Queue);
 		SET_DEBUG_NAME_FN(RenderPass);
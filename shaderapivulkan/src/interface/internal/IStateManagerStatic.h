@@ -13,8 +13,9 @@ namespace TF2Vulkan
 	class IStateManagerStatic : public IShaderShadow
 	{
 	public:
-		virtual void ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf) = 0;
-		virtual void ApplyCurrentState(IVulkanCommandBuffer& buf) = 0;
+		// Returns false if the draw should be skipped (pipeline still compiling)
+		virtual bool ApplyState(LogicalShadowStateID id, IVulkanCommandBuffer& buf) = 0;
+		virtual bool ApplyCurrentState(IVulkanCommandBuffer& buf) = 0;
 
 		virtual LogicalShadowStateID TakeSnapshot() = 0;
 		virtual bool IsTranslucent(LogicalShadowStateID id) const = 0;
@@ -26,7 +27,8 @@ namespace TF2Vulkan
 		virtual void SetRenderTargetEx(int rtID, ShaderAPITextureHandle_t colTex, ShaderAPITextureHandle_t depthTex) = 0;
 
 		virtual void SetState(LogicalShadowStateID id) = 0;
-		virtual const LogicalShadowState& GetState(LogicalShadowStateID id) const = 0;
+		// Snapshots are stored packed, so this rebuilds the full state
+		virtual LogicalShadowState GetState(LogicalShadowStateID id) const = 0;
 
 		// Helpers
 		void SetState(StateSnapshot_t id)
@@ -49,7 +51,7 @@ namespace TF2Vulkan
 		{
 			return IsDepthWriteEnabled(Util::SafeConvert<LogicalShadowStateID>(id));
 		}
-		const LogicalShadowState& GetState(StateSnapshot_t id) const
+		LogicalShadowState GetState(StateSnapshot_t id) const
 		{
 			return GetState(Util::SafeConvert<LogicalShadowStateID>(id));
 		}
@@ -1,10 +1,63 @@
 #include "IVulkanCommandBuffer.h"
 #include "IVulkanQueue.h"
+#include "interface/internal/IShaderDeviceInternal.h"
 #include "TF2Vulkan/ShaderDeviceMgr.h"
 #include "TF2Vulkan/VulkanUtil.h"
 
+#include <algorithm>
+#include <atomic>
+
 using namespace TF2Vulkan;
 
+namespace
+{
+	struct AtomicBindStats final
+	{
+		struct Counter final
+		{
+			std::atomic<uint64_t> m_Issued = 0;
+			std::atomic<uint64_t> m_Elided = 0;
+
+			// Returns true if the bind should be recorded
+			bool Count(bool redundant)
+			{
+				if (redundant)
+					m_Elided.fetch_add(1, std::memory_order_relaxed);
+				else
+					m_Issued.fetch_add(1, std::memory_order_relaxed);
+
+				return !redundant;
+			}
+
+			IVulkanCommandBuffer::BindStats::Counter Get() const
+			{
+				return { m_Issued.load(std::memory_order_relaxed), m_Elided.load(std::memory_order_relaxed) };
+			}
+		};
+
+		Counter m_Pipelines;
+		Counter m_DescriptorSets;
+		Counter m_VertexBuffers;
+		Counter m_IndexBuffers;
+	};
+}
+
+static AtomicBindStats s_BindStats;
+
+CON_COMMAND(mat_vulkan_bind_stats, "Prints how many pipeline/descriptor set/vertex and index buffer binds were recorded, and how many were dropped as redundant.")
+{
+	const auto stats = IVulkanCommandBuffer::GetBindStats();
+	const auto print = [](const char* name, const IVulkanCommandBuffer::BindStats::Counter& counter)
+	{
+		Msg(TF2VULKAN_PREFIX "%s: %llu recorded, %llu elided\n", name, counter.m_Issued, counter.m_Elided);
+	};
+
+	print("Pipelines", stats.m_Pipelines);
+	print("Descriptor sets", stats.m_DescriptorSets);
+	print("Vertex buffers", stats.m_VertexBuffers);
+	print("Index buffers", stats.m_IndexBuffers);
+}
+
 static vk::DebugUtilsLabelEXT InitDebugUtilsLabel(const char* name, const Color& color = PIX_COLOR_MISC)
 {
 	vk::DebugUtilsLabelEXT label;
@@ -49,41 +102,128 @@ void IVulkanCommandBuffer::begin(const vk::CommandBufferBeginInfo& beginInfo)
 {
 	assert(!m_IsActive);
 	m_IsActive = true;
+	m_Viewport.reset();
+	m_Scissor.reset();
+	m_Bound = {};
+	m_PendingBarriers = {};
 	return GetCmdBuffer().begin(beginInfo);
 }
 
 void IVulkanCommandBuffer::beginRenderPass(const vk::RenderPassBeginInfo& renderPassBegin, const vk::SubpassContents& contents)
 {
 	assert(!m_ActiveRenderPass);
-	m_ActiveRenderPass.emplace(ActiveRenderPass{ renderPassBegin, contents });
+	FlushBarriers();
+
+	auto& active = m_ActiveRenderPass.emplace(ActiveRenderPass{ renderPassBegin, contents });
+
+	// The caller's clear values usually live on the stack
+	active.m_BeginInfo.pClearValues = nullptr;
+	for (uint32_t i = 0; i < renderPassBegin.clearValueCount; i++)
+		active.m_ClearValues.push_back(renderPassBegin.pClearValues[i]);
+
 	return GetCmdBuffer().beginRenderPass(renderPassBegin, contents);
 }
 
 void IVulkanCommandBuffer::bindDescriptorSets(const vk::PipelineBindPoint& pipelineBindPoint, const vk::PipelineLayout& layout, uint32_t firstSet, const vk::ArrayProxy<const vk::DescriptorSet>& descriptorSets, const vk::ArrayProxy<const uint32_t> dynamicOffsets)
 {
-	return GetCmdBuffer().bindDescriptorSets(pipelineBindPoint, layout, firstSet, descriptorSets, dynamicOffsets);
+	if (pipelineBindPoint != vk::PipelineBindPoint::eGraphics)
+		return GetCmdBuffer().bindDescriptorSets(pipelineBindPoint, layout, firstSet, descriptorSets, dynamicOffsets);
+
+	auto& bound = m_Bound;
+
+	// Same layout means the same set layouts, so nothing was disturbed in between
+	const bool redundant = bound.m_DescriptorLayout == layout &&
+		bound.m_FirstDescriptorSet == firstSet &&
+		std::equal(descriptorSets.begin(), descriptorSets.end(), bound.m_DescriptorSets.begin(), bound.m_DescriptorSets.end()) &&
+		std::equal(dynamicOffsets.begin(), dynamicOffsets.end(), bound.m_DynamicOffsets.begin(), bound.m_DynamicOffsets.end());
+
+	if (!s_BindStats.m_DescriptorSets.Count(redundant))
+		return;
+
+	GetCmdBuffer().bindDescriptorSets(pipelineBindPoint, layout, firstSet, descriptorSets, dynamicOffsets);
+
+	bound.m_DescriptorSets.clear();
+	bound.m_DynamicOffsets.clear();
+	if (descriptorSets.size() <= bound.m_DescriptorSets.max_size() &&
+		dynamicOffsets.size() <= bound.m_DynamicOffsets.max_size())
+	{
+		bound.m_DescriptorLayout = layout;
+		bound.m_FirstDescriptorSet = firstSet;
+		for (const auto& set : descriptorSets)
+			bound.m_DescriptorSets.push_back(set);
+		for (const auto& offset : dynamicOffsets)
+			bound.m_DynamicOffsets.push_back(offset);
+	}
+	else
+	{
+		// Too many to remember, never elide the next one
+		bound.m_DescriptorLayout = nullptr;
+	}
 }
 
 void IVulkanCommandBuffer::bindPipeline(const vk::PipelineBindPoint& pipelineBindPoint, const vk::Pipeline& pipeline)
 {
+	if (pipelineBindPoint != vk::PipelineBindPoint::eGraphics)
+		return GetCmdBuffer().bindPipeline(pipelineBindPoint, pipeline);
+
+	if (!s_BindStats.m_Pipelines.Count(m_Bound.m_Pipeline == pipeline))
+		return;
+
+	m_Bound.m_Pipeline = pipeline;
 	return GetCmdBuffer().bindPipeline(pipelineBindPoint, pipeline);
 }
 
 void IVulkanCommandBuffer::bindIndexBuffer(const vk::Buffer& buffer,
 	const vk::DeviceSize& offset, const vk::IndexType& indexType)
 {
+	auto& bound = m_Bound;
+	const bool redundant = bound.m_IndexBuffer == buffer &&
+		bound.m_IndexBufferOffset == offset &&
+		bound.m_IndexType == indexType;
+
+	if (!s_BindStats.m_IndexBuffers.Count(redundant))
+		return;
+
+	bound.m_IndexBuffer = buffer;
+	bound.m_IndexBufferOffset = offset;
+	bound.m_IndexType = indexType;
 	return GetCmdBuffer().bindIndexBuffer(buffer, offset, indexType);
 }
 
 void IVulkanCommandBuffer::bindVertexBuffers(uint32_t firstBinding,
 	const vk::ArrayProxy<const vk::Buffer>& buffers, const vk::ArrayProxy<const vk::DeviceSize>& offsets)
 {
+	assert(buffers.size() == offsets.size());
+
+	auto& bound = m_Bound;
+	const bool tracked = firstBinding + buffers.size() <= bound.MAX_VERTEX_BUFFERS;
+	const bool redundant = tracked &&
+		std::equal(buffers.begin(), buffers.end(), bound.m_VertexBuffers.begin() + firstBinding) &&
+		std::equal(offsets.begin(), offsets.end(), bound.m_VertexBufferOffsets.begin() + firstBinding);
+
+	if (!s_BindStats.m_VertexBuffers.Count(redundant))
+		return;
+
+	if (tracked)
+	{
+		std::copy(buffers.begin(), buffers.end(), bound.m_VertexBuffers.begin() + firstBinding);
+		std::copy(offsets.begin(), offsets.end(), bound.m_VertexBufferOffsets.begin() + firstBinding);
+	}
+
 	return GetCmdBuffer().bindVertexBuffers(firstBinding, buffers, offsets);
 }
 
+void IVulkanCommandBuffer::copyBuffer(const vk::Buffer& srcBuf, const vk::Buffer& dstBuf,
+	const vk::ArrayProxy<const vk::BufferCopy>& regions)
+{
+	FlushBarriers();
+	return GetCmdBuffer().copyBuffer(srcBuf, dstBuf, regions);
+}
+
 void IVulkanCommandBuffer::copyBufferToImage(const vk::Buffer& buf, const vk::Image& img,
 	const vk::ImageLayout& dstImageLayout, const vk::ArrayProxy<const vk::BufferImageCopy>& regions)
 {
+	FlushBarriers();
 	return GetCmdBuffer().copyBufferToImage(buf, img, dstImageLayout, regions);
 }
 
@@ -107,6 +247,8 @@ void IVulkanCommandBuffer::drawIndexed(uint32_t indexCount, uint32_t instanceCou
 
 void IVulkanCommandBuffer::end()
 {
+	FlushBarriers();
+
 	while (m_DebugScopeCount > 0)
 		endDebugUtilsLabelEXT();
 
@@ -127,6 +269,62 @@ void IVulkanCommandBuffer::endRenderPass()
 	m_ActiveRenderPass.reset();
 	return GetCmdBuffer().endRenderPass();
 }
+void IVulkanCommandBuffer::setViewport(uint32_t firstViewport, const vk::ArrayProxy<const vk::Viewport>& viewports)
+{
+	return GetCmdBuffer().setViewport(firstViewport, viewports);
+}
+
+void IVulkanCommandBuffer::setScissor(uint32_t firstScissor, const vk::ArrayProxy<const vk::Rect2D>& scissors)
+{
+	return GetCmdBuffer().setScissor(firstScissor, scissors);
+}
+
+void IVulkanCommandBuffer::setStencilCompareMask(const vk::StencilFaceFlags& faceMask, uint32_t compareMask)
+{
+	return GetCmdBuffer().setStencilCompareMask(faceMask, compareMask);
+}
+
+void IVulkanCommandBuffer::setStencilWriteMask(const vk::StencilFaceFlags& faceMask, uint32_t writeMask)
+{
+	return GetCmdBuffer().setStencilWriteMask(faceMask, writeMask);
+}
+
+void IVulkanCommandBuffer::setStencilReference(const vk::StencilFaceFlags& faceMask, uint32_t reference)
+{
+	return GetCmdBuffer().setStencilReference(faceMask, reference);
+}
+
+void IVulkanCommandBuffer::setCullModeEXT(const vk::CullModeFlags& cullMode)
+{
+	return GetCmdBuffer().setCullModeEXT(cullMode, g_ShaderDevice.GetDynamicDispatch());
+}
+
+void IVulkanCommandBuffer::setDepthTestEnableEXT(bool depthTestEnable)
+{
+	return GetCmdBuffer().setDepthTestEnableEXT(depthTestEnable, g_ShaderDevice.GetDynamicDispatch());
+}
+
+void IVulkanCommandBuffer::setDepthWriteEnableEXT(bool depthWriteEnable)
+{
+	return GetCmdBuffer().setDepthWriteEnableEXT(depthWriteEnable, g_ShaderDevice.GetDynamicDispatch());
+}
+
+void IVulkanCommandBuffer::setDepthCompareOpEXT(const vk::CompareOp& depthCompareOp)
+{
+	return GetCmdBuffer().setDepthCompareOpEXT(depthCompareOp, g_ShaderDevice.GetDynamicDispatch());
+}
+
+void IVulkanCommandBuffer::setStencilTestEnableEXT(bool stencilTestEnable)
+{
+	return GetCmdBuffer().setStencilTestEnableEXT(stencilTestEnable, g_ShaderDevice.GetDynamicDispatch());
+}
+
+void IVulkanCommandBuffer::setStencilOpEXT(const vk::StencilFaceFlags& faceMask, const vk::StencilOp& failOp,
+	const vk::StencilOp& passOp, const vk::StencilOp& depthFailOp, const vk::CompareOp& compareOp)
+{
+	return GetCmdBuffer().setStencilOpEXT(faceMask, failOp, passOp, depthFailOp, compareOp,
+		g_ShaderDevice.GetDynamicDispatch());
+}
 
 void IVulkanCommandBuffer::pipelineBarrier(const vk::PipelineStageFlags& srcStageMask,
 	const vk::PipelineStageFlags& dstStageMask, const vk::DependencyFlags& dependencyFlags,
@@ -134,6 +332,7 @@ void IVulkanCommandBuffer::pipelineBarrier(const vk::PipelineStageFlags& srcStag
 	const vk::ArrayProxy<const vk::BufferMemoryBarrier>& bufferMemoryBarriers,
 	const vk::ArrayProxy<const vk::ImageMemoryBarrier>& imageMemoryBarriers)
 {
+	FlushBarriers();
 	return GetCmdBuffer().pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags,
 		memoryBarriers, bufferMemoryBarriers, imageMemoryBarriers);
 }
@@ -156,9 +355,6 @@ void IVulkanCommandBuffer::Submit(vk::SubmitInfo submitInfo, const vk::Fence& fe
 
 	auto& q = GetQueue().GetQueue();
 	q.submit(submitInfo, fence);
-	q.waitIdle(); // FIXME
-
-	ReleaseAttachedResources();
 }
 
 void IVulkanCommandBuffer::CopyBufferToImage(const vk::Buffer& buffer, const vk::Image& image,
@@ -174,6 +370,196 @@ void IVulkanCommandBuffer::CopyBufferToImage(const vk::Buffer& buffer, const vk:
 	copyBufferToImage(buffer, image, vk::ImageLayout::eTransferDstOptimal, copy);
 }
 
+static bool Overlaps(const vk::ImageMemoryBarrier& a, const vk::ImageMemoryBarrier& b)
+{
+	if (a.image != b.image)
+		return false;
+
+	const auto& ra = a.subresourceRange;
+	const auto& rb = b.subresourceRange;
+	return ra.baseMipLevel < rb.baseMipLevel + rb.levelCount && rb.baseMipLevel < ra.baseMipLevel + ra.levelCount &&
+		ra.baseArrayLayer < rb.baseArrayLayer + rb.layerCount && rb.baseArrayLayer < ra.baseArrayLayer + ra.layerCount;
+}
+
+void IVulkanCommandBuffer::QueueImageBarrier(const vk::PipelineStageFlags& srcStageMask,
+	const vk::PipelineStageFlags& dstStageMask, const vk::ImageMemoryBarrier& barrier)
+{
+	assert(!m_ActiveRenderPass);
+	auto& pending = m_PendingBarriers;
+
+	// Barriers within a single vkCmdPipelineBarrier aren't ordered relative to each
+	// other, so a second transition of the same subresource has to go in a new one
+	if (std::any_of(pending.m_ImageBarriers.begin(), pending.m_ImageBarriers.end(),
+		[&](const vk::ImageMemoryBarrier& other) { return Overlaps(barrier, other); }))
+	{
+		FlushBarriers();
+	}
+
+	pending.m_SrcStageMask |= srcStageMask;
+	pending.m_DstStageMask |= dstStageMask;
+	pending.m_ImageBarriers.push_back(barrier);
+}
+
+void IVulkanCommandBuffer::QueueMemoryBarrier(const vk::PipelineStageFlags& srcStageMask,
+	const vk::PipelineStageFlags& dstStageMask, const vk::MemoryBarrier& barrier)
+{
+	assert(!m_ActiveRenderPass);
+	auto& pending = m_PendingBarriers;
+
+	// Global barriers just widen the one that's already queued
+	pending.m_SrcStageMask |= srcStageMask;
+	pending.m_DstStageMask |= dstStageMask;
+	pending.m_MemoryBarrier.srcAccessMask |= barrier.srcAccessMask;
+	pending.m_MemoryBarrier.dstAccessMask |= barrier.dstAccessMask;
+	pending.m_HasMemoryBarrier = true;
+}
+
+void IVulkanCommandBuffer::QueueBufferBarrier(const vk::PipelineStageFlags& srcStageMask,
+	const vk::PipelineStageFlags& dstStageMask, const vk::BufferMemoryBarrier& barrier)
+{
+	assert(!m_ActiveRenderPass);
+	auto& pending = m_PendingBarriers;
+
+	// Only used for queue family ownership transfers of whole buffers, which
+	// never overlap within a batch
+	pending.m_SrcStageMask |= srcStageMask;
+	pending.m_DstStageMask |= dstStageMask;
+	pending.m_BufferBarriers.push_back(barrier);
+}
+
+void IVulkanCommandBuffer::FlushBarriers()
+{
+	auto& pending = m_PendingBarriers;
+	if (pending.m_ImageBarriers.empty() && pending.m_BufferBarriers.empty() && !pending.m_HasMemoryBarrier)
+		return;
+
+	const vk::ArrayProxy<const vk::MemoryBarrier> memoryBarriers(
+		pending.m_HasMemoryBarrier ? 1 : 0, &pending.m_MemoryBarrier);
+
+	GetCmdBuffer().pipelineBarrier(pending.m_SrcStageMask, pending.m_DstStageMask, {},
+		memoryBarriers, pending.m_BufferBarriers, pending.m_ImageBarriers);
+
+	pending.m_ImageBarriers.clear();
+	pending.m_BufferBarriers.clear();
+	pending.m_MemoryBarrier = vk::MemoryBarrier{};
+	pending.m_HasMemoryBarrier = false;
+	pending.m_SrcStageMask = {};
+	pending.m_DstStageMask = {};
+}
+
+void IVulkanCommandBuffer::SetViewport(const vk::Viewport& viewport)
+{
+	if (m_Viewport == viewport)
+		return;
+
+	setViewport(0, viewport);
+	m_Viewport = viewport;
+}
+
+void IVulkanCommandBuffer::SetScissor(const vk::Rect2D& scissor)
+{
+	if (m_Scissor == scissor)
+		return;
+
+	setScissor(0, scissor);
+	m_Scissor = scissor;
+}
+
+static constexpr auto STENCIL_FACES = vk::StencilFaceFlagBits::eFrontAndBack;
+
+void IVulkanCommandBuffer::SetStencilReference(uint32_t reference)
+{
+	if (m_Bound.m_StencilReference == reference)
+		return;
+
+	setStencilReference(STENCIL_FACES, reference);
+	m_Bound.m_StencilReference = reference;
+}
+
+void IVulkanCommandBuffer::SetStencilCompareMask(uint32_t compareMask)
+{
+	if (m_Bound.m_StencilCompareMask == compareMask)
+		return;
+
+	setStencilCompareMask(STENCIL_FACES, compareMask);
+	m_Bound.m_StencilCompareMask = compareMask;
+}
+
+void IVulkanCommandBuffer::SetStencilWriteMask(uint32_t writeMask)
+{
+	if (m_Bound.m_StencilWriteMask == writeMask)
+		return;
+
+	setStencilWriteMask(STENCIL_FACES, writeMask);
+	m_Bound.m_StencilWriteMask = writeMask;
+}
+
+void IVulkanCommandBuffer::SetCullMode(const vk::CullModeFlags& cullMode)
+{
+	if (m_Bound.m_CullMode == cullMode)
+		return;
+
+	setCullModeEXT(cullMode);
+	m_Bound.m_CullMode = cullMode;
+}
+
+void IVulkanCommandBuffer::SetDepthTestEnable(bool depthTestEnable)
+{
+	if (m_Bound.m_DepthTestEnable == depthTestEnable)
+		return;
+
+	setDepthTestEnableEXT(depthTestEnable);
+	m_Bound.m_DepthTestEnable = depthTestEnable;
+}
+
+void IVulkanCommandBuffer::SetDepthWriteEnable(bool depthWriteEnable)
+{
+	if (m_Bound.m_DepthWriteEnable == depthWriteEnable)
+		return;
+
+	setDepthWriteEnableEXT(depthWriteEnable);
+	m_Bound.m_DepthWriteEnable = depthWriteEnable;
+}
+
+void IVulkanCommandBuffer::SetDepthCompareOp(vk::CompareOp depthCompareOp)
+{
+	if (m_Bound.m_DepthCompareOp == depthCompareOp)
+		return;
+
+	setDepthCompareOpEXT(depthCompareOp);
+	m_Bound.m_DepthCompareOp = depthCompareOp;
+}
+
+void IVulkanCommandBuffer::SetStencilTestEnable(bool stencilTestEnable)
+{
+	if (m_Bound.m_StencilTestEnable == stencilTestEnable)
+		return;
+
+	setStencilTestEnableEXT(stencilTestEnable);
+	m_Bound.m_StencilTestEnable = stencilTestEnable;
+}
+
+void IVulkanCommandBuffer::SetStencilOp(vk::StencilOp failOp, vk::StencilOp passOp, vk::StencilOp depthFailOp,
+	vk::CompareOp compareOp)
+{
+	const auto ops = std::make_tuple(failOp, passOp, depthFailOp, compareOp);
+	if (m_Bound.m_StencilOp == ops)
+		return;
+
+	setStencilOpEXT(STENCIL_FACES, failOp, passOp, depthFailOp, compareOp);
+	m_Bound.m_StencilOp = ops;
+}
+
+auto IVulkanCommandBuffer::GetBindStats() -> BindStats
+{
+	BindStats retVal;
+	retVal.m_Pipelines = s_BindStats.m_Pipelines.Get();
+	retVal.m_DescriptorSets = s_BindStats.m_DescriptorSets.Get();
+	retVal.m_VertexBuffers = s_BindStats.m_VertexBuffers.Get();
+	retVal.m_IndexBuffers = s_BindStats.m_IndexBuffers.Get();
+	return retVal;
+}
+
 void IVulkanCommandBuffer::InsertDebugLabel(const Color& color, const char* text)
 {
 	insertDebugUtilsLabelEXT(InitDebugUtilsLabel(text, color));
@@ -226,7 +612,7 @@ bool IVulkanCommandBuffer::IsRenderPassActive(const vk::RenderPassBeginInfo& beg
 	for (uint32_t i = 0; i < beginInfo.clearValueCount; i++)
 	{
 		const auto& a = beginInfo.pClearValues[i];
-		const auto& b = activeRP.m_BeginInfo.pClearValues[i];
+		const auto& b = activeRP.m_ClearValues[i];
 		if (!IsEqual(a, b, ClearValueType::Float))
 			return false;
 	}
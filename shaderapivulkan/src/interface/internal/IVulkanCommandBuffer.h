@@ -1,11 +1,15 @@
 #pragma once
 
 #include "TF2Vulkan/PixScope.h"
-#include "TF2Vulkan/ResourceBlob.h"
+
+#include <TF2Vulkan/Util/InPlaceVector.h>
 
 #include <Color.h>
 
+#include <array>
 #include <optional>
+#include <tuple>
+#include <vector>
 
 namespace TF2Vulkan
 {
@@ -18,7 +22,7 @@ namespace TF2Vulkan
 	static constexpr Color PIX_COLOR_READ(230, 159, 0);
 	static constexpr Color PIX_COLOR_WRITE(86, 180, 233);
 
-	class IVulkanCommandBuffer : public ResourceBlob
+	class IVulkanCommandBuffer
 	{
 	public:
 		virtual ~IVulkanCommandBuffer() = default;
@@ -34,8 +38,9 @@ namespace TF2Vulkan
 
 		struct ActiveRenderPass final
 		{
-			vk::RenderPassBeginInfo m_BeginInfo;
+			vk::RenderPassBeginInfo m_BeginInfo; // pClearValues is not kept, see m_ClearValues
 			vk::SubpassContents m_Contents;
+			Util::InPlaceVector<vk::ClearValue, 8> m_ClearValues;
 		};
 		const ActiveRenderPass* GetActiveRenderPass() const;
 		bool IsRenderPassActive(const vk::RenderPassBeginInfo& beginInfo, const vk::SubpassContents& contents) const;
@@ -48,6 +53,47 @@ namespace TF2Vulkan
 
 		void CopyBufferToImage(const vk::Buffer& buffer, const vk::Image& image, const vk::Extent2D& size, uint32_t sliceOffset);
 
+		// Queued barriers are recorded together as a single vkCmdPipelineBarrier right
+		// before the next command that could depend on them (render pass begin, copy,
+		// explicit pipelineBarrier or end). Can't be used inside a render pass.
+		void QueueImageBarrier(const vk::PipelineStageFlags& srcStageMask, const vk::PipelineStageFlags& dstStageMask,
+			const vk::ImageMemoryBarrier& barrier);
+		void QueueMemoryBarrier(const vk::PipelineStageFlags& srcStageMask, const vk::PipelineStageFlags& dstStageMask,
+			const vk::MemoryBarrier& barrier);
+		void QueueBufferBarrier(const vk::PipelineStageFlags& srcStageMask, const vk::PipelineStageFlags& dstStageMask,
+			const vk::BufferMemoryBarrier& barrier);
+		void FlushBarriers();
+
+		// Only record the command if it differs from what's already set on this command buffer
+		void SetViewport(const vk::Viewport& viewport);
+		void SetScissor(const vk::Rect2D& scissor);
+		void SetStencilReference(uint32_t reference);
+		void SetStencilCompareMask(uint32_t compareMask);
+		void SetStencilWriteMask(uint32_t writeMask);
+		void SetCullMode(const vk::CullModeFlags& cullMode);
+		void SetDepthTestEnable(bool depthTestEnable);
+		void SetDepthWriteEnable(bool depthWriteEnable);
+		void SetDepthCompareOp(vk::CompareOp depthCompareOp);
+		void SetStencilTestEnable(bool stencilTestEnable);
+		void SetStencilOp(vk::StencilOp failOp, vk::StencilOp passOp, vk::StencilOp depthFailOp, vk::CompareOp compareOp);
+
+		// Totals across all command buffers. bind*() calls that wouldn't change
+		// anything are dropped before they reach the driver.
+		struct BindStats final
+		{
+			struct Counter final
+			{
+				uint64_t m_Issued = 0;
+				uint64_t m_Elided = 0;
+			};
+
+			Counter m_Pipelines;
+			Counter m_DescriptorSets;
+			Counter m_VertexBuffers;
+			Counter m_IndexBuffers;
+		};
+		static BindStats GetBindStats();
+
 #pragma region VkCommandBuffer Functionality
 
 		void insertDebugUtilsLabelEXT(const vk::DebugUtilsLabelEXT& labelInfo);
@@ -65,6 +111,8 @@ namespace TF2Vulkan
 		void bindIndexBuffer(const vk::Buffer& buffer, const vk::DeviceSize& offset, const vk::IndexType& indexType);
 		void bindVertexBuffers(uint32_t firstBinding, const vk::ArrayProxy<const vk::Buffer>& buffers,
 			const vk::ArrayProxy<const vk::DeviceSize>& offsets);
+		void copyBuffer(const vk::Buffer& srcBuf, const vk::Buffer& dstBuf,
+			const vk::ArrayProxy<const vk::BufferCopy>& regions);
 		void copyBufferToImage(const vk::Buffer& buf, const vk::Image& img, const vk::ImageLayout& dstImageLayout,
 			const vk::ArrayProxy<const vk::BufferImageCopy>& regions);
 		void clearAttachments(uint32_t attachmentCount, const vk::ClearAttachment* pAttachments,
@@ -74,6 +122,21 @@ namespace TF2Vulkan
 		void drawIndexed(uint32_t indexCount, uint32_t instanceCount = 1, uint32_t firstIndex = 0,
 			int32_t vertexOffset = 0, uint32_t firstInstance = 0);
 		void endRenderPass();
+		void setViewport(uint32_t firstViewport, const vk::ArrayProxy<const vk::Viewport>& viewports);
+		void setScissor(uint32_t firstScissor, const vk::ArrayProxy<const vk::Rect2D>& scissors);
+		void setStencilCompareMask(const vk::StencilFaceFlags& faceMask, uint32_t compareMask);
+		void setStencilWriteMask(const vk::StencilFaceFlags& faceMask, uint32_t writeMask);
+		void setStencilReference(const vk::StencilFaceFlags& faceMask, uint32_t reference);
+
+		// VK_EXT_extended_dynamic_state
+		void setCullModeEXT(const vk::CullModeFlags& cullMode);
+		void setDepthTestEnableEXT(bool depthTestEnable);
+		void setDepthWriteEnableEXT(bool depthWriteEnable);
+		void setDepthCompareOpEXT(const vk::CompareOp& depthCompareOp);
+		void setStencilTestEnableEXT(bool stencilTestEnable);
+		void setStencilOpEXT(const vk::StencilFaceFlags& faceMask, const vk::StencilOp& failOp,
+			const vk::StencilOp& passOp, const vk::StencilOp& depthFailOp, const vk::CompareOp& compareOp);
+
 		void pipelineBarrier(const vk::PipelineStageFlags& srcStageMask, const vk::PipelineStageFlags& dstStageMask,
 			const vk::DependencyFlags& dependencyFlags, const vk::ArrayProxy<const vk::MemoryBarrier>& memoryBarriers,
 			const vk::ArrayProxy<const vk::BufferMemoryBarrier>& bufferMemoryBarriers,
@@ -88,6 +151,52 @@ namespace TF2Vulkan
 		bool m_IsActive = false; // Is inside begin()..end()
 		std::optional<ActiveRenderPass> m_ActiveRenderPass;
 		int m_DebugScopeCount = 0;
+
+		// Dynamic state doesn't carry over between command buffers, reset by begin()
+		std::optional<vk::Viewport> m_Viewport;
+		std::optional<vk::Rect2D> m_Scissor;
+
+		struct PendingBarriers final
+		{
+			vk::PipelineStageFlags m_SrcStageMask;
+			vk::PipelineStageFlags m_DstStageMask;
+			std::vector<vk::ImageMemoryBarrier> m_ImageBarriers;
+			std::vector<vk::BufferMemoryBarrier> m_BufferBarriers;
+			vk::MemoryBarrier m_MemoryBarrier;
+			bool m_HasMemoryBarrier = false;
+		} m_PendingBarriers;
+
+		// Currently bound objects, reset by begin(). Only graphics bind points are tracked.
+		struct BoundState final
+		{
+			vk::Pipeline m_Pipeline;
+
+			vk::PipelineLayout m_DescriptorLayout; // null if the bound sets aren't known
+			uint32_t m_FirstDescriptorSet = 0;
+			Util::InPlaceVector<vk::DescriptorSet, 8> m_DescriptorSets;
+			Util::InPlaceVector<uint32_t, 32> m_DynamicOffsets;
+
+			static constexpr uint32_t MAX_VERTEX_BUFFERS = 16;
+			std::array<vk::Buffer, MAX_VERTEX_BUFFERS> m_VertexBuffers{};
+			std::array<vk::DeviceSize, MAX_VERTEX_BUFFERS> m_VertexBufferOffsets{};
+
+			vk::Buffer m_IndexBuffer;
+			vk::DeviceSize m_IndexBufferOffset = 0;
+			vk::IndexType m_IndexType = vk::IndexType::eUint16;
+
+			// Dynamic depth/stencil state. Every graphics pipeline declares the same
+			// dynamic states, so binding a new pipeline doesn't invalidate these.
+			// Stencil state is always set for both faces at once.
+			std::optional<uint32_t> m_StencilReference;
+			std::optional<uint32_t> m_StencilCompareMask;
+			std::optional<uint32_t> m_StencilWriteMask;
+			std::optional<vk::CullModeFlags> m_CullMode;
+			std::optional<bool> m_DepthTestEnable;
+			std::optional<bool> m_DepthWriteEnable;
+			std::optional<vk::CompareOp> m_DepthCompareOp;
+			std::optional<bool> m_StencilTestEnable;
+			std::optional<std::tuple<vk::StencilOp, vk::StencilOp, vk::StencilOp, vk::CompareOp>> m_StencilOp;
+		} m_Bound;
 	};
 
 	template<typename ...TArgs>
@@ -13,6 +13,7 @@ namespace TF2Vulkan
 		virtual const vk::Device& GetDevice() const = 0;
 		virtual const vk::Queue& GetQueue() const = 0;
 		virtual const vk::CommandPool& GetCmdPool() const = 0;
+		virtual uint32_t GetQueueFamily() const = 0;
 
 		[[nodiscard]] std::unique_ptr<IVulkanCommandBuffer> CreateCmdBuffer();
 		[[nodiscard]] std::unique_ptr<IVulkanCommandBuffer> CreateCmdBufferAndBegin(